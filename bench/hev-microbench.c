@@ -0,0 +1,1037 @@
+/*
+ ============================================================================
+ Name        : hev-microbench.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Microbenchmarks for parsers, DNS codec, ring buffer I/O,
+               event dispatch, wakeup latency and socket tuning
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* the benchmarked functions are static, pull in their translation units */
+#include "hev-socks5-session.c"
+#include "hev-dns-resolver.c"
+
+typedef void (*HevBenchFunc) (void *data);
+
+extern void * __libc_malloc (size_t size);
+extern void * __libc_calloc (size_t nmemb, size_t size);
+extern void * __libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+extern uint64_t hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_MAX];
+
+static unsigned long long alloc_count;
+
+void *
+malloc (size_t size)
+{
+	alloc_count ++;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	alloc_count ++;
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	alloc_count ++;
+	return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+	__libc_free (ptr);
+}
+
+static uint64_t
+bench_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_run (const char *name, HevBenchFunc func, void *data, unsigned int iterations)
+{
+	unsigned long long allocs = 0;
+	uint64_t begin = 0, end = 0;
+	unsigned int i = 0;
+
+	for (i=0; i<(iterations / 10); i++)
+	  func (data);
+
+	allocs = alloc_count;
+	begin = bench_clock ();
+	for (i=0; i<iterations; i++)
+	  func (data);
+	end = bench_clock ();
+	allocs = alloc_count - allocs;
+
+	printf ("%-40s %10.1f ns/op %8.2f allocs/op\n", name,
+				(double) (end - begin) / iterations, (double) allocs / iterations);
+}
+
+static void
+ring_buffer_fill (HevRingBuffer *buffer, const uint8_t *data, size_t len)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = 0, size = 0;
+
+	iovec_len = hev_ring_buffer_writing (buffer, iovec);
+	size = iovec[0].iov_len < len ? iovec[0].iov_len : len;
+	memcpy (iovec[0].iov_base, data, size);
+	if ((1 < iovec_len) && (size < len))
+	  memcpy (iovec[1].iov_base, data + size, len - size);
+	hev_ring_buffer_write_finish (buffer, len);
+}
+
+static void
+ring_buffer_drain (HevRingBuffer *buffer)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = 0;
+
+	iovec_len = hev_ring_buffer_reading (buffer, iovec);
+	hev_ring_buffer_read_finish (buffer, iovec_size (iovec, iovec_len));
+}
+
+static HevSocks5Session *
+bench_session_new (const uint8_t *data, size_t len)
+{
+	HevSocks5Session *session = NULL;
+
+	session = hev_socks5_session_new (open ("/dev/null", O_RDWR), NULL, NULL);
+	ring_buffer_fill (session->forward_buffer, data, len);
+
+	return session;
+}
+
+static void
+bench_read_auth_method (void *data)
+{
+	HevSocks5Session *session = data;
+
+	session->roffset = 0;
+	session->step = STEP_READ_AUTH_METHOD;
+	socks5_read_auth_method (session);
+	ring_buffer_drain (session->backward_buffer);
+}
+
+static void
+bench_read_request (void *data)
+{
+	HevSocks5Session *session = data;
+
+	session->roffset = 3;
+	session->step = STEP_READ_REQUEST;
+	socks5_read_request (session);
+}
+
+static void
+bench_parse_addr_domain (void *data)
+{
+	HevSocks5Session *session = data;
+
+	session->roffset = 7;
+	session->step = STEP_PARSE_ADDR_DOMAIN;
+	socks5_parse_addr_domain (session);
+}
+
+#define BENCH_HOSTS	100000
+
+/* a map the size of a large internal zone, plus the benchmarked name */
+static HevSocks5Hosts *
+bench_hosts_new (void)
+{
+	HevSocks5Hosts *hosts = NULL;
+	char path[] = "/tmp/hev-microbench-hosts-XXXXXX";
+	unsigned int i = 0;
+	FILE *fp = NULL;
+	int fd = -1;
+
+	fd = mkstemp (path);
+	if (0 > fd)
+	  return NULL;
+	fp = fdopen (fd, "w");
+	for (i=0; i<BENCH_HOSTS; i++)
+	  fprintf (fp, "10.%u.%u.%u node%u.internal\n", (i >> 16) & 0xff,
+				  (i >> 8) & 0xff, i & 0xff, i);
+	fprintf (fp, "203.0.113.10 db.internal\n");
+	fclose (fp);
+	hosts = hev_socks5_hosts_new (path);
+	unlink (path);
+
+	return hosts;
+}
+
+static void
+bench_dns_query_encode (void *data)
+{
+	uint8_t buffer[2048];
+
+	dns_query_encode (buffer, data);
+	__asm__ volatile ("" : : "r" (buffer) : "memory");
+}
+
+typedef struct _HevBenchDNSAnswer HevBenchDNSAnswer;
+
+struct _HevBenchDNSAnswer
+{
+	size_t size;
+	uint8_t packet[512];
+};
+
+static void
+bench_dns_answer_parse (void *data)
+{
+	HevBenchDNSAnswer *answer = data;
+	uint8_t buffer[512];
+	unsigned int addrs[8];
+	volatile unsigned int count = 0;
+
+	/* the walker byte-swaps the header in place, parse a fresh copy */
+	memcpy (buffer, answer->packet, answer->size);
+	count = dns_answer_parse (buffer, answer->size, addrs, 8);
+	(void) count;
+}
+
+static void
+dns_answer_build (HevBenchDNSAnswer *answer)
+{
+	static const uint8_t cname[] =
+	{
+		/* www.example.com CNAME edge.example.net, name compressed */
+		0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x12,
+		0x04, 'e', 'd', 'g', 'e', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		0x03, 'n', 'e', 't', 0x00,
+	};
+	static const uint8_t a[] =
+	{
+		/* edge.example.net A, name points into the CNAME rdata */
+		0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+	};
+	HevDNSHeader *header = (HevDNSHeader *) answer->packet;
+	size_t i = 0;
+
+	answer->size = dns_query_encode (answer->packet, "www.example.com");
+	header->qr = 1;
+	header->ra = 1;
+	header->ancount = htons (3);
+	memcpy (&answer->packet[answer->size], cname, sizeof (cname));
+	answer->size += sizeof (cname);
+	for (i=0; i<2; i++) {
+		memcpy (&answer->packet[answer->size], a, sizeof (a));
+		answer->size += sizeof (a);
+		answer->packet[answer->size++] = 192;
+		answer->packet[answer->size++] = 0;
+		answer->packet[answer->size++] = 2;
+		answer->packet[answer->size++] = 10 + i;
+	}
+}
+
+typedef struct _HevBenchRingIO HevBenchRingIO;
+
+struct _HevBenchRingIO
+{
+	int fds[2];
+	size_t chunk;
+	HevRingBuffer *buffer;
+	uint8_t data[2000];
+};
+
+static void
+bench_ring_io (void *data)
+{
+	HevBenchRingIO *io = data;
+	uint8_t sink[2000];
+
+	/* peer -> read_data -> ring -> write_data -> peer */
+	send (io->fds[1], io->data, io->chunk, 0);
+	read_data (io->fds[0], io->buffer);
+	write_data (io->fds[0], io->buffer);
+	recv (io->fds[1], sink, sizeof (sink), 0);
+}
+
+static void
+bench_ring_io_init (HevBenchRingIO *io, size_t offset, size_t chunk)
+{
+	socketpair (AF_UNIX, SOCK_STREAM, 0, io->fds);
+	io->chunk = chunk;
+	io->buffer = hev_ring_buffer_new (2000);
+	memset (io->data, 0x5a, sizeof (io->data));
+	/* move the ring position so every chunk is split across the boundary */
+	hev_ring_buffer_write_finish (io->buffer, offset);
+	hev_ring_buffer_read_finish (io->buffer, offset);
+}
+
+#define BENCH_PAIRS	64
+#define BENCH_EVENTS	1000000
+#define BENCH_RUNS	7	/* median of, single runs vary by 20% or more */
+
+typedef struct _HevBenchDispatch HevBenchDispatch;
+typedef struct _HevBenchPair HevBenchPair;
+
+struct _HevBenchPair
+{
+	int fds[2];
+	HevBenchDispatch *bench;
+};
+
+struct _HevBenchDispatch
+{
+	unsigned int events;
+	HevEventLoop *loop;
+	HevBenchPair pairs[BENCH_PAIRS];
+};
+
+static void
+bench_pair_event (HevBenchPair *pair)
+{
+	uint8_t byte = 0;
+
+	/* consume one byte and send the next, one readiness edge per event */
+	if (1 == read (pair->fds[0], &byte, 1))
+	  write (pair->fds[1], &byte, 1);
+	if (BENCH_EVENTS <= ++ pair->bench->events)
+	  hev_event_loop_quit (pair->bench->loop);
+}
+
+static bool
+bench_source_handler (HevEventSourceFD *fd, void *data)
+{
+	fd->revents &= ~EPOLLIN;
+	bench_pair_event (data);
+
+	return true;
+}
+
+static void
+bench_dispatch_handler (void *data, uint32_t events)
+{
+	bench_pair_event (data);
+}
+
+static double
+bench_dispatch_once (bool direct)
+{
+	HevBenchDispatch bench;
+	HevSocks5Dispatch *dispatch = NULL;
+	HevEventSource *sources[BENCH_PAIRS];
+	uint64_t begin = 0, end = 0;
+	unsigned int i = 0;
+	int nonblock = 1;
+
+	bench.events = 0;
+	bench.loop = hev_event_loop_new ();
+	if (direct)
+	  dispatch = hev_socks5_dispatch_new (bench.loop, bench_dispatch_handler);
+	for (i=0; i<BENCH_PAIRS; i++) {
+		HevBenchPair *pair = &bench.pairs[i];
+
+		socketpair (AF_UNIX, SOCK_STREAM, 0, pair->fds);
+		ioctl (pair->fds[0], FIONBIO, (char *) &nonblock);
+		pair->bench = &bench;
+		if (direct) {
+			hev_socks5_dispatch_add (dispatch, pair->fds[0], EPOLLIN | EPOLLET, pair);
+		} else {
+			/* one source per fd, the way sessions register them */
+			sources[i] = hev_event_source_fds_new ();
+			hev_event_source_add_fd (sources[i], pair->fds[0], EPOLLIN | EPOLLET);
+			hev_event_source_set_callback (sources[i],
+						(HevEventSourceFunc) bench_source_handler, pair, NULL);
+			hev_event_loop_add_source (bench.loop, sources[i]);
+		}
+		write (pair->fds[1], "x", 1);
+	}
+
+	begin = bench_clock ();
+	hev_event_loop_run (bench.loop);
+	end = bench_clock ();
+
+	for (i=0; i<BENCH_PAIRS; i++) {
+		if (!direct) {
+			hev_event_loop_del_source (bench.loop, sources[i]);
+			hev_event_source_unref (sources[i]);
+		}
+		close (bench.pairs[i].fds[0]);
+		close (bench.pairs[i].fds[1]);
+	}
+	hev_socks5_dispatch_unref (dispatch);
+	hev_event_loop_unref (bench.loop);
+
+	return bench.events * 1000000000.0 / (end - begin);
+}
+
+static int
+bench_rate_compare (const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void
+bench_dispatch (const char *name, bool direct)
+{
+	double rates[BENCH_RUNS];
+	unsigned int i = 0;
+
+	for (i=0; i<BENCH_RUNS; i++)
+	  rates[i] = bench_dispatch_once (direct);
+	qsort (rates, BENCH_RUNS, sizeof (double), bench_rate_compare);
+	printf ("%-40s %10.0f events/s median of %u (%.0f-%.0f)\n", name,
+				rates[BENCH_RUNS / 2], BENCH_RUNS, rates[0], rates[BENCH_RUNS - 1]);
+}
+
+/* a relay the budget holds back under direct dispatch hands the loop
+ * back, the held read must not keep the pass going */
+static bool
+budget_direct_check (void)
+{
+	static uint8_t fill[65536];
+	uint8_t carried[sizeof (HevSocks5SessionState) + RING_SIZE / 2];
+	HevSocks5SessionState state;
+	HevEventLoop *loop = NULL;
+	HevSocks5Dispatch *dispatch = NULL;
+	HevSocks5Session *session = NULL;
+	int cfds[2], rfds[2];
+	int nonblock = 1, sndbuf = 4096;
+	bool held = false;
+
+	loop = hev_event_loop_new ();
+	dispatch = hev_socks5_dispatch_new (loop, hev_socks5_session_dispatch);
+	socketpair (AF_UNIX, SOCK_STREAM, 0, cfds);
+	socketpair (AF_UNIX, SOCK_STREAM, 0, rfds);
+	ioctl (cfds[0], FIONBIO, (char *) &nonblock);
+	ioctl (rfds[0], FIONBIO, (char *) &nonblock);
+	/* the remote takes nothing, half a ring stays queued for it */
+	setsockopt (rfds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+	while (0 < write (rfds[0], fill, sizeof (fill)));
+	write (cfds[1], "x", 1);
+
+	memset (&state, 0, sizeof (state));
+	memset (carried, 0, sizeof (carried));
+	state.egress_index = -1;
+	state.forward_len = RING_SIZE / 2;
+	memcpy (carried, &state, sizeof (state));
+	session = hev_socks5_session_new (cfds[0], NULL, NULL);
+	hev_socks5_session_set_dispatch (session, dispatch);
+	if (hev_socks5_session_import (session, rfds[0], carried, sizeof (carried))) {
+		/* tight from the first pass, a spin ends with the alarm */
+		hev_socks5_budget_set_limit (1);
+		hev_socks5_budget_adjust (1);
+		alarm (5);
+		hev_socks5_session_dispatch (session, EPOLLIN);
+		alarm (0);
+		held = (CLIENT_IN & session->throttled) && !(CLIENT_IN & session->revents) &&
+			!(EPOLLIN & session->client_fd->revents);
+	} else {
+		close (rfds[0]);
+	}
+
+	hev_socks5_session_unref (session);
+	memset (&hev_socks5_budget, 0, sizeof (hev_socks5_budget));
+	close (cfds[1]);
+	close (rfds[1]);
+	hev_socks5_dispatch_unref (dispatch);
+	hev_event_loop_unref (loop);
+
+	return held;
+}
+
+static int
+bench_ns_compare (const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+#define BENCH_CLASS_PAIRS	64
+#define BENCH_CLASS_EVENTS	1000000	/* enough interactive waits for a steady p99 */
+#define BENCH_CLASS_EVERY	16	/* one interactive pair among this many */
+#define BENCH_CLASS_WORK	16384	/* bytes a bulk relay pass copies */
+
+typedef struct _HevBenchClasses HevBenchClasses;
+typedef struct _HevBenchClassPair HevBenchClassPair;
+
+struct _HevBenchClassPair
+{
+	int fds[2];
+	bool interactive;
+	uint64_t sent;
+	HevBenchClasses *bench;
+};
+
+struct _HevBenchClasses
+{
+	unsigned int events;
+	unsigned int pending;
+	unsigned long long waits;
+	uint64_t wait_total;
+	uint64_t *wait_list;
+	HevEventLoop *loop;
+	HevBenchClassPair pairs[BENCH_CLASS_PAIRS];
+};
+
+/* every relay gets data at once, the next round starts when all of
+ * them have been served */
+static void
+bench_class_round (HevBenchClasses *bench)
+{
+	unsigned int i = 0;
+
+	bench->pending = BENCH_CLASS_PAIRS;
+	for (i=0; i<BENCH_CLASS_PAIRS; i++) {
+		bench->pairs[i].sent = bench_clock ();
+		write (bench->pairs[i].fds[1], "x", 1);
+	}
+}
+
+static bool
+bench_class_handler (HevEventSourceFD *fd, void *data)
+{
+	static uint8_t src[BENCH_CLASS_WORK], dst[BENCH_CLASS_WORK];
+	HevBenchClassPair *pair = data;
+	HevBenchClasses *bench = pair->bench;
+	uint8_t byte = 0;
+
+	fd->revents &= ~EPOLLIN;
+	if (1 != read (pair->fds[0], &byte, 1))
+	  return true;
+	/* an interactive relay waits for every source dispatched before it */
+	if (pair->interactive) {
+		uint64_t wait = bench_clock () - pair->sent;
+
+		bench->wait_total += wait;
+		bench->wait_list[bench->waits ++] = wait;
+	} else {
+		memcpy (dst, src, sizeof (dst));
+		__asm__ __volatile__ ("" : : "r" (dst) : "memory");
+	}
+	if (BENCH_CLASS_EVENTS <= ++ bench->events)
+	  hev_event_loop_quit (bench->loop);
+	else if (0 == -- bench->pending)
+	  bench_class_round (bench);
+
+	return true;
+}
+
+static void
+bench_classes (const char *name, bool classes)
+{
+	HevBenchClasses bench;
+	HevEventSource *sources[BENCH_CLASS_PAIRS];
+	unsigned int i = 0;
+	int nonblock = 1;
+
+	memset (&bench, 0, sizeof (bench));
+	bench.wait_list = malloc (BENCH_CLASS_EVENTS * sizeof (uint64_t));
+	bench.loop = hev_event_loop_new ();
+	for (i=0; i<BENCH_CLASS_PAIRS; i++) {
+		HevBenchClassPair *pair = &bench.pairs[i];
+		HevSocks5Class class = HEV_SOCKS5_CLASS_DEFAULT;
+
+		socketpair (AF_UNIX, SOCK_STREAM, 0, pair->fds);
+		ioctl (pair->fds[0], FIONBIO, (char *) &nonblock);
+		pair->bench = &bench;
+		/* spread among the bulk relays, the way sessions arrive */
+		pair->interactive = (BENCH_CLASS_EVERY - 1) == (i % BENCH_CLASS_EVERY);
+		if (classes)
+		  class = pair->interactive ? HEV_SOCKS5_CLASS_INTERACTIVE : HEV_SOCKS5_CLASS_BULK;
+		sources[i] = hev_event_source_fds_new ();
+		hev_event_source_set_priority (sources[i], hev_socks5_class_priority (class));
+		hev_event_source_add_fd (sources[i], pair->fds[0], EPOLLIN | EPOLLET);
+		hev_event_source_set_callback (sources[i],
+					(HevEventSourceFunc) bench_class_handler, pair, NULL);
+		hev_event_loop_add_source (bench.loop, sources[i]);
+	}
+
+	bench_class_round (&bench);
+	hev_event_loop_run (bench.loop);
+	/* the tail, a single max swings with whatever else the host runs */
+	qsort (bench.wait_list, bench.waits, sizeof (uint64_t), bench_ns_compare);
+	printf ("%-40s %8llu ns avg %8llu ns p99 %8llu ns p99.9 %8llu ns max interactive wait\n",
+				name, (unsigned long long) (bench.wait_total / bench.waits),
+				(unsigned long long) bench.wait_list[bench.waits * 99 / 100],
+				(unsigned long long) bench.wait_list[bench.waits * 999 / 1000],
+				(unsigned long long) bench.wait_list[bench.waits - 1]);
+	free (bench.wait_list);
+
+	for (i=0; i<BENCH_CLASS_PAIRS; i++) {
+		hev_event_loop_del_source (bench.loop, sources[i]);
+		hev_event_source_unref (sources[i]);
+		close (bench.pairs[i].fds[0]);
+		close (bench.pairs[i].fds[1]);
+	}
+	hev_event_loop_unref (bench.loop);
+}
+
+#define BENCH_PINGS	5000
+#define BENCH_PING_GAP	100	/* microseconds between pings */
+
+/* the client side, a request and then a pause, the way an interactive
+ * session sends keystrokes */
+static void
+bench_pinger (int fd, int result_fd)
+{
+	static uint64_t lats[BENCH_PINGS];
+	uint64_t result[2] = { 0, 0 };
+	unsigned int i = 0;
+	uint8_t byte = 0;
+
+	for (i=0; i<BENCH_PINGS; i++) {
+		uint64_t begin = bench_clock ();
+
+		if ((1 != write (fd, "x", 1)) || (1 != read (fd, &byte, 1)))
+		  break;
+		lats[i] = bench_clock () - begin;
+		result[0] += lats[i];
+		usleep (BENCH_PING_GAP);
+	}
+	if (i) {
+		qsort (lats, i, sizeof (uint64_t), bench_ns_compare);
+		result[0] /= i;
+		result[1] = lats[i * 99 / 100];
+	}
+	write (result_fd, result, sizeof (result));
+}
+
+static bool
+bench_pong_handler (HevEventSourceFD *fd, void *data)
+{
+	HevEventLoop *loop = data;
+	uint8_t byte = 0;
+	ssize_t size = 0;
+
+	hev_socks5_busypoll_kick ();
+	size = read (fd->fd, &byte, 1);
+	if (0 > size) {
+		fd->revents &= ~EPOLLIN;
+		return true;
+	}
+	if ((0 == size) || (1 != write (fd->fd, &byte, 1)))
+	  hev_event_loop_quit (loop);
+
+	return true;
+}
+
+static uint64_t
+bench_cpu_time (void)
+{
+	struct rusage usage;
+
+	getrusage (RUSAGE_SELF, &usage);
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void
+bench_busypoll (const char *name, bool busy)
+{
+	HevEventLoop *loop = NULL;
+	HevEventSource *source = NULL;
+	uint64_t result[2] = { 0, 0 };
+	uint64_t wall = 0, cpu = 0;
+	int fds[2], results[2];
+	int nonblock = 1;
+	pid_t pid = 0;
+
+	loop = hev_event_loop_new ();
+	if (busy) {
+		hev_socks5_busypoll_start (loop, 50, 500);
+		/* the spin stays off without a spare CPU, nothing to compare */
+		if (!hev_socks5_busypoll.enabled) {
+			printf ("%-40s skipped (single CPU)\n", name);
+			hev_socks5_busypoll_stop (loop);
+			hev_event_loop_unref (loop);
+			return;
+		}
+	}
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+	pipe (results);
+	pid = fork ();
+	if (0 == pid) {
+		close (fds[0]);
+		bench_pinger (fds[1], results[1]);
+		_exit (0);
+	}
+	close (fds[1]);
+	close (results[1]);
+
+	ioctl (fds[0], FIONBIO, (char *) &nonblock);
+	source = hev_event_source_fds_new ();
+	hev_event_source_add_fd (source, fds[0], EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (source,
+				(HevEventSourceFunc) bench_pong_handler, loop, NULL);
+	hev_event_loop_add_source (loop, source);
+
+	wall = bench_clock ();
+	cpu = bench_cpu_time ();
+	hev_event_loop_run (loop);
+	wall = bench_clock () - wall;
+	cpu = bench_cpu_time () - cpu;
+	waitpid (pid, NULL, 0);
+	read (results[0], result, sizeof (result));
+	printf ("%-40s %10llu ns avg %10llu ns p99 %5.1f%% loop cpu\n", name,
+				(unsigned long long) result[0], (unsigned long long) result[1],
+				cpu * 100.0 / wall);
+
+	hev_socks5_busypoll_stop (loop);
+	hev_event_loop_del_source (loop, source);
+	hev_event_source_unref (source);
+	hev_event_loop_unref (loop);
+	close (fds[0]);
+	close (results[0]);
+}
+
+#define BENCH_RELAY_BYTES	(64 << 20)
+
+typedef struct _HevBenchRelay HevBenchRelay;
+
+struct _HevBenchRelay
+{
+	uint64_t received;
+	HevEventLoop *loop;
+};
+
+/* the remote floods, the client reads everything it gets */
+static bool
+bench_relay_send_handler (HevEventSourceFD *fd, void *data)
+{
+	static const uint8_t chunk[65536];
+
+	if (0 > write (fd->fd, chunk, sizeof (chunk)))
+	  fd->revents &= ~EPOLLOUT;
+
+	return true;
+}
+
+static bool
+bench_relay_receive_handler (HevEventSourceFD *fd, void *data)
+{
+	static uint8_t buf[65536];
+	HevBenchRelay *relay = data;
+	ssize_t size = read (fd->fd, buf, sizeof (buf));
+
+	if (0 >= size) {
+		fd->revents &= ~EPOLLIN;
+		return true;
+	}
+	relay->received += size;
+	if (BENCH_RELAY_BYTES <= relay->received)
+	  hev_event_loop_quit (relay->loop);
+
+	return true;
+}
+
+/* a bulk download through a session on the loop's own sources, where
+ * every interest change is a del and an add, two epoll_ctl calls */
+static void
+bench_relay (const char *name, unsigned int linger)
+{
+	uint8_t carried[sizeof (HevSocks5SessionState)];
+	HevSocks5SessionState state;
+	HevBenchRelay relay;
+	HevEventSource *sender = NULL, *receiver = NULL;
+	HevSocks5Session *session = NULL;
+	uint64_t wakeups = 0, changes = 0;
+	int cfds[2], rfds[2];
+	int nonblock = 1, sndbuf = 4096;
+	double mb = 0;
+
+	relay.received = 0;
+	relay.loop = hev_event_loop_new ();
+	socketpair (AF_UNIX, SOCK_STREAM, 0, cfds);
+	socketpair (AF_UNIX, SOCK_STREAM, 0, rfds);
+	ioctl (cfds[0], FIONBIO, (char *) &nonblock);
+	ioctl (cfds[1], FIONBIO, (char *) &nonblock);
+	ioctl (rfds[0], FIONBIO, (char *) &nonblock);
+	ioctl (rfds[1], FIONBIO, (char *) &nonblock);
+	/* a slow client, its writes block and drain on most passes */
+	setsockopt (cfds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+
+	memset (&state, 0, sizeof (state));
+	state.egress_index = -1;
+	memcpy (carried, &state, sizeof (state));
+	session = hev_socks5_session_new (cfds[0], NULL, NULL);
+	if (!hev_socks5_session_import (session, rfds[0], carried, sizeof (carried))) {
+		printf ("%-40s skipped (import failed)\n", name);
+		close (rfds[0]);
+		goto free;
+	}
+	hev_event_loop_add_source (relay.loop, hev_socks5_session_get_source (session));
+
+	sender = hev_event_source_fds_new ();
+	hev_event_source_add_fd (sender, rfds[1], EPOLLOUT | EPOLLET);
+	hev_event_source_set_callback (sender,
+				(HevEventSourceFunc) bench_relay_send_handler, &relay, NULL);
+	hev_event_loop_add_source (relay.loop, sender);
+	receiver = hev_event_source_fds_new ();
+	hev_event_source_add_fd (receiver, cfds[1], EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (receiver,
+				(HevEventSourceFunc) bench_relay_receive_handler, &relay, NULL);
+	hev_event_loop_add_source (relay.loop, receiver);
+
+	interest_linger = linger;
+	wakeups = hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_WAKEUPS];
+	changes = hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_INTEREST_CHANGES];
+	hev_event_loop_run (relay.loop);
+	wakeups = hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_WAKEUPS] - wakeups;
+	changes = hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_INTEREST_CHANGES] - changes;
+	interest_linger = INTEREST_LINGER;
+	mb = relay.received / 1048576.0;
+	printf ("%-40s %8.1f wakeups/MB %8.1f epoll_ctl/MB\n", name,
+				wakeups / mb, 2 * changes / mb);
+
+	hev_event_loop_del_source (relay.loop, sender);
+	hev_event_source_unref (sender);
+	hev_event_loop_del_source (relay.loop, receiver);
+	hev_event_source_unref (receiver);
+	hev_event_loop_del_source (relay.loop, hev_socks5_session_get_source (session));
+free:
+	hev_socks5_session_unref (session);
+	close (cfds[1]);
+	close (rfds[1]);
+	hev_event_loop_unref (relay.loop);
+}
+
+#define BENCH_TUNING_PINGS	200	/* a Nagle stall is tens of ms each */
+#define BENCH_TUNING_REPLY	64	/* bytes, answered in two writes */
+
+/* the client asks, then waits for the whole reply */
+static void
+bench_tuning_pinger (int fd, int result_fd)
+{
+	static uint64_t lats[BENCH_TUNING_PINGS];
+	uint8_t buf[BENCH_TUNING_REPLY];
+	uint64_t result[2] = { 0, 0 };
+	unsigned int i = 0;
+
+	for (i=0; i<BENCH_TUNING_PINGS; i++) {
+		uint64_t begin = bench_clock ();
+		size_t received = 0;
+
+		if (1 != write (fd, "x", 1))
+		  break;
+		while (BENCH_TUNING_REPLY > received) {
+			ssize_t size = read (fd, buf, sizeof (buf) - received);
+			if (0 >= size)
+			  break;
+			received += size;
+		}
+		if (BENCH_TUNING_REPLY > received)
+		  break;
+		lats[i] = bench_clock () - begin;
+		result[0] += lats[i];
+		usleep (BENCH_PING_GAP);
+	}
+	if (i) {
+		qsort (lats, i, sizeof (uint64_t), bench_ns_compare);
+		result[0] /= i;
+		result[1] = lats[i * 99 / 100];
+	}
+	write (result_fd, result, sizeof (result));
+}
+
+/* a relay forwards a reply the way it arrives, here a header and
+ * then the body, which is where Nagle holds the second write back */
+static bool
+bench_tuning_pong_handler (HevEventSourceFD *fd, void *data)
+{
+	static const uint8_t reply[BENCH_TUNING_REPLY];
+	HevEventLoop *loop = data;
+	uint8_t byte = 0;
+	ssize_t size = 0;
+
+	size = read (fd->fd, &byte, 1);
+	if (0 > size) {
+		fd->revents &= ~EPOLLIN;
+		return true;
+	}
+	if ((0 == size) || (8 != write (fd->fd, reply, 8)) ||
+				((BENCH_TUNING_REPLY - 8) != write (fd->fd, reply + 8,
+						BENCH_TUNING_REPLY - 8)))
+	  hev_event_loop_quit (loop);
+
+	return true;
+}
+
+static void
+bench_tuning (const char *name, const char *profile)
+{
+	const HevSocks5Tuning *tuning = NULL;
+	HevEventLoop *loop = NULL;
+	HevEventSource *source = NULL;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof (addr);
+	uint64_t result[2] = { 0, 0 };
+	int listen_fd = -1, fd = -1, results[2];
+	int nonblock = 1;
+	pid_t pid = 0;
+
+	if (profile)
+	  tuning = hev_socks5_tuning_lookup (profile);
+
+	/* loopback TCP, the options mean nothing on a unix socket */
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+	if ((0 > bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr))) ||
+				(0 > listen (listen_fd, 1)) ||
+				(0 > getsockname (listen_fd, (struct sockaddr *) &addr, &addr_len))) {
+		printf ("%-40s skipped (no loopback)\n", name);
+		close (listen_fd);
+		return;
+	}
+
+	pipe (results);
+	pid = fork ();
+	if (0 == pid) {
+		fd = socket (AF_INET, SOCK_STREAM, 0);
+		if (0 == connect (fd, (struct sockaddr *) &addr, sizeof (addr)))
+		  bench_tuning_pinger (fd, results[1]);
+		_exit (0);
+	}
+	close (results[1]);
+	fd = accept (listen_fd, NULL, NULL);
+	close (listen_fd);
+
+	/* the proxy side of the connection, where sessions apply it */
+	hev_socks5_tuning_apply (tuning, fd);
+	ioctl (fd, FIONBIO, (char *) &nonblock);
+	loop = hev_event_loop_new ();
+	source = hev_event_source_fds_new ();
+	hev_event_source_add_fd (source, fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (source,
+				(HevEventSourceFunc) bench_tuning_pong_handler, loop, NULL);
+	hev_event_loop_add_source (loop, source);
+	hev_event_loop_run (loop);
+	waitpid (pid, NULL, 0);
+	read (results[0], result, sizeof (result));
+	printf ("%-40s %10llu ns avg %10llu ns p99\n", name,
+				(unsigned long long) result[0], (unsigned long long) result[1]);
+
+	hev_event_loop_del_source (loop, source);
+	hev_event_source_unref (source);
+	hev_event_loop_unref (loop);
+	close (fd);
+	close (results[0]);
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t greeting[] = { 0x05, 0x02, 0x00, 0x02 };
+	static const uint8_t request[] =
+	{
+		0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x01, 203, 0, 113, 10, 0x01, 0xbb,
+	};
+	static const uint8_t request_domain[] =
+	{
+		0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x03, 12,
+		'2', '0', '3', '.', '0', '.', '1', '1', '3', '.', '1', '0', 0x01, 0xbb,
+	};
+	static const uint8_t request_hosts[] =
+	{
+		0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x03, 11,
+		'd', 'b', '.', 'i', 'n', 't', 'e', 'r', 'n', 'a', 'l', 0x01, 0xbb,
+	};
+	HevSocks5Hosts *hosts = NULL;
+	HevSocks5Session *session = NULL;
+	HevBenchDNSAnswer answer;
+	HevBenchRingIO io;
+	unsigned int addrs[8];
+
+	session = bench_session_new (greeting, sizeof (greeting));
+	bench_run ("socks5_read_auth_method", bench_read_auth_method, session, 1000000);
+	hev_socks5_session_unref (session);
+
+	session = bench_session_new (request, sizeof (request));
+	bench_run ("socks5_read_request", bench_read_request, session, 1000000);
+	hev_socks5_session_unref (session);
+
+	session = bench_session_new (request_domain, sizeof (request_domain));
+	bench_run ("socks5_parse_addr_domain (literal)", bench_parse_addr_domain, session, 1000000);
+	hev_socks5_session_unref (session);
+
+	hosts = bench_hosts_new ();
+	if (!hosts) {
+		fprintf (stderr, "Build host map failed!\n");
+		return 1;
+	}
+	session = bench_session_new (request_hosts, sizeof (request_hosts));
+	hev_socks5_session_set_hosts (session, hosts);
+	bench_parse_addr_domain (session);
+	if (htonl (0xcb00710a) != session->addr.sin_addr.s_addr) {
+		fprintf (stderr, "Host map returned a wrong address!\n");
+		return 1;
+	}
+	bench_run ("socks5_parse_addr_domain (host map)", bench_parse_addr_domain, session, 1000000);
+	hev_socks5_session_unref (session);
+	hev_socks5_hosts_unref (hosts);
+
+	bench_run ("dns_query_encode", bench_dns_query_encode, "www.example.com", 1000000);
+
+	dns_answer_build (&answer);
+	if ((2 != dns_answer_parse (answer.packet, answer.size, addrs, 8)) ||
+				(htonl (0xc000020a) != addrs[0]) || (htonl (0xc000020b) != addrs[1])) {
+		fprintf (stderr, "DNS answer walker returned wrong addresses!\n");
+		return 1;
+	}
+	dns_answer_build (&answer);
+	bench_run ("dns_answer_parse (cname + 2 a)", bench_dns_answer_parse, &answer, 1000000);
+
+	bench_ring_io_init (&io, 0, 1000);
+	bench_run ("read_data/write_data 1000B", bench_ring_io, &io, 100000);
+	hev_ring_buffer_unref (io.buffer);
+	close (io.fds[0]);
+	close (io.fds[1]);
+
+	bench_ring_io_init (&io, 1000, 2000);
+	bench_run ("read_data/write_data 2000B wrapped", bench_ring_io, &io, 100000);
+	hev_ring_buffer_unref (io.buffer);
+	close (io.fds[0]);
+	close (io.fds[1]);
+
+	bench_dispatch ("dispatch via event sources", false);
+	bench_dispatch ("dispatch via nested epoll", true);
+
+	bench_relay ("bulk relay, interest dropped at once", 1);
+	bench_relay ("bulk relay, interest lingers", INTEREST_LINGER);
+	if (!budget_direct_check ()) {
+		fprintf (stderr, "Direct relay held by the budget did not yield!\n");
+		return 1;
+	}
+
+	bench_classes ("relay classes, one priority", false);
+	bench_classes ("relay classes, interactive over bulk", true);
+
+	bench_busypoll ("ping-pong, loop sleeps", false);
+	bench_busypoll ("ping-pong, loop spins", true);
+
+	bench_tuning ("tcp ping-pong, no tuning", NULL);
+	bench_tuning ("tcp ping-pong, interactive profile", "interactive");
+	bench_tuning ("tcp ping-pong, bulk profile", "bulk");
+
+	return 0;
+}
+
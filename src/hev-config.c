@@ -0,0 +1,483 @@
+/*
+ ============================================================================
+ Name        : hev-config.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Config
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "hev-config.h"
+
+#define MAX_LISTENERS		16
+#define MAX_EGRESS_ADDRESSES	32
+#define MAX_PARENT_ROUTES	64
+#define MAX_CLASS_RULES		64
+
+static HevConfigListener listeners[MAX_LISTENERS];
+static unsigned int listener_count;
+static const char *auth_file;
+static const char *hosts_file;
+static const char *egress_addresses[MAX_EGRESS_ADDRESSES];
+static unsigned int egress_address_count;
+static const char *tuning_profile;
+static bool sockmap;
+static bool direct_dispatch;
+static bool negcache;
+static bool early_reply;
+static const char *control_path;
+static const char *handoff_path;
+static const char *parent_address;
+static unsigned int parent_port;
+static unsigned int parent_conns = 2;
+static const char *parent_secret;
+static const char *parent_routes[MAX_PARENT_ROUTES];
+static unsigned int parent_route_count;
+static const char *tunnel_address;
+static unsigned int tunnel_port;
+static const char *tunnel_secret;
+static const char *class_rules[MAX_CLASS_RULES];
+static unsigned int class_rule_count;
+static unsigned int connect_stagger = 250;
+static unsigned int sample_interval = 5000;
+static unsigned int slow_threshold;
+static uint64_t relay_budget;
+static unsigned int busy_poll;
+static unsigned int busy_spin = 500;
+static unsigned int deadline_auth = 10000;
+static unsigned int deadline_request = 10000;
+static unsigned int deadline_dns = 10000;
+static unsigned int deadline_connect = 15000;
+static unsigned int deadline_stall = 20000;
+static const char *accesslog;
+static size_t accesslog_rotate_size;
+static unsigned int accesslog_keep = 4;
+static bool accesslog_compress;
+
+/* ADDR:PORT[,tuning=NAME][,cert=PATH,key=PATH][,class=NAME][,forward=HOST:PORT] or
+ * PATH[,mode=OCTAL][,tuning=NAME][,cert=PATH,key=PATH][,class=NAME][,forward=HOST:PORT] */
+static int
+parse_listener (char *spec, int family)
+{
+	HevConfigListener *listener = NULL;
+	char *opts = NULL, *opt = NULL;
+
+	if (MAX_LISTENERS <= listener_count)
+	  return -1;
+	listener = &listeners[listener_count];
+	memset (listener, 0, sizeof (HevConfigListener));
+	listener->family = family;
+	listener->mode = 0666;
+
+	opts = strchr (spec, ',');
+	if (opts)
+	  *opts++ = '\0';
+	if (AF_INET == family) {
+		char *port = strrchr (spec, ':');
+		if (!port)
+		  return -1;
+		*port++ = '\0';
+		listener->port = atoi (port);
+	}
+	listener->address = spec;
+
+	while (opts && (opt = strsep (&opts, ","))) {
+		if (0 == strncmp (opt, "tuning=", 7))
+		  listener->tuning_profile = opt + 7;
+		else if ((AF_UNIX == family) && (0 == strncmp (opt, "mode=", 5)))
+		  listener->mode = strtoul (opt + 5, NULL, 8);
+		else if (0 == strncmp (opt, "cert=", 5))
+		  listener->tls_cert = opt + 5;
+		else if (0 == strncmp (opt, "key=", 4))
+		  listener->tls_key = opt + 4;
+		else if (0 == strncmp (opt, "class=", 6))
+		  listener->class_name = opt + 6;
+		else if (0 == strncmp (opt, "forward=", 8))
+		  listener->forward = opt + 8;
+		else
+		  return -1;
+	}
+	if (!listener->tls_cert != !listener->tls_key)
+	  return -1;
+	listener_count ++;
+
+	return 0;
+}
+
+/* ADDR:PORT[,conns=N][,secret=STRING], conns only for the parent */
+static int
+parse_tunnel (char *spec, const char **address, unsigned int *port,
+			unsigned int *conns, const char **secret)
+{
+	char *opts = NULL, *opt = NULL, *colon = NULL;
+
+	opts = strchr (spec, ',');
+	if (opts)
+	  *opts++ = '\0';
+	colon = strrchr (spec, ':');
+	if (!colon)
+	  return -1;
+	*colon++ = '\0';
+	*address = spec;
+	*port = atoi (colon);
+
+	while (opts && (opt = strsep (&opts, ","))) {
+		if (conns && (0 == strncmp (opt, "conns=", 6)))
+		  *conns = atoi (opt + 6);
+		else if (0 == strncmp (opt, "secret=", 7))
+		  *secret = opt + 7;
+		else
+		  return -1;
+	}
+
+	return 0;
+}
+
+/* PATH[,rotate=BYTES][,keep=N][,gzip] */
+static int
+parse_accesslog (char *spec)
+{
+	char *opts = NULL, *opt = NULL;
+
+	opts = strchr (spec, ',');
+	if (opts)
+	  *opts++ = '\0';
+	accesslog = spec;
+
+	while (opts && (opt = strsep (&opts, ","))) {
+		if (0 == strncmp (opt, "rotate=", 7))
+		  accesslog_rotate_size = strtoull (opt + 7, NULL, 10);
+		else if (0 == strncmp (opt, "keep=", 5))
+		  accesslog_keep = atoi (opt + 5);
+		else if (0 == strcmp (opt, "gzip"))
+		  accesslog_compress = true;
+		else
+		  return -1;
+	}
+
+	return 0;
+}
+
+/* USECS[,spin=USECS] */
+static int
+parse_busy_poll (char *spec)
+{
+	char *opts = NULL, *opt = NULL;
+
+	opts = strchr (spec, ',');
+	if (opts)
+	  *opts++ = '\0';
+	busy_poll = strtoul (spec, NULL, 10);
+	if (0 == busy_poll)
+	  return -1;
+
+	while (opts && (opt = strsep (&opts, ","))) {
+		if (0 == strncmp (opt, "spin=", 5))
+		  busy_spin = strtoul (opt + 5, NULL, 10);
+		else
+		  return -1;
+	}
+
+	return 0;
+}
+
+/* auth=MS,request=MS,dns=MS,connect=MS,stall=MS */
+static int
+parse_deadlines (char *spec)
+{
+	char *opt = NULL;
+
+	while ((opt = strsep (&spec, ","))) {
+		char *value = strchr (opt, '=');
+
+		if (!value)
+		  return -1;
+		*value++ = '\0';
+		if (0 == strcmp (opt, "auth"))
+		  deadline_auth = atoi (value);
+		else if (0 == strcmp (opt, "request"))
+		  deadline_request = atoi (value);
+		else if (0 == strcmp (opt, "dns"))
+		  deadline_dns = atoi (value);
+		else if (0 == strcmp (opt, "connect"))
+		  deadline_connect = atoi (value);
+		else if (0 == strcmp (opt, "stall"))
+		  deadline_stall = atoi (value);
+		else
+		  return -1;
+	}
+
+	return 0;
+}
+
+int
+hev_config_init (int argc, char *argv[])
+{
+	int opt = 0;
+
+	while (-1 != (opt = getopt (argc, argv, "a:s:e:t:l:u:kDnoL:c:H:P:R:T:Q:d:r:i:m:b:B:"))) {
+		switch (opt) {
+		case 'l':
+			if (0 > parse_listener (optarg, AF_INET))
+			  return -1;
+			break;
+		case 'u':
+			if (0 > parse_listener (optarg, AF_UNIX))
+			  return -1;
+			break;
+		case 'a':
+			auth_file = optarg;
+			break;
+		case 's':
+			hosts_file = optarg;
+			break;
+		case 'e':
+			if (MAX_EGRESS_ADDRESSES <= egress_address_count)
+			  return -1;
+			egress_addresses[egress_address_count ++] = optarg;
+			break;
+		case 't':
+			tuning_profile = optarg;
+			break;
+		case 'k':
+			sockmap = true;
+			break;
+		case 'D':
+			direct_dispatch = true;
+			break;
+		case 'n':
+			negcache = true;
+			break;
+		case 'o':
+			early_reply = true;
+			break;
+		case 'c':
+			control_path = optarg;
+			break;
+		case 'H':
+			handoff_path = optarg;
+			break;
+		case 'P':
+			if (0 > parse_tunnel (optarg, &parent_address, &parent_port,
+							&parent_conns, &parent_secret))
+			  return -1;
+			break;
+		case 'R':
+			if (MAX_PARENT_ROUTES <= parent_route_count)
+			  return -1;
+			parent_routes[parent_route_count ++] = optarg;
+			break;
+		case 'T':
+			if (0 > parse_tunnel (optarg, &tunnel_address, &tunnel_port,
+							NULL, &tunnel_secret))
+			  return -1;
+			break;
+		case 'Q':
+			if (MAX_CLASS_RULES <= class_rule_count)
+			  return -1;
+			class_rules[class_rule_count ++] = optarg;
+			break;
+		case 'd':
+			if (0 > parse_deadlines (optarg))
+			  return -1;
+			break;
+		case 'r':
+			connect_stagger = strtoul (optarg, NULL, 10);
+			break;
+		case 'i':
+			sample_interval = strtoul (optarg, NULL, 10);
+			break;
+		case 'm':
+			slow_threshold = strtoul (optarg, NULL, 10);
+			break;
+		case 'b':
+			relay_budget = strtoull (optarg, NULL, 10);
+			break;
+		case 'B':
+			if (0 > parse_busy_poll (optarg))
+			  return -1;
+			break;
+		case 'L':
+			if (0 > parse_accesslog (optarg))
+			  return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* the classic ADDR PORT form adds one more TCP listener */
+	if (2 == (argc - optind)) {
+		HevConfigListener *listener = NULL;
+
+		if (MAX_LISTENERS <= listener_count)
+		  return -1;
+		listener = &listeners[listener_count ++];
+		memset (listener, 0, sizeof (HevConfigListener));
+		listener->family = AF_INET;
+		listener->address = argv[optind];
+		listener->port = atoi (argv[optind+1]);
+	} else if (0 != (argc - optind)) {
+		return -1;
+	}
+	if (0 == listener_count)
+	  return -1;
+
+	return 0;
+}
+
+const HevConfigListener *
+hev_config_get_listeners (unsigned int *count)
+{
+	*count = listener_count;
+	return listeners;
+}
+
+const char *
+hev_config_get_auth_file (void)
+{
+	return auth_file;
+}
+
+const char *
+hev_config_get_hosts_file (void)
+{
+	return hosts_file;
+}
+
+const char **
+hev_config_get_egress_addresses (unsigned int *count)
+{
+	*count = egress_address_count;
+	return egress_addresses;
+}
+
+const char *
+hev_config_get_tuning_profile (void)
+{
+	return tuning_profile;
+}
+
+bool
+hev_config_get_sockmap (void)
+{
+	return sockmap;
+}
+
+bool
+hev_config_get_direct_dispatch (void)
+{
+	return direct_dispatch;
+}
+
+bool
+hev_config_get_negcache (void)
+{
+	return negcache;
+}
+
+bool
+hev_config_get_early_reply (void)
+{
+	return early_reply;
+}
+
+const char *
+hev_config_get_control_path (void)
+{
+	return control_path;
+}
+
+const char *
+hev_config_get_handoff_path (void)
+{
+	return handoff_path;
+}
+
+const char *
+hev_config_get_parent (unsigned int *port, unsigned int *conns, const char **secret)
+{
+	*port = parent_port;
+	*conns = parent_conns;
+	*secret = parent_secret;
+	return parent_address;
+}
+
+const char **
+hev_config_get_parent_routes (unsigned int *count)
+{
+	*count = parent_route_count;
+	return parent_routes;
+}
+
+const char *
+hev_config_get_tunnel (unsigned int *port, const char **secret)
+{
+	*port = tunnel_port;
+	*secret = tunnel_secret;
+	return tunnel_address;
+}
+
+const char **
+hev_config_get_class_rules (unsigned int *count)
+{
+	*count = class_rule_count;
+	return class_rules;
+}
+
+unsigned int
+hev_config_get_connect_stagger (void)
+{
+	return connect_stagger;
+}
+
+unsigned int
+hev_config_get_sample_interval (void)
+{
+	return sample_interval;
+}
+
+unsigned int
+hev_config_get_slow_threshold (void)
+{
+	return slow_threshold;
+}
+
+uint64_t
+hev_config_get_relay_budget (void)
+{
+	return relay_budget;
+}
+
+unsigned int
+hev_config_get_busy_poll (unsigned int *spin)
+{
+	*spin = busy_spin;
+	return busy_poll;
+}
+
+void
+hev_config_get_deadlines (unsigned int *auth, unsigned int *request,
+			unsigned int *dns, unsigned int *connect, unsigned int *stall)
+{
+	*auth = deadline_auth;
+	*request = deadline_request;
+	*dns = deadline_dns;
+	*connect = deadline_connect;
+	*stall = deadline_stall;
+}
+
+const char *
+hev_config_get_accesslog (size_t *rotate_size, unsigned int *keep, bool *compress)
+{
+	*rotate_size = accesslog_rotate_size;
+	*keep = accesslog_keep;
+	*compress = accesslog_compress;
+	return accesslog;
+}
+
@@ -0,0 +1,91 @@
+/*
+ ============================================================================
+ Name        : hev-config.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Config
+ ============================================================================
+ */
+
+#ifndef __HEV_CONFIG_H__
+#define __HEV_CONFIG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _HevConfigListener HevConfigListener;
+
+struct _HevConfigListener
+{
+	int family;
+	const char *address;	/* IPv4 address or unix socket path */
+	unsigned short port;
+	unsigned int mode;	/* unix socket permissions */
+	const char *tuning_profile;
+	const char *tls_cert;	/* both set for a TLS listener */
+	const char *tls_key;
+	const char *class_name;	/* priority class of its sessions */
+	const char *forward;	/* HOST:PORT every session relays to */
+};
+
+int hev_config_init (int argc, char *argv[]);
+
+const HevConfigListener * hev_config_get_listeners (unsigned int *count);
+
+const char * hev_config_get_auth_file (void);
+
+const char * hev_config_get_hosts_file (void);
+
+const char ** hev_config_get_egress_addresses (unsigned int *count);
+
+const char * hev_config_get_tuning_profile (void);
+
+bool hev_config_get_sockmap (void);
+
+bool hev_config_get_direct_dispatch (void);
+
+bool hev_config_get_negcache (void);
+
+bool hev_config_get_early_reply (void);
+
+const char * hev_config_get_control_path (void);
+
+/* control socket of the process being replaced, its fds are taken over */
+const char * hev_config_get_handoff_path (void);
+
+/* parent proxy reached over a multiplexed tunnel, NULL when unset */
+const char * hev_config_get_parent (unsigned int *port, unsigned int *conns,
+			const char **secret);
+const char ** hev_config_get_parent_routes (unsigned int *count);
+/* tunnel listener for children of this process, NULL when unset */
+const char * hev_config_get_tunnel (unsigned int *port, const char **secret);
+
+/* CLASS:user=NAME or CLASS:dest=ADDR/PREFIX[:PORT] */
+const char ** hev_config_get_class_rules (unsigned int *count);
+
+/* microseconds sockets busy poll, 0 disables; spin is how long the
+ * loop keeps spinning past the last wakeup */
+unsigned int hev_config_get_busy_poll (unsigned int *spin);
+
+/* milliseconds between racing connect attempts */
+unsigned int hev_config_get_connect_stagger (void);
+
+/* milliseconds between TCP_INFO samples, 0 disables */
+unsigned int hev_config_get_sample_interval (void);
+
+/* microseconds, slower callbacks are recorded, 0 disables the monitor */
+unsigned int hev_config_get_slow_threshold (void);
+
+/* bytes buffered across all relays before readers are held back, 0 disables */
+uint64_t hev_config_get_relay_budget (void);
+
+/* milliseconds, 0 disables */
+void hev_config_get_deadlines (unsigned int *auth, unsigned int *request,
+			unsigned int *dns, unsigned int *connect, unsigned int *stall);
+
+const char * hev_config_get_accesslog (size_t *rotate_size, unsigned int *keep,
+			bool *compress);
+
+#endif /* __HEV_CONFIG_H__ */
+
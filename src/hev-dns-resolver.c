@@ -48,44 +48,113 @@ hev_dns_resolver_new (void)
 	return resolver;
 }
 
+static size_t
+dns_query_encode (uint8_t *buffer, const char *domain)
+{
+	ssize_t i = 0;
+	uint8_t c = 0;
+	HevDNSHeader *header = (HevDNSHeader *) buffer;
+	size_t size = strlen (domain);
+
+	/* checking domain length */
+	if ((2048-sizeof (HevDNSHeader)-2-4) < size)
+	  return 0;
+	/* copy domain to queries aera */
+	for (i=size-1; 0<=i; i--) {
+		uint8_t b = 0;
+		if ('.' == domain[i]) {
+			b = c; c = 0;
+		} else {
+			b = domain[i]; c ++;
+		}
+		buffer[sizeof (HevDNSHeader)+1+i] = b;
+	}
+	buffer[sizeof (HevDNSHeader)] = c;
+	buffer[sizeof (HevDNSHeader)+1+size] = 0;
+	/* type */
+	buffer[sizeof (HevDNSHeader)+1+size+1] = 0;
+	buffer[sizeof (HevDNSHeader)+1+size+2] = 1;
+	/* class */
+	buffer[sizeof (HevDNSHeader)+1+size+3] = 0;
+	buffer[sizeof (HevDNSHeader)+1+size+4] = 1;
+	/* dns resolve header */
+	memset (header, 0, sizeof (HevDNSHeader));
+	header->id = htons (0x1234);
+	header->rd = 1;
+	header->qdcount = htons (1);
+
+	return size + sizeof (HevDNSHeader) + 6;
+}
+
+static unsigned int
+dns_answer_parse (uint8_t *buffer, ssize_t size, unsigned int *addrs, unsigned int max)
+{
+	HevDNSHeader *header = (HevDNSHeader *) buffer;
+	size_t i = 0, offset = sizeof (HevDNSHeader);
+	unsigned int count = 0;
+
+	if (sizeof (HevDNSHeader) > size)
+	  return 0;
+	if (0 == header->ancount)
+	  return 0;
+	header->qdcount = ntohs (header->qdcount);
+	header->ancount = ntohs (header->ancount);
+	/* skip queries */
+	for (i=0; i<header->qdcount; i++, offset+=4) {
+		for (; offset<size;) {
+			if (0 == buffer[offset]) {
+				offset += 1;
+				break;
+			} else if (0xc0 & buffer[offset]) {
+				offset += 2;
+				break;
+			} else {
+				offset += (buffer[offset] + 1);
+			}
+		}
+	}
+	/* collect every a type answer */
+	for (i=0; (i<header->ancount) && (count<max); i++) {
+		size_t rdlength = 0;
+
+		for (; offset<size;) {
+			if (0 == buffer[offset]) {
+				offset += 1;
+				break;
+			} else if (0xc0 & buffer[offset]) {
+				offset += 2;
+				break;
+			} else {
+				offset += (buffer[offset] + 1);
+			}
+		}
+		offset += 8;
+		/* checking the answer is valid */
+		if ((offset+2) > size)
+		  break;
+		rdlength = buffer[offset+1] + (buffer[offset] << 8);
+		if ((offset+2+rdlength) > size)
+		  break;
+		/* is a type with a 4 byte address */
+		if ((0x00 == buffer[offset-8]) && (0x01 == buffer[offset-7]) && (4 == rdlength))
+		  memcpy (&addrs[count++], &buffer[offset+2], 4);
+		offset += 2 + rdlength;
+	}
+
+	return count;
+}
+
 bool
 hev_dns_resolver_query (int resolver, const char *server, const char *domain)
 {
 	if (-1 < resolver) {
-		ssize_t i = 0;
-		uint8_t c = 0, buffer[2048];
-		HevDNSHeader *header = (HevDNSHeader *) buffer;
-		size_t size = strlen (domain);
+		uint8_t buffer[2048];
+		size_t size = 0;
 		struct sockaddr_in addr;
 
-		/* checking domain length */
-		if ((2048-sizeof (HevDNSHeader)-2-4) < size)
+		size = dns_query_encode (buffer, domain);
+		if (0 == size)
 		  return false;
-		/* copy domain to queries aera */
-		for (i=size-1; 0<=i; i--) {
-			uint8_t b = 0;
-			if ('.' == domain[i]) {
-				b = c; c = 0;
-			} else {
-				b = domain[i]; c ++;
-			}
-			buffer[sizeof (HevDNSHeader)+1+i] = b;
-		}
-		buffer[sizeof (HevDNSHeader)] = c;
-		buffer[sizeof (HevDNSHeader)+1+size] = 0;
-		/* type */
-		buffer[sizeof (HevDNSHeader)+1+size+1] = 0;
-		buffer[sizeof (HevDNSHeader)+1+size+2] = 1;
-		/* class */
-		buffer[sizeof (HevDNSHeader)+1+size+3] = 0;
-		buffer[sizeof (HevDNSHeader)+1+size+4] = 1;
-		/* dns resolve header */
-		memset (header, 0, sizeof (HevDNSHeader));
-		header->id = htons (0x1234);
-		header->rd = 1;
-		header->qdcount = htons (1);
-		/* size */
-		size += sizeof (HevDNSHeader) + 6;
 
 		memset (&addr, 0, sizeof (addr));
 		addr.sin_family = AF_INET;
@@ -102,69 +171,21 @@ hev_dns_resolver_query (int resolver, const char *server, const char *domain)
 }
 
 unsigned int
-hev_dns_resolver_query_finish (int resolver)
+hev_dns_resolver_query_finish (int resolver, unsigned int *addrs, unsigned int max)
 {
 	if (-1 < resolver) {
 		uint8_t buffer[2048];
-		HevDNSHeader *header = (HevDNSHeader *) buffer;
 		struct sockaddr_in addr;
 		socklen_t addr_len = sizeof (addr);
-		size_t i = 0, offset = sizeof (HevDNSHeader);
-		unsigned int *resp = NULL;
 
 		ssize_t size = recvfrom (resolver, buffer, 2048,
 					0, (struct sockaddr *) &addr, &addr_len);
 		if (53 != ntohs (addr.sin_port))
 		  return 0;
-		if (sizeof (HevDNSHeader) > size)
-		  return 0;
-		if (0 == header->ancount)
-		  return 0;
-		header->qdcount = ntohs (header->qdcount);
-		header->ancount = ntohs (header->ancount);
-		/* skip queries */
-		for (i=0; i<header->qdcount; i++, offset+=4) {
-			for (; offset<size;) {
-				if (0 == buffer[offset]) {
-					offset += 1;
-					break;
-				} else if (0xc0 & buffer[offset]) {
-					offset += 2;
-					break;
-				} else {
-					offset += (buffer[offset] + 1);
-				}
-			}
-		}
-		/* goto first a type answer resource area */
-		for (i=0; i<header->ancount; i++) {
-			for (; offset<size;) {
-				if (0 == buffer[offset]) {
-					offset += 1;
-					break;
-				} else if (0xc0 & buffer[offset]) {
-					offset += 2;
-					break;
-				} else {
-					offset += (buffer[offset] + 1);
-				}
-			}
-			offset += 8;
-			/* checking the answer is valid */
-			if ((offset-7) >= size)
-			  return 0;
-			/* is a type */
-			if ((0x00 == buffer[offset-8]) && (0x01 == buffer[offset-7]))
-			  break;
-			offset += 2 + (buffer[offset+1] + (buffer[offset] << 8));
-		}
-		/* checking resource length */
-		if (((offset+5) >= size) || (0x00 != buffer[offset]) || (0x04 != buffer[offset+1]))
-		  return 0;
-		resp = (unsigned int *) &buffer[offset+2];
 
-		return *resp;
+		return dns_answer_parse (buffer, size, addrs, max);
 	}
 
 	return 0;
 }
+
@@ -15,7 +15,9 @@
 
 int hev_dns_resolver_new (void);
 bool hev_dns_resolver_query (int resolver, const char *server, const char *domain);
-unsigned int hev_dns_resolver_query_finish (int resolver);
+/* fills addrs with up to max A records, returns how many */
+unsigned int hev_dns_resolver_query_finish (int resolver, unsigned int *addrs,
+			unsigned int max);
 
 #endif /* __HEV_DNS_RESOLVER_H__ */
 
@@ -9,14 +9,28 @@
 
 #include <stdio.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include "hev-main.h"
+#include "hev-config.h"
 #include "hev-socks5-server.h"
 
 static void
 show_help (const char *app)
 {
-	fprintf (stderr, "%s ADDR PORT\n", app);
+	fprintf (stderr, "%s [-a AUTH_FILE] [-s HOSTS_FILE] [-e EGRESS_ADDR]... [-t PROFILE]\n"
+				"\t[-k] [-D] [-n] [-o]\n"
+				"\t[-l ADDR:PORT[,tuning=PROFILE][,cert=PATH,key=PATH][,class=CLASS]\n"
+				"\t\t[,forward=HOST:PORT]]...\n"
+				"\t[-u PATH[,mode=OCTAL][,tuning=PROFILE][,cert=PATH,key=PATH][,class=CLASS]\n"
+				"\t\t[,forward=HOST:PORT]]...\n"
+				"\t[-Q CLASS:user=NAME|CLASS:dest=ADDR/PREFIX[:PORT]]...\n"
+				"\t[-L LOG_PATH[,rotate=BYTES][,keep=N][,gzip]] [-c CONTROL_PATH] [-H HANDOFF_PATH]\n"
+				"\t[-P ADDR:PORT[,conns=N][,secret=STRING] [-R ADDR/PREFIX]...]\n"
+				"\t[-T ADDR:PORT[,secret=STRING]]\n"
+				"\t[-d auth=MS,request=MS,dns=MS,connect=MS,stall=MS] [-r STAGGER_MS]\n"
+				"\t[-i SAMPLE_MS] [-m SLOW_US] [-b BUDGET_BYTES] [-B POLL_US[,spin=US]]\n"
+				"\t[ADDR PORT]\n", app);
 }
 
 static bool
@@ -27,6 +41,22 @@ signal_handler (void *data)
 	return false;
 }
 
+static bool
+reload_signal_handler (void *data)
+{
+	HevSocks5Server *server = data;
+	hev_socks5_server_reload (server);
+	return true;
+}
+
+static bool
+stats_signal_handler (void *data)
+{
+	HevSocks5Server *server = data;
+	hev_socks5_server_dump_stats (server, STDERR_FILENO);
+	return true;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -34,7 +64,7 @@ main (int argc, char *argv[])
 	HevEventSource *source = NULL;
 	HevSocks5Server *server = NULL;
 
-	if (3 != argc) {
+	if (0 > hev_config_init (argc, argv)) {
 		show_help (argv[0]);
 		exit (1);
 	}
@@ -49,8 +79,20 @@ main (int argc, char *argv[])
 	hev_event_loop_add_source (loop, source);
 	hev_event_source_unref (source);
 
-	server = hev_socks5_server_new (loop, argv[1], atoi (argv[2]));
+	server = hev_socks5_server_new (loop);
 	if (server) {
+		source = hev_event_source_signal_new (SIGHUP);
+		hev_event_source_set_priority (source, 3);
+		hev_event_source_set_callback (source, reload_signal_handler, server, NULL);
+		hev_event_loop_add_source (loop, source);
+		hev_event_source_unref (source);
+
+		source = hev_event_source_signal_new (SIGUSR1);
+		hev_event_source_set_priority (source, 3);
+		hev_event_source_set_callback (source, stats_signal_handler, server, NULL);
+		hev_event_loop_add_source (loop, source);
+		hev_event_source_unref (source);
+
 		hev_event_loop_run (loop);
 		hev_socks5_server_unref (server);
 	}
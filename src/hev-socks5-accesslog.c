@@ -0,0 +1,327 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-accesslog.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 binary access log
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <hev-lib.h>
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "hev-socks5-accesslog.h"
+#include "hev-socks5-stats.h"
+
+#define RING_SIZE	8192	/* records, power of 2 */
+#define FLUSH_INTERVAL	100	/* ms */
+
+struct _HevSocks5AccessLog
+{
+	/* written by the event loop only */
+	size_t head;
+	char pad0[64];
+	/* written by the writer thread only */
+	size_t tail;
+	char pad1[64];
+
+	unsigned int ref_count;
+	int running;
+	int reopen;
+	int fd;
+	bool compress;
+	unsigned int keep;
+	size_t rotate_size;
+	size_t file_size;
+	uint64_t written;
+	uint64_t lost;
+	uint64_t rotations;
+	char *path;
+	pthread_t thread;
+	HevSocks5AccessLogRecord *records;
+#ifdef ENABLE_ZLIB
+	gzFile gz;
+#endif
+};
+
+static void * accesslog_writer (void *data);
+
+HevSocks5AccessLog *
+hev_socks5_accesslog_new (const char *path, size_t rotate_size,
+			unsigned int keep, bool compress)
+{
+	HevSocks5AccessLog *self = NULL;
+	sigset_t set, oset;
+	int res = 0;
+
+#ifndef ENABLE_ZLIB
+	if (compress) {
+		printf ("Access log compression needs a build with ZLIB=1!\n");
+		return NULL;
+	}
+#endif
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5AccessLog));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5AccessLog));
+	self->records = calloc (RING_SIZE, sizeof (HevSocks5AccessLogRecord));
+	if (!self->records) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	self->ref_count = 1;
+	self->running = 1;
+	self->fd = -1;
+	self->compress = compress;
+	self->keep = keep;
+	self->rotate_size = rotate_size;
+	self->path = strdup (path);
+
+	/* signals are for the event loop, keep them off the writer */
+	sigfillset (&set);
+	pthread_sigmask (SIG_SETMASK, &set, &oset);
+	res = pthread_create (&self->thread, NULL, accesslog_writer, self);
+	pthread_sigmask (SIG_SETMASK, &oset, NULL);
+	if (0 != res) {
+		free (self->path);
+		free (self->records);
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+
+	return self;
+}
+
+HevSocks5AccessLog *
+hev_socks5_accesslog_ref (HevSocks5AccessLog *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_accesslog_unref (HevSocks5AccessLog *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			/* the writer drains what is left before it exits */
+			__atomic_store_n (&self->running, 0, __ATOMIC_RELEASE);
+			pthread_join (self->thread, NULL);
+			free (self->path);
+			free (self->records);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_accesslog_push (HevSocks5AccessLog *self,
+			const HevSocks5AccessLogRecord *record)
+{
+	size_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+
+	/* never wait for the writer, drop the record when the ring is full */
+	if (RING_SIZE == (self->head - tail)) {
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_ACCESSLOG_DROPS, 1);
+		return false;
+	}
+	self->records[self->head & (RING_SIZE - 1)] = *record;
+	__atomic_store_n (&self->head, self->head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void
+hev_socks5_accesslog_reopen (HevSocks5AccessLog *self)
+{
+	__atomic_store_n (&self->reopen, 1, __ATOMIC_RELEASE);
+}
+
+void
+hev_socks5_accesslog_dump (HevSocks5AccessLog *self, int fd)
+{
+	size_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+
+	dprintf (fd, "accesslog %s: written %llu lost %llu rotations %llu pending %zu\n",
+				self->path,
+				(unsigned long long) __atomic_load_n (&self->written, __ATOMIC_RELAXED),
+				(unsigned long long) __atomic_load_n (&self->lost, __ATOMIC_RELAXED),
+				(unsigned long long) __atomic_load_n (&self->rotations, __ATOMIC_RELAXED),
+				self->head - tail);
+}
+
+static bool
+accesslog_write (HevSocks5AccessLog *self, const void *data, size_t size)
+{
+	const uint8_t *ptr = data;
+	size_t len = size;
+
+#ifdef ENABLE_ZLIB
+	if (self->gz) {
+		if (size != gzwrite (self->gz, data, size))
+		  return false;
+		self->file_size += size;
+		return true;
+	}
+#endif
+	while (0 < len) {
+		ssize_t res = write (self->fd, ptr, len);
+		if (0 >= res)
+		  return false;
+		ptr += res;
+		len -= res;
+	}
+	self->file_size += size;
+
+	return true;
+}
+
+static void
+accesslog_open (HevSocks5AccessLog *self)
+{
+	HevSocks5AccessLogHeader header;
+	struct stat st;
+
+	self->fd = open (self->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (0 > self->fd)
+	  return;
+	self->file_size = (0 == fstat (self->fd, &st)) ? st.st_size : 0;
+#ifdef ENABLE_ZLIB
+	if (self->compress) {
+		/* appending to a gzip file adds a member, readers concatenate them */
+		self->gz = gzdopen (self->fd, "ab");
+		if (!self->gz) {
+			close (self->fd);
+			self->fd = -1;
+			return;
+		}
+	}
+#endif
+
+	/* the header goes only at the start of a fresh file */
+	if (0 == self->file_size) {
+		header.magic = HEV_SOCKS5_ACCESSLOG_MAGIC;
+		header.version = HEV_SOCKS5_ACCESSLOG_VERSION;
+		header.record_size = sizeof (HevSocks5AccessLogRecord);
+		accesslog_write (self, &header, sizeof (header));
+	}
+}
+
+static void
+accesslog_close (HevSocks5AccessLog *self)
+{
+	if (0 > self->fd)
+	  return;
+#ifdef ENABLE_ZLIB
+	if (self->gz) {
+		gzclose (self->gz);
+		self->gz = NULL;
+		self->fd = -1;
+		return;
+	}
+#endif
+	close (self->fd);
+	self->fd = -1;
+}
+
+static void
+accesslog_rotate (HevSocks5AccessLog *self)
+{
+	size_t len = strlen (self->path) + 16;
+	char from[len], to[len];
+	unsigned int i = 0;
+
+	accesslog_close (self);
+	/* PATH.N-1 -> PATH.N ... PATH -> PATH.1, the oldest falls off */
+	if (0 == self->keep) {
+		unlink (self->path);
+	} else {
+		for (i=self->keep-1; i>0; i--) {
+			snprintf (from, len, "%s.%u", self->path, i);
+			snprintf (to, len, "%s.%u", self->path, i + 1);
+			rename (from, to);
+		}
+		snprintf (to, len, "%s.1", self->path);
+		rename (self->path, to);
+	}
+	__atomic_add_fetch (&self->rotations, 1, __ATOMIC_RELAXED);
+	accesslog_open (self);
+}
+
+static void
+accesslog_flush (HevSocks5AccessLog *self)
+{
+	size_t head = __atomic_load_n (&self->head, __ATOMIC_ACQUIRE);
+	size_t tail = self->tail;
+
+	if (head == tail)
+	  return;
+	if (0 > self->fd)
+	  accesslog_open (self);
+
+	/* at most two contiguous spans per pass */
+	while (tail != head) {
+		size_t offset = tail & (RING_SIZE - 1);
+		size_t count = head - tail;
+
+		if (count > (RING_SIZE - offset))
+		  count = RING_SIZE - offset;
+		if ((0 > self->fd) || !accesslog_write (self, &self->records[offset],
+						count * sizeof (HevSocks5AccessLogRecord)))
+		  __atomic_add_fetch (&self->lost, count, __ATOMIC_RELAXED);
+		else
+		  __atomic_add_fetch (&self->written, count, __ATOMIC_RELAXED);
+		tail += count;
+		__atomic_store_n (&self->tail, tail, __ATOMIC_RELEASE);
+	}
+#ifdef ENABLE_ZLIB
+	/* keep the compressed stream decodable up to the last batch */
+	if (self->gz)
+	  gzflush (self->gz, Z_SYNC_FLUSH);
+#endif
+
+	if (self->rotate_size && (0 <= self->fd) && (self->file_size >= self->rotate_size))
+	  accesslog_rotate (self);
+}
+
+static void *
+accesslog_writer (void *data)
+{
+	HevSocks5AccessLog *self = data;
+	struct timespec interval;
+	int running = 1;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = FLUSH_INTERVAL * 1000000;
+	accesslog_open (self);
+
+	/* wake up periodically and write whatever accumulated as one batch */
+	while (running) {
+		running = __atomic_load_n (&self->running, __ATOMIC_ACQUIRE);
+		if (__atomic_exchange_n (&self->reopen, 0, __ATOMIC_ACQ_REL)) {
+			accesslog_close (self);
+			accesslog_open (self);
+		}
+		accesslog_flush (self);
+		if (running)
+		  nanosleep (&interval, NULL);
+	}
+	accesslog_close (self);
+
+	return NULL;
+}
+
@@ -0,0 +1,61 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-accesslog.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 binary access log
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_ACCESSLOG_H__
+#define __HEV_SOCKS5_ACCESSLOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HEV_SOCKS5_ACCESSLOG_MAGIC	0x4c414853	/* "SHAL" */
+#define HEV_SOCKS5_ACCESSLOG_VERSION	1
+
+typedef struct _HevSocks5AccessLog HevSocks5AccessLog;
+typedef struct _HevSocks5AccessLogHeader HevSocks5AccessLogHeader;
+typedef struct _HevSocks5AccessLogRecord HevSocks5AccessLogRecord;
+
+/* written once at the start of every log file, host byte order */
+struct _HevSocks5AccessLogHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+};
+
+/* addresses and ports in network byte order, times in nanoseconds */
+struct _HevSocks5AccessLogRecord
+{
+	uint64_t time;		/* close time since the epoch */
+	uint64_t duration;	/* accept to close */
+	uint64_t handshake;	/* accept to relay start, 0 if never reached */
+	uint64_t forward_bytes;
+	uint64_t backward_bytes;
+	uint32_t client_addr;
+	uint32_t remote_addr;
+	uint16_t client_port;
+	uint16_t remote_port;
+	uint8_t reason;		/* HevSocks5SessionCloseReason */
+	uint8_t reserved[11];
+};
+
+HevSocks5AccessLog * hev_socks5_accesslog_new (const char *path, size_t rotate_size,
+			unsigned int keep, bool compress);
+
+HevSocks5AccessLog * hev_socks5_accesslog_ref (HevSocks5AccessLog *self);
+void hev_socks5_accesslog_unref (HevSocks5AccessLog *self);
+
+bool hev_socks5_accesslog_push (HevSocks5AccessLog *self,
+			const HevSocks5AccessLogRecord *record);
+void hev_socks5_accesslog_reopen (HevSocks5AccessLog *self);
+
+void hev_socks5_accesslog_dump (HevSocks5AccessLog *self, int fd);
+
+#endif /* __HEV_SOCKS5_ACCESSLOG_H__ */
+
@@ -0,0 +1,272 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-auth.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 username/password credential store
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-auth.h"
+#include "hev-socks5-stats.h"
+
+typedef struct _HevSocks5AuthEntry HevSocks5AuthEntry;
+typedef struct _HevSocks5AuthTable HevSocks5AuthTable;
+
+struct _HevSocks5AuthEntry
+{
+	uint64_t hash;
+	uint32_t offset;
+	uint8_t user_len;
+	uint8_t pass_len;
+};
+
+struct _HevSocks5AuthTable
+{
+	size_t mask;
+	size_t count;
+	uint64_t seed;
+	HevSocks5AuthEntry *entries;
+	uint8_t *pool;
+};
+
+struct _HevSocks5Auth
+{
+	unsigned int ref_count;
+	char *path;
+	HevSocks5AuthTable *table;
+};
+
+static HevSocks5AuthTable * auth_table_load (const char *path);
+static void auth_table_free (HevSocks5AuthTable *table);
+
+HevSocks5Auth *
+hev_socks5_auth_new (const char *path)
+{
+	HevSocks5Auth *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Auth));
+	if (self) {
+		self->table = auth_table_load (path);
+		if (!self->table) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		self->path = strdup (path);
+		self->ref_count = 1;
+	}
+
+	return self;
+}
+
+HevSocks5Auth *
+hev_socks5_auth_ref (HevSocks5Auth *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_auth_unref (HevSocks5Auth *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			auth_table_free (self->table);
+			free (self->path);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_auth_reload (HevSocks5Auth *self)
+{
+	HevSocks5AuthTable *table = NULL;
+
+	/* keep serving the old table if the new one can't be loaded */
+	table = auth_table_load (self->path);
+	if (!table)
+	  return false;
+	auth_table_free (self->table);
+	self->table = table;
+
+	return true;
+}
+
+static inline uint64_t
+auth_hash (uint64_t seed, const uint8_t *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+	size_t i = 0;
+
+	/* seeded FNV-1a with a final avalanche */
+	for (i=0; i<len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static HevSocks5AuthEntry *
+auth_table_lookup (HevSocks5AuthTable *table, const uint8_t *user, size_t user_len)
+{
+	uint64_t hash = auth_hash (table->seed, user, user_len);
+	size_t i = hash & table->mask;
+
+	/* linear probing, entries with user_len 0 are empty */
+	for (;; i=(i+1)&table->mask) {
+		HevSocks5AuthEntry *entry = &table->entries[i];
+		if (0 == entry->user_len)
+		  return entry;
+		if ((hash == entry->hash) && (user_len == entry->user_len) &&
+					(0 == memcmp (&table->pool[entry->offset], user, user_len)))
+		  return entry;
+	}
+
+	return NULL;
+}
+
+bool
+hev_socks5_auth_check (HevSocks5Auth *self,
+			const uint8_t *user, size_t user_len,
+			const uint8_t *pass, size_t pass_len)
+{
+	HevSocks5AuthEntry *entry = NULL;
+	const uint8_t *stored = NULL;
+	uint8_t diff = 0;
+	size_t i = 0;
+
+	if ((0 == user_len) || (255 < user_len) || (255 < pass_len))
+	  return false;
+	entry = auth_table_lookup (self->table, user, user_len);
+	if (0 == entry->user_len)
+	  return false;
+	/* compare without an early exit on the first mismatch */
+	stored = &self->table->pool[entry->offset + entry->user_len];
+	diff = pass_len ^ entry->pass_len;
+	for (i=0; i<pass_len; i++)
+	  diff |= pass[i] ^ (entry->pass_len ? stored[i % entry->pass_len] : 0xff);
+
+	return 0 == diff;
+}
+
+static HevSocks5AuthTable *
+auth_table_load (const char *path)
+{
+	HevSocks5AuthTable *table = NULL;
+	HevSocks5AuthEntry *list = NULL;
+	size_t list_len = 0, list_size = 0, pool_len = 0, pool_size = 0;
+	size_t i = 0, capacity = 16;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len = 0;
+	FILE *fp = NULL;
+
+	fp = fopen (path, "r");
+	if (!fp) {
+		fprintf (stderr, "Open auth file %s failed!\n", path);
+		return NULL;
+	}
+
+	table = calloc (1, sizeof (HevSocks5AuthTable));
+	if (!table)
+	  goto fail;
+
+	/* one "username:password" per line */
+	while (0 <= (len = getline (&line, &line_size, fp))) {
+		char *sep = NULL;
+		size_t user_len = 0, pass_len = 0;
+
+		while ((0 < len) && (('\n' == line[len-1]) || ('\r' == line[len-1])))
+		  line[--len] = '\0';
+		if ((0 == len) || ('#' == line[0]))
+		  continue;
+		sep = memchr (line, ':', len);
+		if (!sep)
+		  continue;
+		user_len = sep - line;
+		pass_len = len - user_len - 1;
+		if ((0 == user_len) || (255 < user_len) || (255 < pass_len))
+		  continue;
+
+		if (list_len == list_size) {
+			HevSocks5AuthEntry *new_list = NULL;
+			list_size = list_size ? (list_size * 2) : 1024;
+			new_list = realloc (list, list_size * sizeof (HevSocks5AuthEntry));
+			if (!new_list)
+			  goto fail;
+			list = new_list;
+		}
+		if ((pool_len + user_len + pass_len) > pool_size) {
+			uint8_t *new_pool = NULL;
+			pool_size = (pool_size ? pool_size : 16384) * 2 + user_len + pass_len;
+			new_pool = realloc (table->pool, pool_size);
+			if (!new_pool)
+			  goto fail;
+			table->pool = new_pool;
+		}
+		memcpy (&table->pool[pool_len], line, user_len);
+		memcpy (&table->pool[pool_len+user_len], sep + 1, pass_len);
+		list[list_len].offset = pool_len;
+		list[list_len].user_len = user_len;
+		list[list_len].pass_len = pass_len;
+		list_len ++;
+		pool_len += user_len + pass_len;
+	}
+
+	/* keep the load factor at or below 50% */
+	while (capacity < (list_len * 2))
+	  capacity <<= 1;
+	table->mask = capacity - 1;
+	table->seed = hev_socks5_stats_clock () ^ ((uint64_t) getpid () << 32);
+	table->entries = calloc (capacity, sizeof (HevSocks5AuthEntry));
+	if (!table->entries)
+	  goto fail;
+	for (i=0; i<list_len; i++) {
+		HevSocks5AuthEntry *entry = NULL;
+		const uint8_t *user = &table->pool[list[i].offset];
+
+		/* a later line for the same user overrides the earlier one */
+		entry = auth_table_lookup (table, user, list[i].user_len);
+		if (0 == entry->user_len)
+		  table->count ++;
+		*entry = list[i];
+		entry->hash = auth_hash (table->seed, user, list[i].user_len);
+	}
+
+	free (list);
+	free (line);
+	fclose (fp);
+
+	return table;
+
+fail:
+	free (list);
+	free (line);
+	fclose (fp);
+	auth_table_free (table);
+
+	return NULL;
+}
+
+static void
+auth_table_free (HevSocks5AuthTable *table)
+{
+	if (table) {
+		free (table->entries);
+		free (table->pool);
+		free (table);
+	}
+}
+
@@ -0,0 +1,31 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-auth.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 username/password credential store
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_AUTH_H__
+#define __HEV_SOCKS5_AUTH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _HevSocks5Auth HevSocks5Auth;
+
+HevSocks5Auth * hev_socks5_auth_new (const char *path);
+
+HevSocks5Auth * hev_socks5_auth_ref (HevSocks5Auth *self);
+void hev_socks5_auth_unref (HevSocks5Auth *self);
+
+bool hev_socks5_auth_reload (HevSocks5Auth *self);
+
+bool hev_socks5_auth_check (HevSocks5Auth *self,
+			const uint8_t *user, size_t user_len,
+			const uint8_t *pass, size_t pass_len);
+
+#endif /* __HEV_SOCKS5_AUTH_H__ */
+
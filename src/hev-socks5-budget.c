@@ -0,0 +1,34 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-budget.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 relay buffer memory budget
+ ============================================================================
+ */
+
+#include <stdio.h>
+
+#include "hev-socks5-budget.h"
+
+HevSocks5Budget hev_socks5_budget;
+
+void
+hev_socks5_budget_set_limit (uint64_t limit)
+{
+	hev_socks5_budget.limit = limit;
+}
+
+void
+hev_socks5_budget_dump (int fd)
+{
+	dprintf (fd, "relay buffers: used %llu peak %llu budget %llu allocated %llu "
+				"throttles %llu accept-pauses %llu\n",
+				(unsigned long long) hev_socks5_budget.used,
+				(unsigned long long) hev_socks5_budget.peak,
+				(unsigned long long) hev_socks5_budget.limit,
+				(unsigned long long) hev_socks5_budget.allocated,
+				(unsigned long long) hev_socks5_budget.throttles,
+				(unsigned long long) hev_socks5_budget.pauses);
+}
+
@@ -0,0 +1,60 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-budget.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 relay buffer memory budget
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_BUDGET_H__
+#define __HEV_SOCKS5_BUDGET_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _HevSocks5Budget HevSocks5Budget;
+
+/* process wide, bytes held in relay ring buffers */
+struct _HevSocks5Budget
+{
+	uint64_t limit;		/* 0 when unlimited */
+	uint64_t used;
+	uint64_t peak;
+	uint64_t allocated;
+	uint64_t throttles;
+	uint64_t pauses;	/* times accepting stopped for room */
+};
+
+extern HevSocks5Budget hev_socks5_budget;
+
+void hev_socks5_budget_set_limit (uint64_t limit);
+
+static inline void
+hev_socks5_budget_adjust (int64_t delta)
+{
+	hev_socks5_budget.used += delta;
+	if (hev_socks5_budget.used > hev_socks5_budget.peak)
+	  hev_socks5_budget.peak = hev_socks5_budget.used;
+}
+
+/* past 7/8 of the limit the fullest buffers stop reading */
+static inline bool
+hev_socks5_budget_tight (void)
+{
+	uint64_t limit = hev_socks5_budget.limit;
+	return limit && (hev_socks5_budget.used >= (limit - (limit >> 3)));
+}
+
+/* the rings allocated reached the limit, new sessions have to wait */
+static inline bool
+hev_socks5_budget_full (void)
+{
+	uint64_t limit = hev_socks5_budget.limit;
+	return limit && (hev_socks5_budget.allocated >= limit);
+}
+
+void hev_socks5_budget_dump (int fd);
+
+#endif /* __HEV_SOCKS5_BUDGET_H__ */
+
@@ -0,0 +1,205 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-busypoll.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 busy poll low latency mode
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "hev-socks5-busypoll.h"
+#include "hev-socks5-loopmon.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL		46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+#define EPOLL_BUDGET	8	/* the kernel default */
+
+typedef struct _HevSocks5EpollParams HevSocks5EpollParams;
+
+/* struct epoll_params of Linux 6.9, older headers lack it */
+struct _HevSocks5EpollParams
+{
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t pad;
+};
+
+#define EPOLL_SET_PARAMS	_IOW (0x8A, 0x01, HevSocks5EpollParams)
+
+HevSocks5BusyPoll hev_socks5_busypoll;
+
+static HevEventSource *spin_source;
+static int spin_fd = -1;
+static unsigned int poll_usecs;
+static uint64_t spin_ns;
+static uint64_t spin_kicks;	/* kicks the spinner has seen */
+static uint64_t spin_active;	/* when it last saw one */
+static uint64_t spin_begin;
+static uint64_t spin_total;
+static uint64_t spin_rounds;
+static uint64_t sockopt_failures;
+static unsigned int epoll_count;
+static uint64_t start_time;
+
+static bool
+spin_source_handler (HevEventSourceFD *fd, void *data)
+{
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	uint64_t now = hev_socks5_stats_clock ();
+	uint64_t count = 0;
+
+	/* the eventfd stays readable, so the loop comes straight back
+	 * from epoll_wait while spinning */
+	fd->revents = 0;
+	if (!hev_socks5_busypoll.spinning)
+	  goto out;
+	spin_rounds ++;
+	if (spin_kicks != hev_socks5_busypoll.kicks) {
+		spin_kicks = hev_socks5_busypoll.kicks;
+		spin_active = now;
+	} else if ((now - spin_active) > spin_ns) {
+		if (sizeof (count) == read (spin_fd, &count, sizeof (count))) {
+			hev_socks5_busypoll.spinning = false;
+			spin_total += now - spin_begin;
+		}
+	}
+
+out:
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_BUSYPOLL, mon);
+
+	return true;
+}
+
+void
+hev_socks5_busypoll_start (HevEventLoop *loop, unsigned int poll_us,
+			unsigned int spin_us)
+{
+	if (poll_usecs)
+	  return;
+	poll_usecs = poll_us;
+	start_time = hev_socks5_stats_clock ();
+
+	/* on one CPU the spin only takes time from the peers it waits for */
+	if (!spin_us || (2 > sysconf (_SC_NPROCESSORS_ONLN)))
+	  return;
+	spin_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (0 > spin_fd)
+	  return;
+	spin_ns = spin_us * 1000ULL;
+
+	/* below everything, a spin round never delays real work */
+	spin_source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (spin_source, -2);
+	hev_event_source_add_fd (spin_source, spin_fd, EPOLLIN);
+	hev_event_source_set_callback (spin_source,
+				(HevEventSourceFunc) spin_source_handler, NULL, NULL);
+	hev_event_loop_add_source (loop, spin_source);
+	hev_event_source_unref (spin_source);
+	hev_socks5_busypoll.enabled = true;
+}
+
+void
+hev_socks5_busypoll_stop (HevEventLoop *loop)
+{
+	poll_usecs = 0;
+	if (!spin_source)
+	  return;
+	hev_event_loop_del_source (loop, spin_source);
+	spin_source = NULL;
+	close (spin_fd);
+	spin_fd = -1;
+	hev_socks5_busypoll.enabled = false;
+	hev_socks5_busypoll.spinning = false;
+}
+
+void
+hev_socks5_busypoll_wake (void)
+{
+	uint64_t one = 1;
+
+	if (sizeof (one) != write (spin_fd, &one, sizeof (one)))
+	  return;
+	hev_socks5_busypoll.spinning = true;
+	spin_kicks = hev_socks5_busypoll.kicks;
+	spin_active = hev_socks5_stats_clock ();
+	spin_begin = spin_active;
+}
+
+void
+hev_socks5_busypoll_apply (int fd)
+{
+	int prefer = 1;
+
+	if (!poll_usecs)
+	  return;
+	/* both need CAP_NET_ADMIN past the net.core.busy_read default */
+	if ((0 > setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &poll_usecs, sizeof (int))) ||
+				(0 > setsockopt (fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+					&prefer, sizeof (int))))
+	  sockopt_failures ++;
+}
+
+void
+hev_socks5_busypoll_apply_epoll (int epfd)
+{
+	HevSocks5EpollParams params;
+
+	if (!poll_usecs)
+	  return;
+	memset (&params, 0, sizeof (params));
+	params.busy_poll_usecs = poll_usecs;
+	params.busy_poll_budget = EPOLL_BUDGET;
+	params.prefer_busy_poll = 1;
+	if (0 == ioctl (epfd, EPOLL_SET_PARAMS, &params))
+	  epoll_count ++;
+}
+
+void
+hev_socks5_busypoll_dump (int fd)
+{
+	struct rusage usage;
+	uint64_t user = 0, sys = 0, wall = 0, spin = spin_total;
+	char spin_desc[32] = "off";
+
+	if (!poll_usecs)
+	  return;
+	getrusage (RUSAGE_SELF, &usage);
+	user = usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec;
+	sys = usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+	wall = (hev_socks5_stats_clock () - start_time) / 1000;
+	if (hev_socks5_busypoll.spinning)
+	  spin += hev_socks5_stats_clock () - spin_begin;
+
+	if (spin_source)
+	  snprintf (spin_desc, sizeof (spin_desc), "%lluus",
+				  (unsigned long long) (spin_ns / 1000));
+
+	dprintf (fd, "busy poll: socket %uus spin %s epoll %s sockopt-failures %llu\n",
+				poll_usecs, spin_desc,
+				epoll_count ? "on" : "off", (unsigned long long) sockopt_failures);
+	dprintf (fd, "busy poll: wakeups spinning %llu sleeping %llu rounds %llu "
+				"spin-time %llums cpu %.1f%% user %llums sys %llums\n",
+				(unsigned long long) hev_socks5_busypoll.spin_wakeups,
+				(unsigned long long) hev_socks5_busypoll.sleep_wakeups,
+				(unsigned long long) spin_rounds,
+				(unsigned long long) (spin / 1000000),
+				wall ? (user + sys) * 100.0 / wall : 0.0,
+				(unsigned long long) (user / 1000), (unsigned long long) (sys / 1000));
+}
+
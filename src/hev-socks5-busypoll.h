@@ -0,0 +1,62 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-busypoll.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 busy poll low latency mode
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_BUSYPOLL_H__
+#define __HEV_SOCKS5_BUSYPOLL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <hev-lib.h>
+
+typedef struct _HevSocks5BusyPoll HevSocks5BusyPoll;
+
+/* process wide, the loop spins while wakeups keep coming */
+struct _HevSocks5BusyPoll
+{
+	bool enabled;		/* the loop spins at all */
+	bool spinning;
+	uint64_t kicks;
+	uint64_t spin_wakeups;	/* found the loop spinning */
+	uint64_t sleep_wakeups;	/* found it asleep */
+};
+
+extern HevSocks5BusyPoll hev_socks5_busypoll;
+
+/* sockets busy poll the device queue for poll_us, the loop spins for
+ * spin_us past the last wakeup before it sleeps, given a spare CPU */
+void hev_socks5_busypoll_start (HevEventLoop *loop, unsigned int poll_us,
+			unsigned int spin_us);
+void hev_socks5_busypoll_stop (HevEventLoop *loop);
+
+void hev_socks5_busypoll_wake (void);
+
+/* every session wakeup, a load and a branch while the mode is off */
+static inline void
+hev_socks5_busypoll_kick (void)
+{
+	if (!hev_socks5_busypoll.enabled)
+	  return;
+	hev_socks5_busypoll.kicks ++;
+	if (hev_socks5_busypoll.spinning) {
+		hev_socks5_busypoll.spin_wakeups ++;
+	} else {
+		hev_socks5_busypoll.sleep_wakeups ++;
+		hev_socks5_busypoll_wake ();
+	}
+}
+
+/* client and remote sockets */
+void hev_socks5_busypoll_apply (int fd);
+/* the epoll fd of the direct dispatch, where the kernel supports it */
+void hev_socks5_busypoll_apply_epoll (int epfd);
+
+void hev_socks5_busypoll_dump (int fd);
+
+#endif /* __HEV_SOCKS5_BUSYPOLL_H__ */
+
@@ -0,0 +1,268 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-classes.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 session priority classes
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "hev-socks5-classes.h"
+
+#define MAX_RULES	64
+#define USER_MAX	255
+
+typedef struct _HevSocks5ClassRule HevSocks5ClassRule;
+
+struct _HevSocks5ClassRule
+{
+	HevSocks5Class class;
+	uint8_t user_len;	/* 0 for a destination rule */
+	uint16_t port;		/* network order, 0 matches any */
+	uint32_t network;
+	uint32_t mask;
+	uint64_t hits;
+	char user[USER_MAX + 1];
+};
+
+struct _HevSocks5Classes
+{
+	unsigned int ref_count;
+	unsigned int rule_count;
+	uint64_t relays[HEV_SOCKS5_CLASS_MAX];
+	HevSocks5ClassRule rules[MAX_RULES];
+	HevEventLoop *loop;
+};
+
+static const char *class_names[] =
+{
+	"default",
+	"interactive",
+	"bulk",
+};
+
+static const int class_priorities[] =
+{
+	0,
+	1,
+	-1,
+};
+
+bool
+hev_socks5_class_parse (const char *name, HevSocks5Class *class)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<HEV_SOCKS5_CLASS_MAX; i++) {
+		if (0 == strcmp (name, class_names[i])) {
+			*class = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *
+hev_socks5_class_name (HevSocks5Class class)
+{
+	return class_names[class];
+}
+
+int
+hev_socks5_class_priority (HevSocks5Class class)
+{
+	return class_priorities[class];
+}
+
+HevSocks5Classes *
+hev_socks5_classes_new (HevEventLoop *loop)
+{
+	HevSocks5Classes *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Classes));
+	if (self) {
+		memset (self, 0, sizeof (HevSocks5Classes));
+		self->ref_count = 1;
+		self->loop = loop;
+	}
+
+	return self;
+}
+
+HevSocks5Classes *
+hev_socks5_classes_ref (HevSocks5Classes *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_classes_unref (HevSocks5Classes *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count)
+		  HEV_MEMORY_ALLOCATOR_FREE (self);
+	}
+}
+
+/* ADDR/PREFIX[:PORT] */
+static bool
+parse_dest (HevSocks5ClassRule *rule, const char *spec)
+{
+	const char *slash = strchr (spec, '/');
+	const char *colon = strchr (spec, ':');
+	size_t len = strcspn (spec, "/:");
+	unsigned long prefix = 32;
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in;
+
+	if (sizeof (addr) <= len)
+	  return false;
+	memcpy (addr, spec, len);
+	addr[len] = '\0';
+	if (1 != inet_pton (AF_INET, addr, &in))
+	  return false;
+	if (slash && (!colon || (slash < colon))) {
+		char *end = NULL;
+
+		prefix = strtoul (slash + 1, &end, 10);
+		if ((end == (slash + 1)) || (*end && (':' != *end)) || (32 < prefix))
+		  return false;
+	}
+	if (colon) {
+		char *end = NULL;
+		unsigned long port = strtoul (colon + 1, &end, 10);
+
+		if ((end == (colon + 1)) || *end || (65535 < port))
+		  return false;
+		rule->port = htons (port);
+	}
+
+	rule->mask = prefix ? htonl (~0U << (32 - prefix)) : 0;
+	rule->network = in.s_addr & rule->mask;
+
+	return true;
+}
+
+bool
+hev_socks5_classes_add_rule (HevSocks5Classes *self, const char *spec)
+{
+	HevSocks5ClassRule *rule = NULL;
+	const char *colon = strchr (spec, ':');
+	char name[16];
+
+	if ((MAX_RULES <= self->rule_count) || !colon ||
+				(sizeof (name) <= (size_t) (colon - spec)))
+	  return false;
+	memcpy (name, spec, colon - spec);
+	name[colon - spec] = '\0';
+
+	rule = &self->rules[self->rule_count];
+	memset (rule, 0, sizeof (HevSocks5ClassRule));
+	if (!hev_socks5_class_parse (name, &rule->class))
+	  return false;
+	spec = colon + 1;
+	if (0 == strncmp (spec, "user=", 5)) {
+		size_t len = strlen (spec + 5);
+
+		if ((0 == len) || (USER_MAX < len))
+		  return false;
+		memcpy (rule->user, spec + 5, len);
+		rule->user_len = len;
+	} else if (0 == strncmp (spec, "dest=", 5)) {
+		if (!parse_dest (rule, spec + 5))
+		  return false;
+	} else {
+		return false;
+	}
+	self->rule_count ++;
+
+	return true;
+}
+
+HevSocks5Class
+hev_socks5_classes_match_user (HevSocks5Classes *self,
+			const uint8_t *user, size_t user_len, HevSocks5Class class)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<self->rule_count; i++) {
+		HevSocks5ClassRule *rule = &self->rules[i];
+
+		if ((rule->user_len == user_len) && (0 == memcmp (rule->user, user, user_len))) {
+			rule->hits ++;
+			return rule->class;
+		}
+	}
+
+	return class;
+}
+
+HevSocks5Class
+hev_socks5_classes_match_dest (HevSocks5Classes *self,
+			const struct sockaddr_in *dest, HevSocks5Class class)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<self->rule_count; i++) {
+		HevSocks5ClassRule *rule = &self->rules[i];
+
+		if (rule->user_len)
+		  continue;
+		if ((dest->sin_addr.s_addr & rule->mask) != rule->network)
+		  continue;
+		if (rule->port && (rule->port != dest->sin_port))
+		  continue;
+		rule->hits ++;
+		return rule->class;
+	}
+
+	return class;
+}
+
+void
+hev_socks5_classes_relay (HevSocks5Classes *self, HevEventSource *source,
+			HevSocks5Class current, HevSocks5Class class)
+{
+	self->relays[class] ++;
+	if (class_priorities[current] == class_priorities[class])
+	  return;
+	/* the loop keeps its sources ordered by priority as they are added */
+	hev_event_loop_del_source (self->loop, source);
+	hev_event_source_set_priority (source, class_priorities[class]);
+	hev_event_loop_add_source (self->loop, source);
+}
+
+void
+hev_socks5_classes_dump (HevSocks5Classes *self, int fd)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<HEV_SOCKS5_CLASS_MAX; i++)
+	  dprintf (fd, "class %s: priority %d relays %llu\n", class_names[i],
+				  class_priorities[i], (unsigned long long) self->relays[i]);
+	for (i=0; i<self->rule_count; i++) {
+		HevSocks5ClassRule *rule = &self->rules[i];
+		char addr[INET_ADDRSTRLEN];
+		struct in_addr in;
+
+		if (rule->user_len) {
+			dprintf (fd, "class rule %s:user=%s hits %llu\n", class_names[rule->class],
+						rule->user, (unsigned long long) rule->hits);
+			continue;
+		}
+		in.s_addr = rule->network;
+		inet_ntop (AF_INET, &in, addr, sizeof (addr));
+		dprintf (fd, "class rule %s:dest=%s/%d:%u hits %llu\n", class_names[rule->class],
+					addr, __builtin_popcount (rule->mask), ntohs (rule->port),
+					(unsigned long long) rule->hits);
+	}
+}
+
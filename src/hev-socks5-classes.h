@@ -0,0 +1,56 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-classes.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 session priority classes
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_CLASSES_H__
+#define __HEV_SOCKS5_CLASSES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <hev-lib.h>
+
+typedef struct _HevSocks5Classes HevSocks5Classes;
+typedef enum _HevSocks5Class HevSocks5Class;
+
+enum _HevSocks5Class
+{
+	HEV_SOCKS5_CLASS_DEFAULT,	/* priority 0, as every session before */
+	HEV_SOCKS5_CLASS_INTERACTIVE,	/* priority 1, next to the listeners */
+	HEV_SOCKS5_CLASS_BULK,		/* priority -1, with the housekeeping */
+	HEV_SOCKS5_CLASS_MAX,
+};
+
+bool hev_socks5_class_parse (const char *name, HevSocks5Class *class);
+const char * hev_socks5_class_name (HevSocks5Class class);
+int hev_socks5_class_priority (HevSocks5Class class);
+
+HevSocks5Classes * hev_socks5_classes_new (HevEventLoop *loop);
+
+HevSocks5Classes * hev_socks5_classes_ref (HevSocks5Classes *self);
+void hev_socks5_classes_unref (HevSocks5Classes *self);
+
+/* CLASS:user=NAME or CLASS:dest=ADDR/PREFIX[:PORT], first match wins */
+bool hev_socks5_classes_add_rule (HevSocks5Classes *self, const char *rule);
+
+/* the class of the first matching rule, class when none matches */
+HevSocks5Class hev_socks5_classes_match_user (HevSocks5Classes *self,
+			const uint8_t *user, size_t user_len, HevSocks5Class class);
+HevSocks5Class hev_socks5_classes_match_dest (HevSocks5Classes *self,
+			const struct sockaddr_in *dest, HevSocks5Class class);
+
+/* a session starts relaying in class, its source already in the loop
+ * moves over from the priority of current when they differ */
+void hev_socks5_classes_relay (HevSocks5Classes *self, HevEventSource *source,
+			HevSocks5Class current, HevSocks5Class class);
+
+void hev_socks5_classes_dump (HevSocks5Classes *self, int fd);
+
+#endif /* __HEV_SOCKS5_CLASSES_H__ */
+
@@ -0,0 +1,244 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-control.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 control socket
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hev-socks5-control.h"
+#include "hev-socks5-loopmon.h"
+
+#define MAX_CLIENTS	16
+#define COMMAND_SIZE	256
+
+typedef struct _HevSocks5ControlClient HevSocks5ControlClient;
+
+struct _HevSocks5ControlClient
+{
+	int fd;
+	size_t len;
+	char command[COMMAND_SIZE];
+};
+
+struct _HevSocks5Control
+{
+	int fd;
+	unsigned int ref_count;
+	char *path;
+	HevSList *client_list;
+	unsigned int client_count;
+	HevSocks5ControlHandler handler;
+	void *data;
+	HevEventSource *source;
+	HevEventLoop *loop;
+};
+
+static bool control_source_handler (HevEventSourceFD *fd, void *data);
+static void control_client_close (HevSocks5Control *self,
+			HevSocks5ControlClient *client);
+
+HevSocks5Control *
+hev_socks5_control_new (HevEventLoop *loop, const char *path,
+			HevSocks5ControlHandler handler, void *data)
+{
+	HevSocks5Control *self = NULL;
+	struct sockaddr_un addr;
+	int nonblock = 1;
+
+	if (sizeof (addr.sun_path) <= strlen (path))
+	  return NULL;
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Control));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5Control));
+	self->ref_count = 1;
+	self->handler = handler;
+	self->data = data;
+	self->loop = loop;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+	unlink (path);
+	self->fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (0 > self->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	ioctl (self->fd, FIONBIO, (char *) &nonblock);
+	if ((0 > bind (self->fd, (struct sockaddr *) &addr, sizeof (addr))) ||
+				(0 > listen (self->fd, 4))) {
+		printf ("Bind control socket %s failed!\n", path);
+		close (self->fd);
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	/* owner only, the control socket can reach every session */
+	chmod (path, 0600);
+	self->path = strdup (path);
+
+	/* lowest priority, commands never delay the relay */
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (self->source, -1);
+	hev_event_source_add_fd (self->source, self->fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) control_source_handler, self, NULL);
+	hev_event_loop_add_source (loop, self->source);
+	hev_event_source_unref (self->source);
+
+	return self;
+}
+
+HevSocks5Control *
+hev_socks5_control_ref (HevSocks5Control *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_control_unref (HevSocks5Control *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			HevSList *list = NULL;
+
+			for (list=self->client_list; list; list=hev_slist_next (list)) {
+				HevSocks5ControlClient *client = hev_slist_data (list);
+				close (client->fd);
+				HEV_MEMORY_ALLOCATOR_FREE (client);
+			}
+			hev_slist_free (self->client_list);
+			hev_event_loop_del_source (self->loop, self->source);
+			close (self->fd);
+			if (self->path) {
+				unlink (self->path);
+				free (self->path);
+			}
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+void
+hev_socks5_control_disown (HevSocks5Control *self)
+{
+	free (self->path);
+	self->path = NULL;
+}
+
+static void
+control_accept (HevSocks5Control *self, HevEventSourceFD *fd)
+{
+	HevSocks5ControlClient *client = NULL;
+	int client_fd = -1, nonblock = 1;
+
+	client_fd = accept (fd->fd, NULL, NULL);
+	if (0 > client_fd) {
+		if (EAGAIN == errno)
+		  fd->revents &= ~EPOLLIN;
+		return;
+	}
+	if (MAX_CLIENTS <= self->client_count) {
+		close (client_fd);
+		return;
+	}
+	client = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5ControlClient));
+	if (!client) {
+		close (client_fd);
+		return;
+	}
+	client->fd = client_fd;
+	client->len = 0;
+	ioctl (client_fd, FIONBIO, (char *) &nonblock);
+	hev_event_source_add_fd (self->source, client_fd, EPOLLIN | EPOLLET);
+	self->client_list = hev_slist_append (self->client_list, client);
+	self->client_count ++;
+}
+
+static void
+control_client_close (HevSocks5Control *self, HevSocks5ControlClient *client)
+{
+	hev_event_source_del_fd (self->source, client->fd);
+	close (client->fd);
+	self->client_list = hev_slist_remove (self->client_list, client);
+	self->client_count --;
+	HEV_MEMORY_ALLOCATOR_FREE (client);
+}
+
+static bool
+control_handle (HevEventSourceFD *fd, void *data)
+{
+	HevSocks5Control *self = data;
+	HevSocks5ControlClient *client = NULL;
+	HevSList *list = NULL;
+	char *end = NULL;
+	ssize_t size = 0;
+
+	if (fd->fd == self->fd) {
+		control_accept (self, fd);
+		return true;
+	}
+
+	for (list=self->client_list; list; list=hev_slist_next (list)) {
+		client = hev_slist_data (list);
+		if (client->fd == fd->fd)
+		  break;
+	}
+	if (!list)
+	  return true;
+	if (EPOLLERR & fd->revents) {
+		control_client_close (self, client);
+		return true;
+	}
+
+	/* one command line per connection */
+	size = read (client->fd, client->command + client->len,
+				COMMAND_SIZE - 1 - client->len);
+	if (0 > size) {
+		if (EAGAIN == errno)
+		  fd->revents &= ~EPOLLIN;
+		else
+		  control_client_close (self, client);
+		return true;
+	}
+	client->len += size;
+	client->command[client->len] = '\0';
+	end = strpbrk (client->command, "\r\n");
+	if (end)
+	  *end = '\0';
+	else if ((0 != size) && ((COMMAND_SIZE - 1) > client->len))
+	  return true;
+
+	self->handler (client->command, client->fd, self->data);
+	control_client_close (self, client);
+
+	return true;
+}
+
+static bool
+control_source_handler (HevEventSourceFD *fd, void *data)
+{
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	bool res = control_handle (fd, data);
+
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_CONTROL, mon);
+
+	return res;
+}
+
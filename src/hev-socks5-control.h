@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-control.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 control socket
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_CONTROL_H__
+#define __HEV_SOCKS5_CONTROL_H__
+
+#include <hev-lib.h>
+
+typedef struct _HevSocks5Control HevSocks5Control;
+/* fd is non-blocking and closed afterwards, a reply that may not fit
+ * the socket buffer goes out from a copy of it */
+typedef void (*HevSocks5ControlHandler) (const char *command, int fd, void *data);
+
+HevSocks5Control * hev_socks5_control_new (HevEventLoop *loop, const char *path,
+			HevSocks5ControlHandler handler, void *data);
+
+HevSocks5Control * hev_socks5_control_ref (HevSocks5Control *self);
+void hev_socks5_control_unref (HevSocks5Control *self);
+
+/* the path was taken over by another process, leave it on exit */
+void hev_socks5_control_disown (HevSocks5Control *self);
+
+#endif /* __HEV_SOCKS5_CONTROL_H__ */
+
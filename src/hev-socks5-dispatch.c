@@ -0,0 +1,155 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-dispatch.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 direct epoll dispatch
+ ============================================================================
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "hev-socks5-dispatch.h"
+#include "hev-socks5-stats.h"
+#include "hev-socks5-loopmon.h"
+#include "hev-socks5-busypoll.h"
+
+#define BATCH_SIZE	64
+
+struct _HevSocks5Dispatch
+{
+	int epfd;
+	unsigned int ref_count;
+	int batch_pos;
+	int batch_len;
+	struct epoll_event batch[BATCH_SIZE];
+	HevSocks5DispatchFunc func;
+	HevEventSource *source;
+	HevEventLoop *loop;
+};
+
+static bool dispatch_source_handler (HevEventSourceFD *fd, void *data);
+
+HevSocks5Dispatch *
+hev_socks5_dispatch_new (HevEventLoop *loop, HevSocks5DispatchFunc func)
+{
+	HevSocks5Dispatch *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Dispatch));
+	if (self) {
+		memset (self, 0, sizeof (HevSocks5Dispatch));
+		self->epfd = epoll_create1 (EPOLL_CLOEXEC);
+		if (0 > self->epfd) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		self->ref_count = 1;
+		self->func = func;
+		self->loop = loop;
+		hev_socks5_busypoll_apply_epoll (self->epfd);
+
+		/* the nested epoll shows up in the loop as one readable fd */
+		self->source = hev_event_source_fds_new ();
+		hev_event_source_add_fd (self->source, self->epfd, EPOLLIN | EPOLLET);
+		hev_event_source_set_callback (self->source,
+					(HevEventSourceFunc) dispatch_source_handler, self, NULL);
+		hev_event_loop_add_source (loop, self->source);
+		hev_event_source_unref (self->source);
+	}
+
+	return self;
+}
+
+HevSocks5Dispatch *
+hev_socks5_dispatch_ref (HevSocks5Dispatch *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_dispatch_unref (HevSocks5Dispatch *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			hev_event_loop_del_source (self->loop, self->source);
+			close (self->epfd);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_dispatch_add (HevSocks5Dispatch *self, int fd, uint32_t events, void *data)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = data;
+
+	return 0 == epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+bool
+hev_socks5_dispatch_mod (HevSocks5Dispatch *self, int fd, uint32_t events, void *data)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = data;
+
+	return 0 == epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void
+hev_socks5_dispatch_del (HevSocks5Dispatch *self, int fd, void *data)
+{
+	int i = 0;
+
+	epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, NULL);
+	/* the rest of the batch may still name it, drop those events */
+	for (i=self->batch_pos; i<self->batch_len; i++) {
+		if (self->batch[i].data.ptr == data)
+		  self->batch[i].events = 0;
+	}
+}
+
+static bool
+dispatch_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevSocks5Dispatch *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	int count = 0;
+
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_WAKEUPS, 1);
+	hev_socks5_busypoll_kick ();
+
+	count = epoll_wait (self->epfd, self->batch, BATCH_SIZE, 0);
+	if (0 >= count) {
+		fd->revents &= ~EPOLLIN;
+		hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_DISPATCH, mon);
+		return true;
+	}
+
+	/* the whole batch goes straight to the handler, no per-event source */
+	self->batch_len = count;
+	for (self->batch_pos=0; self->batch_pos<count;) {
+		struct epoll_event *event = &self->batch[self->batch_pos ++];
+		if (event->events)
+		  self->func (event->data.ptr, event->events);
+	}
+	self->batch_len = 0;
+	self->batch_pos = 0;
+
+	/* a short batch drained the nested epoll, a full one comes back
+	 * after the other sources had their turn */
+	if (BATCH_SIZE > count)
+	  fd->revents &= ~EPOLLIN;
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_DISPATCH, mon);
+
+	return true;
+}
+
@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-dispatch.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 direct epoll dispatch
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_DISPATCH_H__
+#define __HEV_SOCKS5_DISPATCH_H__
+
+#include <hev-lib.h>
+
+typedef struct _HevSocks5Dispatch HevSocks5Dispatch;
+/* data is the pointer given to add, tag bits included */
+typedef void (*HevSocks5DispatchFunc) (void *data, uint32_t events);
+
+HevSocks5Dispatch * hev_socks5_dispatch_new (HevEventLoop *loop,
+			HevSocks5DispatchFunc func);
+
+HevSocks5Dispatch * hev_socks5_dispatch_ref (HevSocks5Dispatch *self);
+void hev_socks5_dispatch_unref (HevSocks5Dispatch *self);
+
+bool hev_socks5_dispatch_add (HevSocks5Dispatch *self, int fd, uint32_t events, void *data);
+bool hev_socks5_dispatch_mod (HevSocks5Dispatch *self, int fd, uint32_t events, void *data);
+void hev_socks5_dispatch_del (HevSocks5Dispatch *self, int fd, void *data);
+
+#endif /* __HEV_SOCKS5_DISPATCH_H__ */
+
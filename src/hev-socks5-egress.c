@@ -0,0 +1,242 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-egress.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 egress source address pool
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-egress.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT	24
+#endif
+
+#define MAX_ADDRESSES	32
+#define DEST_BUCKETS	1024
+
+typedef struct _HevSocks5EgressAddress HevSocks5EgressAddress;
+
+struct _HevSocks5EgressAddress
+{
+	struct in_addr addr;
+	unsigned int active;
+	unsigned int peak;
+	unsigned long long addr_not_avail;
+	unsigned long long bind_failed;
+};
+
+struct _HevSocks5Egress
+{
+	unsigned int ref_count;
+	unsigned int count;
+	unsigned int port_range;
+	HevSocks5EgressAddress addrs[MAX_ADDRESSES];
+	/* live connections per (destination bucket, source address) */
+	unsigned int *usage;
+};
+
+static unsigned int
+read_port_range (void)
+{
+	unsigned int low = 32768, high = 60999;
+	FILE *fp = fopen ("/proc/sys/net/ipv4/ip_local_port_range", "r");
+
+	if (fp) {
+		if (2 != fscanf (fp, "%u %u", &low, &high))
+		  low = 32768, high = 60999;
+		fclose (fp);
+	}
+
+	return (high >= low) ? (high - low + 1) : 1;
+}
+
+HevSocks5Egress *
+hev_socks5_egress_new (void)
+{
+	HevSocks5Egress *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Egress));
+	if (self) {
+		self->usage = calloc (DEST_BUCKETS * MAX_ADDRESSES, sizeof (unsigned int));
+		if (!self->usage) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		memset (self->addrs, 0, sizeof (self->addrs));
+		self->ref_count = 1;
+		self->count = 0;
+		self->port_range = read_port_range ();
+	}
+
+	return self;
+}
+
+HevSocks5Egress *
+hev_socks5_egress_ref (HevSocks5Egress *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_egress_unref (HevSocks5Egress *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			free (self->usage);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_egress_add_address (HevSocks5Egress *self, const char *addr)
+{
+	HevSocks5EgressAddress *egress = NULL;
+
+	if (MAX_ADDRESSES <= self->count)
+	  return false;
+	egress = &self->addrs[self->count];
+	if (0 == inet_aton (addr, &egress->addr))
+	  return false;
+	self->count ++;
+
+	return true;
+}
+
+static inline unsigned int *
+dest_usage (HevSocks5Egress *self, const struct sockaddr_in *dest)
+{
+	uint32_t hash = dest->sin_addr.s_addr ^ (dest->sin_port * 0x9e3779b1U);
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+
+	return &self->usage[(hash % DEST_BUCKETS) * MAX_ADDRESSES];
+}
+
+static void
+egress_account (HevSocks5Egress *self, unsigned int *usage, int index)
+{
+	usage[index] ++;
+	if (usage[index] > self->addrs[index].peak)
+	  self->addrs[index].peak = usage[index];
+	self->addrs[index].active ++;
+}
+
+int
+hev_socks5_egress_bind (HevSocks5Egress *self, int fd,
+			const struct sockaddr_in *dest)
+{
+	unsigned int *usage = NULL;
+	unsigned int i = 0, index = 0, start = 0;
+	struct sockaddr_in addr;
+	int no_port = 1;
+
+	if (0 == self->count)
+	  return -1;
+	/* pick the source with the fewest live connections to this destination,
+	 * ties rotate so new destinations don't all land on the first address */
+	usage = dest_usage (self, dest);
+	start = ntohs (dest->sin_port) % self->count;
+	index = start;
+	for (i=1; i<self->count; i++) {
+		unsigned int j = (start + i) % self->count;
+		if (usage[j] < usage[index])
+		  index = j;
+	}
+
+	/* defer port selection to connect, so ports are only unique per 4-tuple */
+	setsockopt (fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &no_port, sizeof (no_port));
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = self->addrs[index].addr;
+	if (0 > bind (fd, (struct sockaddr *) &addr, sizeof (addr))) {
+		self->addrs[index].bind_failed ++;
+		return -1;
+	}
+
+	egress_account (self, usage, index);
+
+	return index;
+}
+
+void
+hev_socks5_egress_release (HevSocks5Egress *self, int index,
+			const struct sockaddr_in *dest)
+{
+	unsigned int *usage = NULL;
+
+	if ((0 > index) || (self->count <= index))
+	  return;
+	usage = dest_usage (self, dest);
+	if (usage[index])
+	  usage[index] --;
+	if (self->addrs[index].active)
+	  self->addrs[index].active --;
+}
+
+int
+hev_socks5_egress_adopt (HevSocks5Egress *self, int index,
+			const struct in_addr *source, const struct sockaddr_in *dest)
+{
+	unsigned int i = 0;
+
+	if ((0 > index) || (self->count <= index) ||
+				(self->addrs[index].addr.s_addr != source->s_addr)) {
+		/* the new configuration may list the addresses differently */
+		for (i=0; i<self->count; i++) {
+			if (self->addrs[i].addr.s_addr == source->s_addr)
+			  break;
+		}
+		if (self->count == i)
+		  return -1;
+		index = i;
+	}
+	egress_account (self, dest_usage (self, dest), index);
+
+	return index;
+}
+
+void
+hev_socks5_egress_report_error (HevSocks5Egress *self, int index, int error)
+{
+	if ((0 > index) || (self->count <= index))
+	  return;
+	if (EADDRNOTAVAIL == error)
+	  self->addrs[index].addr_not_avail ++;
+}
+
+void
+hev_socks5_egress_dump (HevSocks5Egress *self, int fd)
+{
+	unsigned int i = 0, j = 0;
+
+	for (i=0; i<self->count; i++) {
+		HevSocks5EgressAddress *egress = &self->addrs[i];
+		unsigned int hottest = 0;
+
+		for (j=0; j<DEST_BUCKETS; j++) {
+			unsigned int used = self->usage[j * MAX_ADDRESSES + i];
+			if (used > hottest)
+			  hottest = used;
+		}
+		dprintf (fd, "egress %s: active %u hottest-dest %u/%u (%u%%) peak %u "
+					"addrnotavail %llu bind-failed %llu\n",
+					inet_ntoa (egress->addr), egress->active, hottest,
+					self->port_range, hottest * 100 / self->port_range,
+					egress->peak, egress->addr_not_avail, egress->bind_failed);
+	}
+}
+
@@ -0,0 +1,38 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-egress.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 egress source address pool
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_EGRESS_H__
+#define __HEV_SOCKS5_EGRESS_H__
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+typedef struct _HevSocks5Egress HevSocks5Egress;
+
+HevSocks5Egress * hev_socks5_egress_new (void);
+
+HevSocks5Egress * hev_socks5_egress_ref (HevSocks5Egress *self);
+void hev_socks5_egress_unref (HevSocks5Egress *self);
+
+bool hev_socks5_egress_add_address (HevSocks5Egress *self, const char *addr);
+
+int hev_socks5_egress_bind (HevSocks5Egress *self, int fd,
+			const struct sockaddr_in *dest);
+void hev_socks5_egress_release (HevSocks5Egress *self, int index,
+			const struct sockaddr_in *dest);
+/* counts a connection another process bound from source, the index is
+ * a hint for a pool in the same order; -1 when source isn't pooled */
+int hev_socks5_egress_adopt (HevSocks5Egress *self, int index,
+			const struct in_addr *source, const struct sockaddr_in *dest);
+void hev_socks5_egress_report_error (HevSocks5Egress *self, int index, int error);
+
+void hev_socks5_egress_dump (HevSocks5Egress *self, int fd);
+
+#endif /* __HEV_SOCKS5_EGRESS_H__ */
+
@@ -0,0 +1,228 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-flows.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 per destination TCP statistics
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-flows.h"
+
+#define TABLE_SIZE	1024	/* power of 2 */
+#define TABLE_PROBES	8
+
+typedef struct _HevSocks5FlowsSide HevSocks5FlowsSide;
+typedef struct _HevSocks5FlowsEntry HevSocks5FlowsEntry;
+
+enum
+{
+	SIDE_CLIENT,
+	SIDE_REMOTE,
+	SIDE_MAX,
+};
+
+/* sums, the dump divides by samples */
+struct _HevSocks5FlowsSide
+{
+	uint64_t samples;
+	uint64_t rtt;
+	uint64_t rttvar;
+	uint64_t retrans;
+	uint64_t cwnd;
+	uint64_t delivery_rate;
+	uint64_t send_queue;
+	uint32_t rtt_max;
+};
+
+struct _HevSocks5FlowsEntry
+{
+	uint64_t key;	/* 0 for a free slot */
+	uint64_t samples;
+	uint64_t limits[HEV_SOCKS5_FLOWS_LIMIT_MAX];
+	HevSocks5FlowsSide sides[SIDE_MAX];
+};
+
+struct _HevSocks5Flows
+{
+	unsigned int ref_count;
+	HevSocks5FlowsEntry table[TABLE_SIZE];
+};
+
+static const char *limit_names[HEV_SOCKS5_FLOWS_LIMIT_MAX] =
+{
+	"app-limited",
+	"ring-limited",
+	"socket-limited",
+};
+
+static const char *side_names[SIDE_MAX] =
+{
+	"client",
+	"remote",
+};
+
+HevSocks5Flows *
+hev_socks5_flows_new (void)
+{
+	HevSocks5Flows *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Flows));
+	if (self) {
+		memset (self, 0, sizeof (HevSocks5Flows));
+		self->ref_count = 1;
+	}
+
+	return self;
+}
+
+HevSocks5Flows *
+hev_socks5_flows_ref (HevSocks5Flows *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_flows_unref (HevSocks5Flows *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count)
+		  HEV_MEMORY_ALLOCATOR_FREE (self);
+	}
+}
+
+static HevSocks5FlowsEntry *
+flows_lookup (HevSocks5Flows *self, uint64_t key)
+{
+	HevSocks5FlowsEntry *victim = NULL;
+	unsigned int i = 0, index = 0;
+
+	/* short linear probe, the least sampled destination makes room */
+	index = (key * 0x9e3779b97f4a7c15ULL) >> 54;
+	for (i=0; i<TABLE_PROBES; i++) {
+		HevSocks5FlowsEntry *entry = &self->table[(index + i) & (TABLE_SIZE - 1)];
+		if (entry->key == key)
+		  return entry;
+		if (0 == entry->key) {
+			victim = entry;
+			break;
+		}
+		if (!victim || (entry->samples < victim->samples))
+		  victim = entry;
+	}
+	memset (victim, 0, sizeof (HevSocks5FlowsEntry));
+	victim->key = key;
+
+	return victim;
+}
+
+static void
+side_add (HevSocks5FlowsSide *side, const HevSocks5FlowsSample *sample)
+{
+	side->samples ++;
+	side->rtt += sample->rtt;
+	side->rttvar += sample->rttvar;
+	side->retrans += sample->retrans;
+	side->cwnd += sample->cwnd;
+	side->delivery_rate += sample->delivery_rate;
+	side->send_queue += sample->send_queue;
+	if (sample->rtt > side->rtt_max)
+	  side->rtt_max = sample->rtt;
+}
+
+void
+hev_socks5_flows_add (HevSocks5Flows *self, const struct sockaddr_in *dest,
+			const HevSocks5FlowsSample *client, const HevSocks5FlowsSample *remote,
+			HevSocks5FlowsLimit limit)
+{
+	uint64_t key = ((uint64_t) dest->sin_addr.s_addr << 16) | dest->sin_port;
+	HevSocks5FlowsEntry *entry = NULL;
+
+	/* a marker bit keeps the key of 0.0.0.0:0 non zero */
+	entry = flows_lookup (self, key | (1ULL << 48));
+	entry->samples ++;
+	entry->limits[limit] ++;
+	if (client)
+	  side_add (&entry->sides[SIDE_CLIENT], client);
+	if (remote)
+	  side_add (&entry->sides[SIDE_REMOTE], remote);
+}
+
+void
+hev_socks5_flows_decay (HevSocks5Flows *self)
+{
+	unsigned int i = 0, j = 0;
+
+	/* halve everything, averages hold and old destinations fade out */
+	for (i=0; i<TABLE_SIZE; i++) {
+		HevSocks5FlowsEntry *entry = &self->table[i];
+
+		if (0 == entry->key)
+		  continue;
+		entry->samples >>= 1;
+		if (0 == entry->samples) {
+			entry->key = 0;
+			continue;
+		}
+		for (j=0; j<HEV_SOCKS5_FLOWS_LIMIT_MAX; j++)
+		  entry->limits[j] >>= 1;
+		for (j=0; j<SIDE_MAX; j++) {
+			HevSocks5FlowsSide *side = &entry->sides[j];
+			if (0 == side->samples)
+			  continue;
+			side->samples = (side->samples + 1) >> 1;
+			side->rtt >>= 1;
+			side->rttvar >>= 1;
+			side->retrans >>= 1;
+			side->cwnd >>= 1;
+			side->delivery_rate >>= 1;
+			side->send_queue >>= 1;
+		}
+	}
+}
+
+void
+hev_socks5_flows_dump (HevSocks5Flows *self, int fd)
+{
+	unsigned int i = 0, j = 0;
+
+	for (i=0; i<TABLE_SIZE; i++) {
+		HevSocks5FlowsEntry *entry = &self->table[i];
+		char addr[INET_ADDRSTRLEN];
+		struct in_addr in;
+
+		if (0 == entry->key)
+		  continue;
+		in.s_addr = (entry->key >> 16) & 0xffffffff;
+		inet_ntop (AF_INET, &in, addr, sizeof (addr));
+		dprintf (fd, "flow %s:%u samples %llu", addr, ntohs (entry->key & 0xffff),
+					(unsigned long long) entry->samples);
+		for (j=0; j<HEV_SOCKS5_FLOWS_LIMIT_MAX; j++)
+		  dprintf (fd, " %s %llu", limit_names[j],
+					  (unsigned long long) entry->limits[j]);
+		dprintf (fd, "\n");
+		for (j=0; j<SIDE_MAX; j++) {
+			HevSocks5FlowsSide *side = &entry->sides[j];
+			uint64_t n = side->samples;
+
+			if (0 == n)
+			  continue;
+			dprintf (fd, "  %s rtt %lluus rttvar %lluus rtt-max %uus retrans %llu "
+						"cwnd %llu rate %lluB/s sendq %lluB\n", side_names[j],
+						(unsigned long long) (side->rtt / n),
+						(unsigned long long) (side->rttvar / n), side->rtt_max,
+						(unsigned long long) side->retrans,
+						(unsigned long long) (side->cwnd / n),
+						(unsigned long long) (side->delivery_rate / n),
+						(unsigned long long) (side->send_queue / n));
+		}
+	}
+}
+
@@ -0,0 +1,55 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-flows.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 per destination TCP statistics
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_FLOWS_H__
+#define __HEV_SOCKS5_FLOWS_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct _HevSocks5Flows HevSocks5Flows;
+typedef struct _HevSocks5FlowsSample HevSocks5FlowsSample;
+typedef enum _HevSocks5FlowsLimit HevSocks5FlowsLimit;
+
+/* one TCP_INFO reading of a session socket */
+struct _HevSocks5FlowsSample
+{
+	uint32_t rtt;		/* us */
+	uint32_t rttvar;	/* us */
+	uint32_t retrans;	/* since the previous sample */
+	uint32_t cwnd;		/* segments */
+	uint64_t delivery_rate;	/* bytes per second */
+	uint32_t send_queue;	/* bytes not yet acked */
+};
+
+/* what held the session back since the previous sample */
+enum _HevSocks5FlowsLimit
+{
+	HEV_SOCKS5_FLOWS_LIMIT_APP,	/* neither, the peers sent little */
+	HEV_SOCKS5_FLOWS_LIMIT_RING,	/* a relay ring buffer filled up */
+	HEV_SOCKS5_FLOWS_LIMIT_SOCKET,	/* a socket refused writes */
+	HEV_SOCKS5_FLOWS_LIMIT_MAX,
+};
+
+HevSocks5Flows * hev_socks5_flows_new (void);
+
+HevSocks5Flows * hev_socks5_flows_ref (HevSocks5Flows *self);
+void hev_socks5_flows_unref (HevSocks5Flows *self);
+
+/* client or remote is NULL when that socket isn't TCP */
+void hev_socks5_flows_add (HevSocks5Flows *self, const struct sockaddr_in *dest,
+			const HevSocks5FlowsSample *client, const HevSocks5FlowsSample *remote,
+			HevSocks5FlowsLimit limit);
+
+void hev_socks5_flows_decay (HevSocks5Flows *self);
+
+void hev_socks5_flows_dump (HevSocks5Flows *self, int fd);
+
+#endif /* __HEV_SOCKS5_FLOWS_H__ */
+
@@ -0,0 +1,218 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-handoff.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 listener and session handoff between processes
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "hev-socks5-handoff.h"
+
+#define RECV_TIMEOUT	5	/* s */
+
+typedef struct _HevSocks5HandoffHeader HevSocks5HandoffHeader;
+
+struct _HevSocks5HandoffHeader
+{
+	uint32_t type;
+	uint32_t len;
+};
+
+int
+hev_socks5_handoff_connect (const char *path)
+{
+	struct sockaddr_un addr;
+	struct timeval timeout = { RECV_TIMEOUT, 0 };
+	char command[32];
+	int sock = -1, len = 0;
+
+	if (sizeof (addr.sun_path) <= strlen (path))
+	  return -1;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (0 > sock)
+	  return -1;
+	/* a stuck old process must not keep the new one from starting */
+	setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+	if (0 > connect (sock, (struct sockaddr *) &addr, sizeof (addr))) {
+		close (sock);
+		return -1;
+	}
+	len = snprintf (command, sizeof (command), "handoff %u\n",
+				HEV_SOCKS5_HANDOFF_VERSION);
+	if (len != write (sock, command, len)) {
+		close (sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+size_t
+hev_socks5_handoff_pack (void *buf, HevSocks5HandoffType type,
+			const void *payload, size_t len)
+{
+	HevSocks5HandoffHeader header;
+
+	if (HEV_SOCKS5_HANDOFF_PAYLOAD_MAX < len)
+	  return 0;
+	header.type = type;
+	header.len = len;
+	memcpy (buf, &header, sizeof (header));
+	if (len)
+	  memcpy ((uint8_t *) buf + sizeof (header), payload, len);
+
+	return sizeof (header) + len;
+}
+
+ssize_t
+hev_socks5_handoff_write (int sock, const void *buf, size_t len,
+			const int *fds, unsigned int fd_count)
+{
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE (sizeof (int) * HEV_SOCKS5_HANDOFF_FDS_MAX)];
+	} control;
+	struct msghdr mh;
+	struct iovec iovec;
+
+	if (HEV_SOCKS5_HANDOFF_FDS_MAX < fd_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	iovec.iov_base = (void *) buf;
+	iovec.iov_len = len;
+
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iovec;
+	mh.msg_iovlen = 1;
+	if (fd_count) {
+		struct cmsghdr *cmsg = NULL;
+
+		memset (&control, 0, sizeof (control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE (sizeof (int) * fd_count);
+		cmsg = CMSG_FIRSTHDR (&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int) * fd_count);
+		memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * fd_count);
+	}
+
+	return sendmsg (sock, &mh, MSG_NOSIGNAL);
+}
+
+size_t
+hev_socks5_handoff_unpack (const void *buf, size_t len,
+			HevSocks5HandoffType *type, const void **payload, size_t *payload_len)
+{
+	HevSocks5HandoffHeader header;
+
+	if (sizeof (header) > len)
+	  return 0;
+	memcpy (&header, buf, sizeof (header));
+	/* an oversized record never completes, the caller's buffer fills */
+	if ((HEV_SOCKS5_HANDOFF_PAYLOAD_MAX < header.len) ||
+				((sizeof (header) + header.len) > len))
+	  return 0;
+	*type = header.type;
+	*payload = (const uint8_t *) buf + sizeof (header);
+	*payload_len = header.len;
+
+	return sizeof (header) + header.len;
+}
+
+bool
+hev_socks5_handoff_send (int sock, HevSocks5HandoffType type,
+			const void *payload, size_t len, const int *fds, unsigned int fd_count)
+{
+	uint8_t buf[HEV_SOCKS5_HANDOFF_RECORD_MAX];
+	size_t total = 0, sent = 0;
+	ssize_t size = 0;
+
+	total = hev_socks5_handoff_pack (buf, type, payload, len);
+	if (0 == total)
+	  return false;
+
+	/* the fds ride on the first byte, the rest of a short write has none */
+	for (sent=0; sent<total; sent+=size) {
+		size = hev_socks5_handoff_write (sock, buf + sent, total - sent,
+					(0 == sent) ? fds : NULL, (0 == sent) ? fd_count : 0);
+		if (0 >= size)
+		  return false;
+	}
+
+	return true;
+}
+
+HevSocks5HandoffType
+hev_socks5_handoff_recv (int sock, void *payload, size_t *len,
+			int *fds, unsigned int *fd_count)
+{
+	HevSocks5HandoffHeader header;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE (sizeof (int) * HEV_SOCKS5_HANDOFF_FDS_MAX)];
+	} control;
+	struct cmsghdr *cmsg = NULL;
+	struct msghdr mh;
+	struct iovec iovec;
+	unsigned int i = 0;
+	size_t received = 0;
+	ssize_t size = 0;
+
+	for (i=0; i<HEV_SOCKS5_HANDOFF_FDS_MAX; i++)
+	  fds[i] = -1;
+	*fd_count = 0;
+
+	iovec.iov_base = &header;
+	iovec.iov_len = sizeof (header);
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iovec;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof (control.buf);
+	size = recvmsg (sock, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (sizeof (header) != size)
+	  return HEV_SOCKS5_HANDOFF_ERROR;
+
+	for (cmsg=CMSG_FIRSTHDR (&mh); cmsg; cmsg=CMSG_NXTHDR (&mh, cmsg)) {
+		if ((SOL_SOCKET != cmsg->cmsg_level) || (SCM_RIGHTS != cmsg->cmsg_type))
+		  continue;
+		*fd_count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+		memcpy (fds, CMSG_DATA (cmsg), sizeof (int) * *fd_count);
+	}
+	if ((MSG_CTRUNC & mh.msg_flags) || (*len < header.len))
+	  goto fail;
+
+	for (received=0; received<header.len; received+=size) {
+		size = recv (sock, (char *) payload + received, header.len - received,
+					MSG_WAITALL);
+		if (0 >= size)
+		  goto fail;
+	}
+	*len = header.len;
+
+	return header.type;
+
+fail:
+	for (i=0; i<*fd_count; i++)
+	  close (fds[i]);
+	*fd_count = 0;
+
+	return HEV_SOCKS5_HANDOFF_ERROR;
+}
+
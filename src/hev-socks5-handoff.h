@@ -0,0 +1,63 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-handoff.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 listener and session handoff between processes
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_HANDOFF_H__
+#define __HEV_SOCKS5_HANDOFF_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* bumped whenever a record layout changes, both ends must agree */
+#define HEV_SOCKS5_HANDOFF_VERSION	3
+#define HEV_SOCKS5_HANDOFF_PAYLOAD_MAX	16384
+#define HEV_SOCKS5_HANDOFF_RECORD_MAX	(8 + HEV_SOCKS5_HANDOFF_PAYLOAD_MAX)
+#define HEV_SOCKS5_HANDOFF_FDS_MAX	2
+/* one bit each in the ack */
+#define HEV_SOCKS5_HANDOFF_SESSIONS_MAX	(HEV_SOCKS5_HANDOFF_PAYLOAD_MAX * 8)
+
+typedef enum _HevSocks5HandoffType HevSocks5HandoffType;
+
+/* sent in this order: listeners, one cache record, sessions, end; the
+ * new process answers with an ack, the old one confirms with a commit
+ * and only then do the sessions run on the new side */
+enum _HevSocks5HandoffType
+{
+	HEV_SOCKS5_HANDOFF_ERROR,
+	HEV_SOCKS5_HANDOFF_LISTENER,	/* name, listen fd */
+	HEV_SOCKS5_HANDOFF_CACHE,	/* negative connect cache */
+	HEV_SOCKS5_HANDOFF_SESSION,	/* listener name and state, client and remote fd */
+	HEV_SOCKS5_HANDOFF_END,
+	HEV_SOCKS5_HANDOFF_ACK,		/* bit per session record, set if adopted */
+	HEV_SOCKS5_HANDOFF_COMMIT,
+};
+
+/* connects to the control socket of the running process and asks for
+ * its fds, returns a blocking socket or -1 */
+int hev_socks5_handoff_connect (const char *path);
+
+bool hev_socks5_handoff_send (int sock, HevSocks5HandoffType type,
+			const void *payload, size_t len, const int *fds, unsigned int fd_count);
+
+/* for a non-blocking socket: a record with its header into buf, which
+ * holds HEV_SOCKS5_HANDOFF_RECORD_MAX; 0 when the payload is too long */
+size_t hev_socks5_handoff_pack (void *buf, HevSocks5HandoffType type,
+			const void *payload, size_t len);
+/* one write of a packed record, fds ride on its first byte */
+ssize_t hev_socks5_handoff_write (int sock, const void *buf, size_t len,
+			const int *fds, unsigned int fd_count);
+/* the record at the start of buf, its length or 0 while incomplete */
+size_t hev_socks5_handoff_unpack (const void *buf, size_t len,
+			HevSocks5HandoffType *type, const void **payload, size_t *payload_len);
+/* fills payload and fds, missing fds are -1 */
+HevSocks5HandoffType hev_socks5_handoff_recv (int sock, void *payload, size_t *len,
+			int *fds, unsigned int *fd_count);
+
+#endif /* __HEV_SOCKS5_HANDOFF_H__ */
+
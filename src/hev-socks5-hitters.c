@@ -0,0 +1,245 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-hitters.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 heavy hitter tracking
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-hitters.h"
+#include "hev-socks5-stats.h"
+
+#define SKETCH_DEPTH	4
+#define SKETCH_WIDTH	1024	/* power of 2 */
+#define TOP_K		32
+
+typedef struct _HevSocks5HittersEntry HevSocks5HittersEntry;
+typedef struct _HevSocks5HittersTracker HevSocks5HittersTracker;
+
+enum
+{
+	TRACKER_DEST_CONNS,
+	TRACKER_DEST_BYTES,
+	TRACKER_CLIENT_CONNS,
+	TRACKER_CLIENT_BYTES,
+	TRACKER_MAX,
+};
+
+struct _HevSocks5HittersEntry
+{
+	uint64_t key;
+	uint64_t count;
+};
+
+/* count-min sketch for estimates, a fixed top-K table for the hitters */
+struct _HevSocks5HittersTracker
+{
+	uint64_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+	HevSocks5HittersEntry top[TOP_K];
+	unsigned int top_count;
+};
+
+struct _HevSocks5Hitters
+{
+	unsigned int ref_count;
+	uint64_t seeds[SKETCH_DEPTH];
+	HevSocks5HittersTracker trackers[TRACKER_MAX];
+};
+
+static const char *tracker_names[TRACKER_MAX] =
+{
+	"dest-conns",
+	"dest-bytes",
+	"client-conns",
+	"client-bytes",
+};
+
+HevSocks5Hitters *
+hev_socks5_hitters_new (void)
+{
+	HevSocks5Hitters *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Hitters));
+	if (self) {
+		uint64_t seed = hev_socks5_stats_clock ();
+		unsigned int i = 0;
+
+		memset (self, 0, sizeof (HevSocks5Hitters));
+		self->ref_count = 1;
+		for (i=0; i<SKETCH_DEPTH; i++) {
+			seed += 0x9e3779b97f4a7c15ULL;
+			self->seeds[i] = seed;
+		}
+	}
+
+	return self;
+}
+
+HevSocks5Hitters *
+hev_socks5_hitters_ref (HevSocks5Hitters *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_hitters_unref (HevSocks5Hitters *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count)
+		  HEV_MEMORY_ALLOCATOR_FREE (self);
+	}
+}
+
+static inline uint64_t
+hitters_hash (uint64_t seed, uint64_t key)
+{
+	uint64_t hash = key ^ seed;
+
+	/* splitmix64 finalizer */
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+
+	return hash ^ (hash >> 31);
+}
+
+static void
+tracker_add (HevSocks5Hitters *self, HevSocks5HittersTracker *tracker,
+			uint64_t key, uint64_t value)
+{
+	uint64_t *cells[SKETCH_DEPTH];
+	uint64_t estimate = UINT64_MAX;
+	HevSocks5HittersEntry *min = NULL;
+	unsigned int i = 0;
+
+	/* conservative update: raise only the cells below the new estimate */
+	for (i=0; i<SKETCH_DEPTH; i++) {
+		cells[i] = &tracker->sketch[i][hitters_hash (self->seeds[i], key) &
+					(SKETCH_WIDTH - 1)];
+		if (*cells[i] < estimate)
+		  estimate = *cells[i];
+	}
+	estimate += value;
+	for (i=0; i<SKETCH_DEPTH; i++) {
+		if (*cells[i] < estimate)
+		  *cells[i] = estimate;
+	}
+
+	/* space-saving replacement: a key that outgrows the smallest
+	 * tracked entry takes its place */
+	for (i=0; i<tracker->top_count; i++) {
+		HevSocks5HittersEntry *entry = &tracker->top[i];
+		if (entry->key == key) {
+			entry->count = estimate;
+			return;
+		}
+		if (!min || (entry->count < min->count))
+		  min = entry;
+	}
+	if (TOP_K > tracker->top_count) {
+		min = &tracker->top[tracker->top_count ++];
+	} else if (estimate <= min->count) {
+		return;
+	}
+	min->key = key;
+	min->count = estimate;
+}
+
+static inline uint64_t
+dest_key (const struct sockaddr_in *dest)
+{
+	return ((uint64_t) dest->sin_addr.s_addr << 16) | dest->sin_port;
+}
+
+void
+hev_socks5_hitters_add_connect (HevSocks5Hitters *self,
+			const struct sockaddr_in *client, const struct sockaddr_in *dest)
+{
+	tracker_add (self, &self->trackers[TRACKER_DEST_CONNS], dest_key (dest), 1);
+	/* unix socket clients have no address to rank */
+	if (AF_INET == client->sin_family)
+	  tracker_add (self, &self->trackers[TRACKER_CLIENT_CONNS],
+				  client->sin_addr.s_addr, 1);
+}
+
+void
+hev_socks5_hitters_add_bytes (HevSocks5Hitters *self,
+			const struct sockaddr_in *client, const struct sockaddr_in *dest,
+			uint64_t bytes)
+{
+	tracker_add (self, &self->trackers[TRACKER_DEST_BYTES], dest_key (dest), bytes);
+	if (AF_INET == client->sin_family)
+	  tracker_add (self, &self->trackers[TRACKER_CLIENT_BYTES],
+				  client->sin_addr.s_addr, bytes);
+}
+
+void
+hev_socks5_hitters_decay (HevSocks5Hitters *self)
+{
+	unsigned int i = 0, j = 0, k = 0;
+
+	/* halve everything so that old traffic fades out */
+	for (i=0; i<TRACKER_MAX; i++) {
+		HevSocks5HittersTracker *tracker = &self->trackers[i];
+
+		for (j=0; j<SKETCH_DEPTH; j++) {
+			for (k=0; k<SKETCH_WIDTH; k++)
+			  tracker->sketch[j][k] >>= 1;
+		}
+		for (j=0, k=0; j<tracker->top_count; j++) {
+			tracker->top[j].count >>= 1;
+			if (tracker->top[j].count)
+			  tracker->top[k++] = tracker->top[j];
+		}
+		tracker->top_count = k;
+	}
+}
+
+static int
+entry_compare (const void *a, const void *b)
+{
+	const HevSocks5HittersEntry *ea = a, *eb = b;
+
+	if (ea->count == eb->count)
+	  return 0;
+	return (ea->count < eb->count) ? 1 : -1;
+}
+
+void
+hev_socks5_hitters_dump (HevSocks5Hitters *self, int fd)
+{
+	unsigned int i = 0, j = 0;
+
+	for (i=0; i<TRACKER_MAX; i++) {
+		HevSocks5HittersTracker *tracker = &self->trackers[i];
+		HevSocks5HittersEntry top[TOP_K];
+
+		memcpy (top, tracker->top, sizeof (HevSocks5HittersEntry) * tracker->top_count);
+		qsort (top, tracker->top_count, sizeof (HevSocks5HittersEntry), entry_compare);
+		dprintf (fd, "hitters %s:\n", tracker_names[i]);
+		for (j=0; j<tracker->top_count; j++) {
+			char addr[INET_ADDRSTRLEN];
+			struct in_addr in;
+
+			if ((TRACKER_DEST_CONNS == i) || (TRACKER_DEST_BYTES == i)) {
+				in.s_addr = top[j].key >> 16;
+				inet_ntop (AF_INET, &in, addr, sizeof (addr));
+				dprintf (fd, "  %s:%u %llu\n", addr, ntohs (top[j].key & 0xffff),
+							(unsigned long long) top[j].count);
+			} else {
+				in.s_addr = top[j].key;
+				inet_ntop (AF_INET, &in, addr, sizeof (addr));
+				dprintf (fd, "  %s %llu\n", addr, (unsigned long long) top[j].count);
+			}
+		}
+	}
+}
+
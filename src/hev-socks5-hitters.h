@@ -0,0 +1,34 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-hitters.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 heavy hitter tracking
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_HITTERS_H__
+#define __HEV_SOCKS5_HITTERS_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct _HevSocks5Hitters HevSocks5Hitters;
+
+HevSocks5Hitters * hev_socks5_hitters_new (void);
+
+HevSocks5Hitters * hev_socks5_hitters_ref (HevSocks5Hitters *self);
+void hev_socks5_hitters_unref (HevSocks5Hitters *self);
+
+void hev_socks5_hitters_add_connect (HevSocks5Hitters *self,
+			const struct sockaddr_in *client, const struct sockaddr_in *dest);
+void hev_socks5_hitters_add_bytes (HevSocks5Hitters *self,
+			const struct sockaddr_in *client, const struct sockaddr_in *dest,
+			uint64_t bytes);
+
+void hev_socks5_hitters_decay (HevSocks5Hitters *self);
+
+void hev_socks5_hitters_dump (HevSocks5Hitters *self, int fd);
+
+#endif /* __HEV_SOCKS5_HITTERS_H__ */
+
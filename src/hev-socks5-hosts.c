@@ -0,0 +1,437 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-hosts.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 static host map
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-hosts.h"
+#include "hev-socks5-stats.h"
+
+#define NAME_MAX_LEN	255
+#define BUCKET_KEYS	2	/* names per displacement, on average */
+#define BUCKET_MAX	64
+#define DISP_MAX	(1U << 20)
+#define SEED_TRIES	8
+
+typedef struct _HevSocks5HostsEntry HevSocks5HostsEntry;
+typedef struct _HevSocks5HostsTable HevSocks5HostsTable;
+
+struct _HevSocks5HostsEntry
+{
+	uint64_t hash;
+	uint32_t addr;
+	uint32_t offset;
+	uint8_t name_len;
+};
+
+/* a minimal perfect hash: the bucket of a name picks the displacement
+ * that moves it to its own slot, one probe per lookup */
+struct _HevSocks5HostsTable
+{
+	uint32_t count;
+	uint32_t bucket_mask;
+	uint32_t build_tries;
+	uint64_t seed;
+	uint32_t *disps;
+	HevSocks5HostsEntry *entries;
+	char *pool;
+};
+
+struct _HevSocks5Hosts
+{
+	unsigned int ref_count;
+	char *path;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reloads;
+	HevSocks5HostsTable *table;
+};
+
+static HevSocks5HostsTable * hosts_table_load (const char *path);
+static void hosts_table_free (HevSocks5HostsTable *table);
+
+HevSocks5Hosts *
+hev_socks5_hosts_new (const char *path)
+{
+	HevSocks5Hosts *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Hosts));
+	if (self) {
+		memset (self, 0, sizeof (HevSocks5Hosts));
+		self->table = hosts_table_load (path);
+		if (!self->table) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		self->path = strdup (path);
+		self->ref_count = 1;
+	}
+
+	return self;
+}
+
+HevSocks5Hosts *
+hev_socks5_hosts_ref (HevSocks5Hosts *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_hosts_unref (HevSocks5Hosts *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			hosts_table_free (self->table);
+			free (self->path);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_hosts_reload (HevSocks5Hosts *self)
+{
+	HevSocks5HostsTable *table = NULL;
+
+	/* lookups run on the loop, a swap is never seen half done */
+	table = hosts_table_load (self->path);
+	if (!table)
+	  return false;
+	hosts_table_free (self->table);
+	self->table = table;
+	self->reloads ++;
+
+	return true;
+}
+
+static inline uint8_t
+hosts_lower (uint8_t c)
+{
+	return (('A' <= c) && ('Z' >= c)) ? (c | 0x20) : c;
+}
+
+static inline uint64_t
+hosts_hash (uint64_t seed, const char *name, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+	size_t i = 0;
+
+	/* seeded FNV-1a over the lower case name */
+	for (i=0; i<len; i++) {
+		hash ^= hosts_lower (name[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static inline uint32_t
+hosts_slot (uint64_t hash, uint32_t disp, uint32_t count)
+{
+	uint64_t x = hash ^ (disp * 0x9e3779b97f4a7c15ULL);
+
+	x ^= x >> 29;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 32;
+
+	/* scaled into [0, count) without a division */
+	return ((x & 0xffffffffULL) * count) >> 32;
+}
+
+static inline bool
+hosts_equal (const char *stored, const char *name, size_t len)
+{
+	size_t i = 0;
+
+	for (i=0; i<len; i++) {
+		if (stored[i] != hosts_lower (name[i]))
+		  return false;
+	}
+
+	return true;
+}
+
+bool
+hev_socks5_hosts_lookup (HevSocks5Hosts *self,
+			const char *name, size_t name_len, uint32_t *addr)
+{
+	HevSocks5HostsTable *table = self->table;
+	HevSocks5HostsEntry *entry = NULL;
+	uint64_t hash = 0;
+
+	/* the root label is implied */
+	if ((1 < name_len) && ('.' == name[name_len - 1]))
+	  name_len --;
+	if ((0 == table->count) || (0 == name_len) || (NAME_MAX_LEN < name_len))
+	  goto miss;
+
+	hash = hosts_hash (table->seed, name, name_len);
+	entry = &table->entries[hosts_slot (hash,
+				table->disps[hash & table->bucket_mask], table->count)];
+	if ((hash != entry->hash) || (name_len != entry->name_len) ||
+				!hosts_equal (&table->pool[entry->offset], name, name_len))
+	  goto miss;
+
+	*addr = entry->addr;
+	self->hits ++;
+	return true;
+
+miss:
+	self->misses ++;
+	return false;
+}
+
+void
+hev_socks5_hosts_dump (HevSocks5Hosts *self, int fd)
+{
+	HevSocks5HostsTable *table = self->table;
+
+	dprintf (fd, "hosts: names %u buckets %u build-tries %u hits %llu misses %llu "
+				"reloads %llu\n", table->count, table->bucket_mask + 1,
+				table->build_tries, (unsigned long long) self->hits,
+				(unsigned long long) self->misses, (unsigned long long) self->reloads);
+}
+
+/* largest bucket first, the later ones fit into what is left */
+static int
+bucket_compare (const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x < *y) - (*x > *y);
+}
+
+static bool
+hosts_table_build (HevSocks5HostsTable *table, HevSocks5HostsEntry *keys)
+{
+	uint32_t buckets = table->bucket_mask + 1;
+	uint32_t *starts = NULL, *order = NULL;
+	uint64_t *sorted = NULL;
+	uint8_t *taken = NULL;
+	uint32_t i = 0, j = 0;
+	bool built = false;
+
+	starts = calloc (buckets + 1, sizeof (uint32_t));
+	order = malloc (table->count * sizeof (uint32_t));
+	sorted = malloc (buckets * sizeof (uint64_t));
+	taken = calloc (table->count, 1);
+	if (!starts || !order || !sorted || !taken)
+	  goto out;
+
+	/* group the names by bucket */
+	for (i=0; i<table->count; i++) {
+		keys[i].hash = hosts_hash (table->seed, &table->pool[keys[i].offset],
+					keys[i].name_len);
+		starts[(keys[i].hash & table->bucket_mask) + 1] ++;
+	}
+	for (i=0; i<buckets; i++) {
+		if (BUCKET_MAX < starts[i + 1])
+		  goto out;
+		sorted[i] = ((uint64_t) starts[i + 1] << 32) | i;
+		starts[i + 1] += starts[i];
+	}
+	/* filled from the ends, starts[b + 1] is left on the first of b */
+	for (i=table->count; 0<i; i--)
+	  order[-- starts[(keys[i - 1].hash & table->bucket_mask) + 1]] = i - 1;
+	qsort (sorted, buckets, sizeof (uint64_t), bucket_compare);
+
+	for (i=0; i<buckets; i++) {
+		uint32_t bucket = sorted[i] & 0xffffffff;
+		uint32_t size = sorted[i] >> 32;
+		uint32_t slots[BUCKET_MAX];
+		uint32_t disp = 0;
+
+		if (0 == size)
+		  break;
+		for (disp=0; disp<DISP_MAX; disp++) {
+			for (j=0; j<size; j++) {
+				HevSocks5HostsEntry *key = &keys[order[starts[bucket + 1] + j]];
+				uint32_t k = 0;
+
+				slots[j] = hosts_slot (key->hash, disp, table->count);
+				if (taken[slots[j]])
+				  break;
+				for (k=0; (k<j) && (slots[k]!=slots[j]); k++);
+				if (k < j)
+				  break;
+			}
+			if (j == size)
+			  break;
+		}
+		if (DISP_MAX == disp)
+		  goto out;
+		table->disps[bucket] = disp;
+		for (j=0; j<size; j++) {
+			taken[slots[j]] = 1;
+			table->entries[slots[j]] = keys[order[starts[bucket + 1] + j]];
+		}
+	}
+	built = true;
+
+out:
+	free (starts);
+	free (order);
+	free (sorted);
+	free (taken);
+
+	return built;
+}
+
+static HevSocks5HostsTable *
+hosts_table_load (const char *path)
+{
+	HevSocks5HostsTable *table = NULL;
+	HevSocks5HostsEntry *list = NULL;
+	uint32_t *seen = NULL;
+	size_t list_len = 0, list_size = 0, pool_len = 0, pool_size = 0;
+	size_t i = 0, capacity = 16;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len = 0;
+	FILE *fp = NULL;
+
+	fp = fopen (path, "r");
+	if (!fp) {
+		fprintf (stderr, "Open hosts file %s failed!\n", path);
+		return NULL;
+	}
+
+	table = calloc (1, sizeof (HevSocks5HostsTable));
+	if (!table)
+	  goto fail;
+
+	/* "ADDR NAME [ALIAS]..." per line, '#' starts a comment */
+	while (0 <= (len = getline (&line, &line_size, fp))) {
+		char *name = NULL, *saveptr = NULL, *comment = NULL;
+		struct in_addr addr;
+
+		comment = strchr (line, '#');
+		if (comment)
+		  *comment = '\0';
+		name = strtok_r (line, " \t\r\n", &saveptr);
+		if (!name || (1 != inet_pton (AF_INET, name, &addr)))
+		  continue;
+
+		while ((name = strtok_r (NULL, " \t\r\n", &saveptr))) {
+			size_t name_len = strlen (name);
+
+			if ((1 < name_len) && ('.' == name[name_len - 1]))
+			  name_len --;
+			if (NAME_MAX_LEN < name_len)
+			  continue;
+
+			if (list_len == list_size) {
+				HevSocks5HostsEntry *new_list = NULL;
+				list_size = list_size ? (list_size * 2) : 1024;
+				new_list = realloc (list, list_size * sizeof (HevSocks5HostsEntry));
+				if (!new_list)
+				  goto fail;
+				list = new_list;
+			}
+			if ((pool_len + name_len) > pool_size) {
+				char *new_pool = NULL;
+				pool_size = (pool_size ? pool_size : 16384) * 2 + name_len;
+				new_pool = realloc (table->pool, pool_size);
+				if (!new_pool)
+				  goto fail;
+				table->pool = new_pool;
+			}
+			for (i=0; i<name_len; i++)
+			  table->pool[pool_len + i] = hosts_lower (name[i]);
+			list[list_len].addr = addr.s_addr;
+			list[list_len].offset = pool_len;
+			list[list_len].name_len = name_len;
+			list_len ++;
+			pool_len += name_len;
+		}
+	}
+
+	/* the first line naming a host wins, as with the resolver */
+	while (capacity < (list_len * 2))
+	  capacity <<= 1;
+	seen = calloc (capacity, sizeof (uint32_t));
+	if (!seen)
+	  goto fail;
+	for (i=0; i<list_len; i++) {
+		const char *name = &table->pool[list[i].offset];
+		size_t j = hosts_hash (0, name, list[i].name_len) & (capacity - 1);
+
+		for (; seen[j]; j=(j+1)&(capacity-1)) {
+			HevSocks5HostsEntry *other = &list[seen[j] - 1];
+			if ((other->name_len == list[i].name_len) &&
+						(0 == memcmp (&table->pool[other->offset], name, other->name_len)))
+			  break;
+		}
+		if (seen[j])
+		  continue;
+		seen[j] = table->count + 1;
+		list[table->count ++] = list[i];
+	}
+	if (0 == table->count)
+	  goto done;
+
+	capacity = 1;
+	while ((capacity * BUCKET_KEYS) < table->count)
+	  capacity <<= 1;
+	table->bucket_mask = capacity - 1;
+	table->disps = calloc (capacity, sizeof (uint32_t));
+	table->entries = calloc (table->count, sizeof (HevSocks5HostsEntry));
+	if (!table->disps || !table->entries)
+	  goto fail;
+	table->seed = hev_socks5_stats_clock () ^ ((uint64_t) getpid () << 32);
+	for (;;) {
+		table->build_tries ++;
+		if (hosts_table_build (table, list))
+		  break;
+		if (SEED_TRIES == table->build_tries) {
+			fprintf (stderr, "Build hosts map %s failed!\n", path);
+			goto fail;
+		}
+		table->seed = hosts_hash (table->seed, path, strlen (path));
+		memset (table->disps, 0, capacity * sizeof (uint32_t));
+	}
+
+done:
+	free (seen);
+	free (list);
+	free (line);
+	fclose (fp);
+
+	return table;
+
+fail:
+	free (seen);
+	free (list);
+	free (line);
+	fclose (fp);
+	hosts_table_free (table);
+
+	return NULL;
+}
+
+static void
+hosts_table_free (HevSocks5HostsTable *table)
+{
+	if (table) {
+		free (table->disps);
+		free (table->entries);
+		free (table->pool);
+		free (table);
+	}
+}
+
@@ -0,0 +1,35 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-hosts.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 static host map
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_HOSTS_H__
+#define __HEV_SOCKS5_HOSTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _HevSocks5Hosts HevSocks5Hosts;
+
+/* an /etc/hosts style file, IPv4 lines only */
+HevSocks5Hosts * hev_socks5_hosts_new (const char *path);
+
+HevSocks5Hosts * hev_socks5_hosts_ref (HevSocks5Hosts *self);
+void hev_socks5_hosts_unref (HevSocks5Hosts *self);
+
+/* the old map stays in service until a new one is fully built */
+bool hev_socks5_hosts_reload (HevSocks5Hosts *self);
+
+/* case insensitive, addr in network order */
+bool hev_socks5_hosts_lookup (HevSocks5Hosts *self,
+			const char *name, size_t name_len, uint32_t *addr);
+
+void hev_socks5_hosts_dump (HevSocks5Hosts *self, int fd);
+
+#endif /* __HEV_SOCKS5_HOSTS_H__ */
+
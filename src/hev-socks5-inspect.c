@@ -0,0 +1,279 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-inspect.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 live session listing
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "hev-socks5-inspect.h"
+#include "hev-socks5-reply.h"
+
+#define OUT_LINE	384
+
+#define USAGE	"usage: sessions [step=NAME] [class=NAME] [client=ADDR] [dest=ADDR[:PORT]] " \
+	"[idle=SECONDS] [age=SECONDS] [sort=age|idle|bytes|fill] [limit=N]\n"
+
+enum
+{
+	SORT_NONE,
+	SORT_AGE,
+	SORT_IDLE,
+	SORT_BYTES,
+	SORT_FILL,
+};
+
+struct _HevSocks5Inspect
+{
+	unsigned int sort;
+	unsigned int limit;
+	unsigned int walked;
+	bool summary;
+	char step[32];
+	char class[16];
+	struct in_addr client;
+	struct in_addr dest;
+	unsigned short dest_port;
+	uint64_t min_idle;
+	uint64_t min_age;
+	HevSocks5SessionInfo *infos;
+	size_t count;
+	size_t size;
+	size_t next;
+	HevSocks5Reply *reply;
+};
+
+static size_t inspect_fill (char *buf, size_t len, void *data);
+
+static bool
+parse_arg (HevSocks5Inspect *self, char *arg)
+{
+	char *value = strchr (arg, '=');
+
+	if (!value)
+	  return false;
+	*value++ = '\0';
+
+	if (0 == strcmp (arg, "step")) {
+		if (sizeof (self->step) <= strlen (value))
+		  return false;
+		strcpy (self->step, value);
+	} else if (0 == strcmp (arg, "class")) {
+		if (sizeof (self->class) <= strlen (value))
+		  return false;
+		strcpy (self->class, value);
+	} else if (0 == strcmp (arg, "client")) {
+		return 1 == inet_pton (AF_INET, value, &self->client);
+	} else if (0 == strcmp (arg, "dest")) {
+		char *port = strchr (value, ':');
+
+		if (port) {
+			*port++ = '\0';
+			self->dest_port = strtoul (port, NULL, 10);
+		}
+		return 1 == inet_pton (AF_INET, value, &self->dest);
+	} else if (0 == strcmp (arg, "idle")) {
+		self->min_idle = strtoull (value, NULL, 10) * 1000000000ULL;
+	} else if (0 == strcmp (arg, "age")) {
+		self->min_age = strtoull (value, NULL, 10) * 1000000000ULL;
+	} else if (0 == strcmp (arg, "sort")) {
+		if (0 == strcmp (value, "age"))
+		  self->sort = SORT_AGE;
+		else if (0 == strcmp (value, "idle"))
+		  self->sort = SORT_IDLE;
+		else if (0 == strcmp (value, "bytes"))
+		  self->sort = SORT_BYTES;
+		else if (0 == strcmp (value, "fill"))
+		  self->sort = SORT_FILL;
+		else
+		  return false;
+	} else if (0 == strcmp (arg, "limit")) {
+		self->limit = strtoul (value, NULL, 10);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+HevSocks5Inspect *
+hev_socks5_inspect_new (const char *args, int fd)
+{
+	HevSocks5Inspect *self = NULL;
+	char buf[256], *arg = NULL, *saveptr = NULL;
+
+	if (sizeof (buf) <= strlen (args)) {
+		dprintf (fd, USAGE);
+		return NULL;
+	}
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Inspect));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5Inspect));
+
+	strcpy (buf, args);
+	for (arg=strtok_r (buf, " ", &saveptr); arg; arg=strtok_r (NULL, " ", &saveptr)) {
+		if (!parse_arg (self, arg)) {
+			dprintf (fd, USAGE);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+	}
+
+	self->reply = hev_socks5_reply_new (fd, inspect_fill, self);
+	if (!self->reply) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+
+	return self;
+}
+
+void
+hev_socks5_inspect_free (HevSocks5Inspect *self)
+{
+	hev_socks5_reply_free (self->reply);
+	free (self->infos);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+void
+hev_socks5_inspect_add (HevSocks5Inspect *self, const HevSocks5SessionInfo *info)
+{
+	self->walked ++;
+	if (self->step[0] && (0 != strcmp (self->step, info->step)))
+	  return;
+	if (self->class[0] && (0 != strcmp (self->class, info->class)))
+	  return;
+	if (self->client.s_addr && (self->client.s_addr != info->peer.sin_addr.s_addr))
+	  return;
+	if (self->dest.s_addr && (self->dest.s_addr != info->addr.sin_addr.s_addr))
+	  return;
+	if (self->dest_port && (htons (self->dest_port) != info->addr.sin_port))
+	  return;
+	if ((self->min_idle > info->idle) || (self->min_age > info->age))
+	  return;
+
+	if (self->count == self->size) {
+		size_t size = self->size ? self->size * 2 : 64;
+		HevSocks5SessionInfo *infos = NULL;
+
+		infos = realloc (self->infos, size * sizeof (HevSocks5SessionInfo));
+		if (!infos)
+		  return;
+		self->infos = infos;
+		self->size = size;
+	}
+	self->infos[self->count ++] = *info;
+}
+
+/* largest first */
+static int
+age_compare (const void *a, const void *b)
+{
+	const HevSocks5SessionInfo *x = a, *y = b;
+
+	return (x->age < y->age) - (x->age > y->age);
+}
+
+static int
+idle_compare (const void *a, const void *b)
+{
+	const HevSocks5SessionInfo *x = a, *y = b;
+
+	return (x->idle < y->idle) - (x->idle > y->idle);
+}
+
+static int
+bytes_compare (const void *a, const void *b)
+{
+	const HevSocks5SessionInfo *x = a, *y = b;
+	uint64_t m = x->forward_bytes + x->backward_bytes;
+	uint64_t n = y->forward_bytes + y->backward_bytes;
+
+	return (m < n) - (m > n);
+}
+
+static int
+fill_compare (const void *a, const void *b)
+{
+	const HevSocks5SessionInfo *x = a, *y = b;
+	size_t m = x->forward_fill + x->backward_fill;
+	size_t n = y->forward_fill + y->backward_fill;
+
+	return (m < n) - (m > n);
+}
+
+void
+hev_socks5_inspect_sort (HevSocks5Inspect *self)
+{
+	static int (*compares[]) (const void *, const void *) =
+	{
+		NULL, age_compare, idle_compare, bytes_compare, fill_compare,
+	};
+
+	if (compares[self->sort] && self->count)
+	  qsort (self->infos, self->count, sizeof (HevSocks5SessionInfo),
+				  compares[self->sort]);
+	if (self->limit && (self->limit < self->count))
+	  self->count = self->limit;
+}
+
+static void
+format_addr (const struct sockaddr_in *addr, char *buf, size_t len)
+{
+	char ip[INET_ADDRSTRLEN];
+
+	if (AF_INET != addr->sin_family) {
+		snprintf (buf, len, "-");
+		return;
+	}
+	inet_ntop (AF_INET, &addr->sin_addr, ip, sizeof (ip));
+	snprintf (buf, len, "%s:%u", ip, ntohs (addr->sin_port));
+}
+
+/* whole lines only, 0 when nothing is left */
+static size_t
+inspect_fill (char *buf, size_t len, void *data)
+{
+	HevSocks5Inspect *self = data;
+	size_t off = 0;
+
+	while ((self->next < self->count) && ((len - OUT_LINE) > off)) {
+		const HevSocks5SessionInfo *info = &self->infos[self->next ++];
+		char peer[32], addr[32];
+
+		format_addr (&info->peer, peer, sizeof (peer));
+		format_addr (&info->addr, addr, sizeof (addr));
+		off += snprintf (buf + off, OUT_LINE,
+					"session %llu step %s class %s client %s dest %s age %llums "
+					"idle %llums up %llu down %llu ring %zu/%zu %zu/%zu\n",
+					(unsigned long long) info->id, info->step, info->class, peer, addr,
+					(unsigned long long) (info->age / 1000000),
+					(unsigned long long) (info->idle / 1000000),
+					(unsigned long long) info->forward_bytes,
+					(unsigned long long) info->backward_bytes,
+					info->forward_fill, info->ring_size,
+					info->backward_fill, info->ring_size);
+	}
+	if ((self->next == self->count) && !self->summary && ((len - OUT_LINE) > off)) {
+		off += snprintf (buf + off, OUT_LINE,
+					"sessions: listed %zu walked %u\n", self->count, self->walked);
+		self->summary = true;
+	}
+
+	return off;
+}
+
+bool
+hev_socks5_inspect_write (HevSocks5Inspect *self)
+{
+	return hev_socks5_reply_write (self->reply);
+}
+
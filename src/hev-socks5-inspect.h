@@ -0,0 +1,33 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-inspect.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 live session listing
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_INSPECT_H__
+#define __HEV_SOCKS5_INSPECT_H__
+
+#include <stdbool.h>
+
+#include "hev-socks5-session.h"
+
+typedef struct _HevSocks5Inspect HevSocks5Inspect;
+
+/* parses the filter and sort arguments and takes its own copy of fd,
+ * NULL after writing the usage to fd */
+HevSocks5Inspect * hev_socks5_inspect_new (const char *args, int fd);
+void hev_socks5_inspect_free (HevSocks5Inspect *self);
+
+/* kept when it passes the filter */
+void hev_socks5_inspect_add (HevSocks5Inspect *self, const HevSocks5SessionInfo *info);
+void hev_socks5_inspect_sort (HevSocks5Inspect *self);
+
+/* writes what the reader takes without blocking, true once all is out
+ * or the reader is gone */
+bool hev_socks5_inspect_write (HevSocks5Inspect *self);
+
+#endif /* __HEV_SOCKS5_INSPECT_H__ */
+
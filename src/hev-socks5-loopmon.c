@@ -0,0 +1,185 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-loopmon.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 event loop lag and slow callback monitor
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hev-socks5-loopmon.h"
+
+#define TICK		100	/* ms */
+#define LAG_BUCKETS	18	/* <16us, <32us, ... >=1s */
+#define WORST_MAX	8
+
+typedef struct _HevSocks5LoopMonSlow HevSocks5LoopMonSlow;
+
+struct _HevSocks5LoopMonSlow
+{
+	HevSocks5LoopMonSource source;
+	uint64_t duration;	/* ns */
+	time_t time;
+};
+
+static const char *source_names[HEV_SOCKS5_LOOPMON_MAX] =
+{
+	"listener",
+	"session",
+	"relay",
+	"dispatch",
+	"timeout",
+	"deadline",
+	"sample",
+	"control",
+	"tunnel",
+	"busypoll",
+};
+
+uint64_t hev_socks5_loopmon_threshold;
+
+static HevEventSource *tick_source;
+static uint64_t tick_expected;
+static uint64_t lag_samples;
+static uint64_t lag_max;
+static uint64_t lag_buckets[LAG_BUCKETS];
+static uint64_t slow_counts[HEV_SOCKS5_LOOPMON_MAX];
+static uint64_t slow_max[HEV_SOCKS5_LOOPMON_MAX];
+static HevSocks5LoopMonSlow worst[WORST_MAX];
+static unsigned int worst_count;
+
+static bool
+tick_source_handler (void *data)
+{
+	uint64_t now = hev_socks5_stats_clock ();
+	uint64_t lag = 0, us = 0;
+	unsigned int bucket = 0;
+
+	/* how late the loop came back to a timer nothing else delays */
+	if (now > tick_expected)
+	  lag = now - tick_expected;
+	tick_expected += TICK * 1000000ULL;
+	if (tick_expected < now)
+	  tick_expected = now + TICK * 1000000ULL;
+
+	for (us=lag/1000>>4; us && ((LAG_BUCKETS - 1) > bucket); us>>=1)
+	  bucket ++;
+	lag_buckets[bucket] ++;
+	lag_samples ++;
+	if (lag > lag_max)
+	  lag_max = lag;
+
+	return true;
+}
+
+void
+hev_socks5_loopmon_start (HevEventLoop *loop, unsigned int threshold_us)
+{
+	if (tick_source)
+	  return;
+	hev_socks5_loopmon_threshold = threshold_us * 1000ULL;
+
+	/* just below the signals, above every relay and service source */
+	tick_source = hev_event_source_timeout_new (TICK);
+	hev_event_source_set_priority (tick_source, 2);
+	hev_event_source_set_callback (tick_source, tick_source_handler, NULL, NULL);
+	hev_event_loop_add_source (loop, tick_source);
+	hev_event_source_unref (tick_source);
+	tick_expected = hev_socks5_stats_clock () + TICK * 1000000ULL;
+}
+
+void
+hev_socks5_loopmon_stop (HevEventLoop *loop)
+{
+	if (!tick_source)
+	  return;
+	hev_event_loop_del_source (loop, tick_source);
+	tick_source = NULL;
+	hev_socks5_loopmon_threshold = 0;
+}
+
+void
+hev_socks5_loopmon_record (HevSocks5LoopMonSource source, uint64_t start)
+{
+	uint64_t duration = hev_socks5_stats_clock () - start;
+	HevSocks5LoopMonSlow *slot = NULL;
+	unsigned int i = 0;
+
+	if (duration < hev_socks5_loopmon_threshold)
+	  return;
+	slow_counts[source] ++;
+	if (duration > slow_max[source])
+	  slow_max[source] = duration;
+
+	/* keep the slowest few, the fastest of them makes room */
+	if (WORST_MAX > worst_count) {
+		slot = &worst[worst_count ++];
+	} else {
+		for (i=0; i<WORST_MAX; i++) {
+			if (!slot || (worst[i].duration < slot->duration))
+			  slot = &worst[i];
+		}
+		if (duration <= slot->duration)
+		  return;
+	}
+	slot->source = source;
+	slot->duration = duration;
+	slot->time = time (NULL);
+}
+
+static int
+slow_compare (const void *a, const void *b)
+{
+	const HevSocks5LoopMonSlow *sa = a, *sb = b;
+
+	if (sa->duration == sb->duration)
+	  return 0;
+	return (sa->duration < sb->duration) ? 1 : -1;
+}
+
+void
+hev_socks5_loopmon_dump (int fd)
+{
+	HevSocks5LoopMonSlow sorted[WORST_MAX];
+	unsigned int i = 0;
+
+	if (!tick_source)
+	  return;
+
+	dprintf (fd, "loop lag: samples %llu max %lluus\n",
+				(unsigned long long) lag_samples,
+				(unsigned long long) (lag_max / 1000));
+	for (i=0; i<LAG_BUCKETS; i++) {
+		if (0 == lag_buckets[i])
+		  continue;
+		if ((LAG_BUCKETS - 1) == i)
+		  dprintf (fd, "  >=%uus %llu\n", 16U << (i - 1),
+					  (unsigned long long) lag_buckets[i]);
+		else
+		  dprintf (fd, "  <%uus %llu\n", 16U << i,
+					  (unsigned long long) lag_buckets[i]);
+	}
+
+	for (i=0; i<HEV_SOCKS5_LOOPMON_MAX; i++) {
+		dprintf (fd, "slow callbacks %s: %llu max %lluus\n", source_names[i],
+					(unsigned long long) slow_counts[i],
+					(unsigned long long) (slow_max[i] / 1000));
+	}
+	memcpy (sorted, worst, sizeof (HevSocks5LoopMonSlow) * worst_count);
+	qsort (sorted, worst_count, sizeof (HevSocks5LoopMonSlow), slow_compare);
+	for (i=0; i<worst_count; i++) {
+		struct tm tm;
+		char stamp[32];
+
+		localtime_r (&sorted[i].time, &tm);
+		strftime (stamp, sizeof (stamp), "%F %T", &tm);
+		dprintf (fd, "  worst %s %lluus at %s\n", source_names[sorted[i].source],
+					(unsigned long long) (sorted[i].duration / 1000), stamp);
+	}
+}
+
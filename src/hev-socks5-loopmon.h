@@ -0,0 +1,59 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-loopmon.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 event loop lag and slow callback monitor
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_LOOPMON_H__
+#define __HEV_SOCKS5_LOOPMON_H__
+
+#include <stdint.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-stats.h"
+
+typedef enum _HevSocks5LoopMonSource HevSocks5LoopMonSource;
+
+enum _HevSocks5LoopMonSource
+{
+	HEV_SOCKS5_LOOPMON_LISTENER,
+	HEV_SOCKS5_LOOPMON_SESSION,
+	HEV_SOCKS5_LOOPMON_RELAY,
+	HEV_SOCKS5_LOOPMON_DISPATCH,
+	HEV_SOCKS5_LOOPMON_TIMEOUT,
+	HEV_SOCKS5_LOOPMON_DEADLINE,
+	HEV_SOCKS5_LOOPMON_SAMPLE,
+	HEV_SOCKS5_LOOPMON_CONTROL,
+	HEV_SOCKS5_LOOPMON_TUNNEL,
+	HEV_SOCKS5_LOOPMON_BUSYPOLL,
+	HEV_SOCKS5_LOOPMON_MAX,
+};
+
+/* callbacks slower than threshold_us are recorded, 0 disables */
+void hev_socks5_loopmon_start (HevEventLoop *loop, unsigned int threshold_us);
+void hev_socks5_loopmon_stop (HevEventLoop *loop);
+
+void hev_socks5_loopmon_record (HevSocks5LoopMonSource source, uint64_t start);
+
+/* brackets a callback, one load and branch while the monitor is off */
+static inline uint64_t
+hev_socks5_loopmon_enter (void)
+{
+	extern uint64_t hev_socks5_loopmon_threshold;
+	return hev_socks5_loopmon_threshold ? hev_socks5_stats_clock () : 0;
+}
+
+static inline void
+hev_socks5_loopmon_leave (HevSocks5LoopMonSource source, uint64_t start)
+{
+	if (start)
+	  hev_socks5_loopmon_record (source, start);
+}
+
+void hev_socks5_loopmon_dump (int fd);
+
+#endif /* __HEV_SOCKS5_LOOPMON_H__ */
+
@@ -0,0 +1,261 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-negcache.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 negative connect cache
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-negcache.h"
+#include "hev-socks5-stats.h"
+
+#define TABLE_SIZE	256	/* power of 2 */
+#define TABLE_PROBES	8
+#define BACKOFF_MIN	1000	/* ms */
+#define BACKOFF_MAX	60000	/* ms */
+#define PROBE_LEASE	5000	/* ms, a probe that never reported back */
+
+typedef struct _HevSocks5NegCacheEntry HevSocks5NegCacheEntry;
+
+struct _HevSocks5NegCacheEntry
+{
+	uint64_t key;		/* 0 for a free slot */
+	uint64_t until;		/* failing until, ns */
+	uint64_t probe_until;	/* a probe is out until, ns */
+	unsigned int backoff;	/* ms */
+	unsigned int failures;
+	int error;
+};
+
+struct _HevSocks5NegCache
+{
+	unsigned int ref_count;
+	unsigned int count;
+	uint64_t hits;
+	HevSocks5NegCacheEntry table[TABLE_SIZE];
+};
+
+HevSocks5NegCache *
+hev_socks5_negcache_new (void)
+{
+	HevSocks5NegCache *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5NegCache));
+	if (self) {
+		memset (self, 0, sizeof (HevSocks5NegCache));
+		self->ref_count = 1;
+	}
+
+	return self;
+}
+
+HevSocks5NegCache *
+hev_socks5_negcache_ref (HevSocks5NegCache *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_negcache_unref (HevSocks5NegCache *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count)
+		  HEV_MEMORY_ALLOCATOR_FREE (self);
+	}
+}
+
+static inline uint64_t
+negcache_key (const struct sockaddr_in *dest)
+{
+	/* a marker bit keeps the key of 0.0.0.0:0 non zero */
+	return ((uint64_t) dest->sin_addr.s_addr << 16) | dest->sin_port | (1ULL << 48);
+}
+
+static HevSocks5NegCacheEntry *
+negcache_lookup (HevSocks5NegCache *self, uint64_t key, bool insert)
+{
+	HevSocks5NegCacheEntry *victim = NULL;
+	unsigned int i = 0, index = 0;
+
+	index = (key * 0x9e3779b97f4a7c15ULL) >> 56;
+	for (i=0; i<TABLE_PROBES; i++) {
+		HevSocks5NegCacheEntry *entry = &self->table[(index + i) & (TABLE_SIZE - 1)];
+		if (entry->key == key)
+		  return entry;
+		if (!insert)
+		  continue;
+		if (0 == entry->key) {
+			if (!victim || victim->key)
+			  victim = entry;
+			continue;
+		}
+		/* full, the entry closest to expiry makes room */
+		if (!victim || (victim->key && (entry->until < victim->until)))
+		  victim = entry;
+	}
+	if (!victim)
+	  return NULL;
+	if (victim->key)
+	  self->count --;
+	memset (victim, 0, sizeof (HevSocks5NegCacheEntry));
+	victim->key = key;
+	self->count ++;
+
+	return victim;
+}
+
+static inline void
+negcache_remove (HevSocks5NegCache *self, HevSocks5NegCacheEntry *entry)
+{
+	entry->key = 0;
+	self->count --;
+}
+
+bool
+hev_socks5_negcache_check (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest, int *error)
+{
+	HevSocks5NegCacheEntry *entry = NULL;
+	uint64_t now = 0;
+
+	if (0 == self->count)
+	  return false;
+	entry = negcache_lookup (self, negcache_key (dest), false);
+	if (!entry)
+	  return false;
+
+	now = hev_socks5_stats_clock ();
+	if ((now < entry->until) || (now < entry->probe_until)) {
+		*error = entry->error;
+		self->hits ++;
+		return true;
+	}
+	/* nothing heard for a whole maximum backoff, start over */
+	if ((now - entry->until) > (BACKOFF_MAX * 1000000ULL)) {
+		negcache_remove (self, entry);
+		return false;
+	}
+	/* this connect is the probe, the others keep failing fast */
+	entry->probe_until = now + PROBE_LEASE * 1000000ULL;
+
+	return false;
+}
+
+void
+hev_socks5_negcache_failure (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest, int error)
+{
+	HevSocks5NegCacheEntry *entry = NULL;
+	uint64_t now = 0;
+
+	switch (error) {
+	case ECONNREFUSED:
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+	case ETIMEDOUT:
+		break;
+	default:
+		return;
+	}
+
+	entry = negcache_lookup (self, negcache_key (dest), true);
+	if (!entry)
+	  return;
+	now = hev_socks5_stats_clock ();
+	entry->failures ++;
+	entry->error = error;
+	/* connects already out when the entry was made fail on their own,
+	 * only the probe or an attempt past the backoff extends it */
+	if (entry->backoff && !entry->probe_until && (now < entry->until))
+	  return;
+	/* exponential backoff, reset by a successful connect */
+	if (entry->backoff)
+	  entry->backoff = (BACKOFF_MAX < (entry->backoff * 2)) ?
+		  BACKOFF_MAX : (entry->backoff * 2);
+	else
+	  entry->backoff = BACKOFF_MIN;
+	entry->until = now + entry->backoff * 1000000ULL;
+	entry->probe_until = 0;
+}
+
+void
+hev_socks5_negcache_success (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest)
+{
+	HevSocks5NegCacheEntry *entry = NULL;
+
+	if (0 == self->count)
+	  return;
+	entry = negcache_lookup (self, negcache_key (dest), false);
+	if (entry)
+	  negcache_remove (self, entry);
+}
+
+size_t
+hev_socks5_negcache_save (HevSocks5NegCache *self, void *buf, size_t len)
+{
+	HevSocks5NegCacheEntry *entries = buf;
+	unsigned int i = 0, count = 0;
+
+	/* monotonic deadlines stay valid in another process on this host */
+	for (i=0; i<TABLE_SIZE; i++) {
+		if (0 == self->table[i].key)
+		  continue;
+		if (len < (sizeof (HevSocks5NegCacheEntry) * (count + 1)))
+		  break;
+		entries[count ++] = self->table[i];
+	}
+
+	return sizeof (HevSocks5NegCacheEntry) * count;
+}
+
+void
+hev_socks5_negcache_load (HevSocks5NegCache *self, const void *buf, size_t len)
+{
+	const HevSocks5NegCacheEntry *entries = buf;
+	unsigned int i = 0;
+
+	for (i=0; i<(len / sizeof (HevSocks5NegCacheEntry)); i++) {
+		HevSocks5NegCacheEntry *entry = NULL;
+
+		if (0 == entries[i].key)
+		  continue;
+		entry = negcache_lookup (self, entries[i].key, true);
+		if (entry)
+		  *entry = entries[i];
+	}
+}
+
+void
+hev_socks5_negcache_dump (HevSocks5NegCache *self, int fd)
+{
+	uint64_t now = hev_socks5_stats_clock ();
+	unsigned int i = 0;
+
+	dprintf (fd, "negcache: entries %u hits %llu\n", self->count,
+				(unsigned long long) self->hits);
+	for (i=0; i<TABLE_SIZE; i++) {
+		HevSocks5NegCacheEntry *entry = &self->table[i];
+		char addr[INET_ADDRSTRLEN];
+		struct in_addr in;
+
+		if (0 == entry->key)
+		  continue;
+		in.s_addr = (entry->key >> 16) & 0xffffffff;
+		inet_ntop (AF_INET, &in, addr, sizeof (addr));
+		dprintf (fd, "  %s:%u %s failures %u backoff %ums remaining %llums\n",
+					addr, ntohs (entry->key & 0xffff), strerror (entry->error),
+					entry->failures, entry->backoff, (unsigned long long)
+					((now < entry->until) ? (entry->until - now) / 1000000 : 0));
+	}
+}
+
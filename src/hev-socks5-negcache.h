@@ -0,0 +1,41 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-negcache.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 negative connect cache
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_NEGCACHE_H__
+#define __HEV_SOCKS5_NEGCACHE_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+typedef struct _HevSocks5NegCache HevSocks5NegCache;
+
+HevSocks5NegCache * hev_socks5_negcache_new (void);
+
+HevSocks5NegCache * hev_socks5_negcache_ref (HevSocks5NegCache *self);
+void hev_socks5_negcache_unref (HevSocks5NegCache *self);
+
+/* true while dest is known to fail, with the errno it failed with; once
+ * the backoff ran out one connect at a time is let through as a probe */
+bool hev_socks5_negcache_check (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest, int *error);
+/* only refused, unreachable and timed out connects are remembered */
+void hev_socks5_negcache_failure (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest, int error);
+void hev_socks5_negcache_success (HevSocks5NegCache *self,
+			const struct sockaddr_in *dest);
+
+/* live entries as an opaque blob for a restarted process */
+size_t hev_socks5_negcache_save (HevSocks5NegCache *self, void *buf, size_t len);
+void hev_socks5_negcache_load (HevSocks5NegCache *self, const void *buf, size_t len);
+
+void hev_socks5_negcache_dump (HevSocks5NegCache *self, int fd);
+
+#endif /* __HEV_SOCKS5_NEGCACHE_H__ */
+
@@ -0,0 +1,93 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-reply.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 control reply writer
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-reply.h"
+
+#define OUT_SIZE	16384
+#define WRITE_ROUNDS	4
+#define STALL_MAX	5000	/* calls, about 5 s at one per ms */
+
+struct _HevSocks5Reply
+{
+	int fd;
+	unsigned int stalls;
+	HevSocks5ReplyFill fill;
+	void *data;
+	size_t out_len;
+	size_t out_off;
+	char out[OUT_SIZE];
+};
+
+HevSocks5Reply *
+hev_socks5_reply_new (int fd, HevSocks5ReplyFill fill, void *data)
+{
+	HevSocks5Reply *self = NULL;
+	int nonblock = 1;
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Reply));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5Reply));
+	self->fill = fill;
+	self->data = data;
+
+	/* the control socket closes its copy once the command returns */
+	self->fd = dup (fd);
+	if (0 > self->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	ioctl (self->fd, FIONBIO, (char *) &nonblock);
+
+	return self;
+}
+
+void
+hev_socks5_reply_free (HevSocks5Reply *self)
+{
+	close (self->fd);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+bool
+hev_socks5_reply_write (HevSocks5Reply *self)
+{
+	unsigned int i = 0;
+
+	/* a few buffers per call keep each pass short */
+	for (i=0; i<WRITE_ROUNDS; i++) {
+		ssize_t size = 0;
+
+		if (self->out_off == self->out_len) {
+			self->out_off = 0;
+			self->out_len = self->fill (self->out, OUT_SIZE, self->data);
+			if (0 == self->out_len)
+			  return true;
+		}
+		size = write (self->fd, self->out + self->out_off,
+					self->out_len - self->out_off);
+		if (0 > size) {
+			if (EAGAIN != errno)
+			  return true;
+			/* a reader that stopped reading is dropped */
+			return STALL_MAX < ++ self->stalls;
+		}
+		self->out_off += size;
+		self->stalls = 0;
+	}
+
+	return false;
+}
+
@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-reply.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 control reply writer
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_REPLY_H__
+#define __HEV_SOCKS5_REPLY_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct _HevSocks5Reply HevSocks5Reply;
+
+/* puts up to len bytes in buf, 0 once everything was handed out */
+typedef size_t (*HevSocks5ReplyFill) (char *buf, size_t len, void *data);
+
+/* takes its own non-blocking copy of fd */
+HevSocks5Reply * hev_socks5_reply_new (int fd, HevSocks5ReplyFill fill, void *data);
+void hev_socks5_reply_free (HevSocks5Reply *self);
+
+/* writes what the reader takes without blocking, true once all is out
+ * or the reader is gone */
+bool hev_socks5_reply_write (HevSocks5Reply *self);
+
+#endif /* __HEV_SOCKS5_REPLY_H__ */
+
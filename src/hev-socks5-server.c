@@ -8,71 +8,391 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/memfd.h>
 
+#include "hev-config.h"
 #include "hev-socks5-server.h"
 #include "hev-socks5-session.h"
+#include "hev-socks5-stats.h"
+#include "hev-socks5-auth.h"
+#include "hev-socks5-hosts.h"
+#include "hev-socks5-egress.h"
+#include "hev-socks5-tuning.h"
+#include "hev-socks5-sockmap.h"
+#include "hev-socks5-accesslog.h"
+#include "hev-socks5-hitters.h"
+#include "hev-socks5-control.h"
+#include "hev-socks5-dispatch.h"
+#include "hev-socks5-tls.h"
+#include "hev-socks5-flows.h"
+#include "hev-socks5-negcache.h"
+#include "hev-socks5-loopmon.h"
+#include "hev-socks5-budget.h"
+#include "hev-socks5-handoff.h"
+#include "hev-socks5-tunnel.h"
+#include "hev-socks5-inspect.h"
+#include "hev-socks5-reply.h"
+#include "hev-socks5-classes.h"
+#include "hev-socks5-busypoll.h"
 
 #define TIMEOUT		(30 * 1000)
+#define DEADLINE_TIMEOUT	(1000)
+#define WALK_INTERVAL	(1)
+#define WALK_BATCH	256
+#define MAX_WALKS	4
+#define HANDOFF_INTERVAL	(1000)
+#define HANDOFF_TIMEOUT	10	/* intervals without progress */
+
+typedef struct _HevSocks5Listener HevSocks5Listener;
+typedef struct _HevSocks5Inherited HevSocks5Inherited;
+typedef struct _HevSocks5Walk HevSocks5Walk;
+typedef struct _HevSocks5Transfer HevSocks5Transfer;
+
+struct _HevSocks5Listener
+{
+	int fd;
+	char *path;
+	char name[128];
+	unsigned int active;
+	unsigned long long accepted;
+	unsigned long long accept_failed;
+	const HevSocks5Tuning *tuning;
+	HevSocks5Tls *tls;
+	HevSocks5Class class;
+	char forward_host[256];	/* empty for a SOCKS5 listener */
+	unsigned short forward_port;
+	HevEventSource *source;
+	HevSocks5Server *server;
+};
+
+/* a listen fd handed over, until a configured listener claims it */
+struct _HevSocks5Inherited
+{
+	int fd;
+	char name[128];
+};
+
+/* a control reply in progress; a session listing takes a batch of the
+ * list per tick, other replies are rendered up front and streamed */
+struct _HevSocks5Walk
+{
+	bool walking;
+	int buffer_fd;
+	HevSList *cursor;
+	HevSocks5Inspect *inspect;
+	HevSocks5Reply *reply;
+	HevEventSource *source;
+	HevSocks5Server *server;
+};
+
+/* a handoff in progress on the old side, its relays sit off the loop
+ * until the new process acks the ones it adopted */
+struct _HevSocks5Transfer
+{
+	int fd;
+	bool cache_sent;
+	bool ended;
+	unsigned int idle;
+	unsigned int sent_count;
+	HevSList *listener;
+	HevSList *frozen_list;
+	HevSList *sent_list;	/* newest first */
+	uint8_t out[HEV_SOCKS5_HANDOFF_RECORD_MAX];
+	size_t out_len;
+	size_t out_off;
+	int fds[HEV_SOCKS5_HANDOFF_FDS_MAX];
+	unsigned int fd_count;
+	uint8_t in[HEV_SOCKS5_HANDOFF_RECORD_MAX];
+	size_t in_len;
+	HevEventSource *source;
+	HevEventSource *timer_source;
+};
 
 struct _HevSocks5Server
 {
-	int listen_fd;
 	unsigned int ref_count;
-	HevEventSource *listener_source;
+	HevSList *listener_list;
 	HevEventSource *timeout_source;
+	HevEventSource *deadline_source;
+	HevEventSource *sample_source;
 	HevSList *session_list;
+	HevSocks5SessionDeadlines deadlines;
+	unsigned int connect_stagger;
+	bool early_reply;
+	bool handed_off;
+	bool accept_paused;	/* the relay budget is all allocated */
+	HevSList *inherited_list;
+	HevSList *walk_list;
+	HevSocks5Transfer *transfer;
+	HevSocks5Auth *auth;
+	HevSocks5Hosts *hosts;
+	HevSocks5Egress *egress;
+	HevSocks5Sockmap *sockmap;
+	HevSocks5AccessLog *accesslog;
+	HevSocks5Hitters *hitters;
+	HevSocks5Flows *flows;
+	HevSocks5Control *control;
+	HevSocks5Dispatch *dispatch;
+	HevSocks5NegCache *negcache;
+	HevSocks5Tunnel *parent;
+	HevSocks5Tunnel *tunnel;
+	HevSocks5Classes *classes;
 
 	HevEventLoop *loop;
 };
 
 static bool listener_source_handler (HevEventSourceFD *fd, void *data);
 static bool timeout_source_handler (void *data);
+static bool deadline_source_handler (void *data);
+static bool sample_source_handler (void *data);
+static void session_setup (HevSocks5Server *self, HevSocks5Session *session);
 static void session_close_handler (HevSocks5Session *session, void *data);
+static void remove_session (HevSocks5Server *self, HevSocks5Session *session);
 static void remove_all_sessions (HevSocks5Server *self);
+static HevSocks5Listener * listener_new (HevSocks5Server *server,
+			const HevConfigListener *config, const HevSocks5Tuning *tuning);
+static void listener_free (HevSocks5Listener *listener);
+static int listener_inherit (HevSocks5Server *server, const char *name);
+static void listener_watch (HevSocks5Listener *listener);
+static void listener_pause_all (HevSocks5Server *self);
+static void server_free (HevSocks5Server *self);
+static void control_command_handler (const char *command, int fd, void *data);
+static bool walk_source_handler (void *data);
+static void walk_free (HevSocks5Server *self, HevSocks5Walk *walk);
+static void walk_skip (HevSocks5Server *self, HevSocks5Session *session);
+static int handoff_receive_listeners (HevSocks5Server *self, const char *path);
+static void handoff_receive_sessions (HevSocks5Server *self, int sock);
+static void handoff_send (HevSocks5Server *self, int fd, unsigned int version);
+static void transfer_fail (HevSocks5Server *self);
 
 HevSocks5Server *
-hev_socks5_server_new (HevEventLoop *loop, const char *addr, unsigned short port)
+hev_socks5_server_new (HevEventLoop *loop)
 {
 	HevSocks5Server *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Server));
+	int handoff_fd = -1;
+
 	if (self) {
-		int nonblock = 1, reuseaddr = 1;
-		struct sockaddr_in iaddr;
+		const char *auth_file = hev_config_get_auth_file ();
+		const char *hosts_file = hev_config_get_hosts_file ();
+		const char *tuning_profile = hev_config_get_tuning_profile ();
+		const char *accesslog = NULL;
+		const char *control_path = hev_config_get_control_path ();
+		const char *handoff_path = hev_config_get_handoff_path ();
+		const char *parent_addr = NULL, *parent_secret = NULL;
+		const char *tunnel_addr = NULL, *tunnel_secret = NULL;
+		const char **routes = NULL;
+		const HevSocks5Tuning *tuning = NULL;
+		const HevConfigListener *listeners = NULL;
+		const char **egress_addrs = NULL;
+		unsigned int i = 0, listener_count = 0, egress_count = 0, keep = 0;
+		unsigned int parent_port = 0, parent_conns = 0, route_count = 0, tunnel_port = 0;
+		unsigned int class_rule_count = 0;
+		const char **class_rules = NULL;
+		unsigned int sample_interval = hev_config_get_sample_interval ();
+		unsigned int slow_threshold = hev_config_get_slow_threshold ();
+		unsigned int busy_poll = 0, busy_spin = 0;
+		unsigned int auth_ms = 0, request_ms = 0, dns_ms = 0, connect_ms = 0, stall_ms = 0;
+		size_t rotate_size = 0;
+		bool compress = false;
 
-		/* listen socket */
-		self->listen_fd = socket (AF_INET, SOCK_STREAM, 0);
-		if (0 > self->listen_fd) {
-			HEV_MEMORY_ALLOCATOR_FREE (self);
-			return NULL;
+		self->ref_count = 1;
+		self->listener_list = NULL;
+		self->timeout_source = NULL;
+		self->deadline_source = NULL;
+		self->sample_source = NULL;
+		self->session_list = NULL;
+		self->auth = NULL;
+		self->hosts = NULL;
+		self->egress = NULL;
+		self->sockmap = NULL;
+		self->accesslog = NULL;
+		self->hitters = NULL;
+		self->flows = NULL;
+		self->control = NULL;
+		self->dispatch = NULL;
+		self->negcache = NULL;
+		self->parent = NULL;
+		self->tunnel = NULL;
+		self->classes = NULL;
+		self->loop = loop;
+
+		/* per phase deadlines, checked by a finer grained sweep */
+		hev_config_get_deadlines (&auth_ms, &request_ms, &dns_ms, &connect_ms, &stall_ms);
+		self->deadlines.auth = auth_ms * 1000000ULL;
+		self->deadlines.request = request_ms * 1000000ULL;
+		self->deadlines.dns = dns_ms * 1000000ULL;
+		self->deadlines.connect = connect_ms * 1000000ULL;
+		self->deadlines.stall = stall_ms * 1000000ULL;
+		self->connect_stagger = hev_config_get_connect_stagger ();
+		self->early_reply = hev_config_get_early_reply ();
+		self->handed_off = false;
+		self->inherited_list = NULL;
+		self->walk_list = NULL;
+		self->transfer = NULL;
+
+		/* default socket tuning profile */
+		if (tuning_profile) {
+			tuning = hev_socks5_tuning_lookup (tuning_profile);
+			if (!tuning) {
+				printf ("Unknown tuning profile %s!\n", tuning_profile);
+				goto fail;
+			}
 		}
-		ioctl (self->listen_fd, FIONBIO, (char *) &nonblock);
-		setsockopt (self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
-		memset (&iaddr, 0, sizeof (iaddr));
-		iaddr.sin_family = AF_INET;
-		iaddr.sin_addr.s_addr = inet_addr (addr);
-		iaddr.sin_port = htons (port);
-		if ((0 > bind (self->listen_fd, (struct sockaddr *) &iaddr, (socklen_t) sizeof (iaddr))) ||
-					(0 > listen (self->listen_fd, 100))) {
-			close (self->listen_fd);
-			HEV_MEMORY_ALLOCATOR_FREE (self);
-			return NULL;
+
+		/* credential store */
+		if (auth_file) {
+			self->auth = hev_socks5_auth_new (auth_file);
+			if (!self->auth)
+			  goto fail;
+		}
+
+		/* names answered before any DNS traffic */
+		if (hosts_file) {
+			self->hosts = hev_socks5_hosts_new (hosts_file);
+			if (!self->hosts)
+			  goto fail;
+		}
+
+		/* egress source address pool */
+		egress_addrs = hev_config_get_egress_addresses (&egress_count);
+		if (0 < egress_count) {
+			self->egress = hev_socks5_egress_new ();
+			if (!self->egress)
+			  goto fail;
+			for (i=0; i<egress_count; i++) {
+				if (!hev_socks5_egress_add_address (self->egress, egress_addrs[i])) {
+					printf ("Invalid egress address %s!\n", egress_addrs[i]);
+					goto fail;
+				}
+			}
+		}
+
+		/* in-kernel relay, the user space relay stays as the fallback */
+		if (hev_config_get_sockmap ()) {
+			self->sockmap = hev_socks5_sockmap_new ();
+			if (!self->sockmap)
+			  printf ("eBPF sockmap unavailable, using user space relay!\n");
 		}
 
-		/* event source fds for listener */
-		self->listener_source = hev_event_source_fds_new ();
-		hev_event_source_set_priority (self->listener_source, 1);
-		hev_event_source_add_fd (self->listener_source, self->listen_fd, EPOLLIN | EPOLLET);
-		hev_event_source_set_callback (self->listener_source,
-					(HevEventSourceFunc) listener_source_handler, self, NULL);
-		hev_event_loop_add_source (loop, self->listener_source);
-		hev_event_source_unref (self->listener_source);
+		/* trade CPU for latency, before the dispatch makes its epoll */
+		busy_poll = hev_config_get_busy_poll (&busy_spin);
+		if (busy_poll)
+		  hev_socks5_busypoll_start (loop, busy_poll, busy_spin);
+
+		/* relay events straight from a nested epoll */
+		if (hev_config_get_direct_dispatch ()) {
+			self->dispatch = hev_socks5_dispatch_new (loop, hev_socks5_session_dispatch);
+			if (!self->dispatch)
+			  goto fail;
+		}
+
+		/* recent connect failures, answered without connecting */
+		if (hev_config_get_negcache ()) {
+			self->negcache = hev_socks5_negcache_new ();
+			if (!self->negcache)
+			  goto fail;
+		}
+
+		/* routed destinations go through streams to the parent */
+		parent_addr = hev_config_get_parent (&parent_port, &parent_conns, &parent_secret);
+		if (parent_addr) {
+			self->parent = hev_socks5_tunnel_new (loop, parent_addr, parent_port,
+						parent_conns, parent_secret);
+			if (!self->parent)
+			  goto fail;
+			routes = hev_config_get_parent_routes (&route_count);
+			for (i=0; i<route_count; i++) {
+				if (!hev_socks5_tunnel_add_route (self->parent, routes[i])) {
+					printf ("Invalid parent route %s!\n", routes[i]);
+					goto fail;
+				}
+			}
+		}
+
+		/* and the other end, for children of this process */
+		tunnel_addr = hev_config_get_tunnel (&tunnel_port, &tunnel_secret);
+		if (tunnel_addr) {
+			self->tunnel = hev_socks5_tunnel_new_server (loop, tunnel_addr,
+						tunnel_port, tunnel_secret);
+			if (!self->tunnel)
+			  goto fail;
+		}
+
+		/* user and destination rules pick the class a relay runs at */
+		class_rules = hev_config_get_class_rules (&class_rule_count);
+		if (class_rule_count) {
+			self->classes = hev_socks5_classes_new (loop);
+			if (!self->classes)
+			  goto fail;
+			for (i=0; i<class_rule_count; i++) {
+				if (!hev_socks5_classes_add_rule (self->classes, class_rules[i])) {
+					printf ("Invalid class rule %s!\n", class_rules[i]);
+					goto fail;
+				}
+			}
+		}
+
+		/* access log, written by its own thread */
+		accesslog = hev_config_get_accesslog (&rotate_size, &keep, &compress);
+		if (accesslog) {
+			self->accesslog = hev_socks5_accesslog_new (accesslog,
+						rotate_size, keep, compress);
+			if (!self->accesslog)
+			  goto fail;
+		}
+
+		/* take over from the running process before its control path is
+		 * reused, its sessions follow once the listeners exist */
+		if (handoff_path)
+		  handoff_fd = handoff_receive_listeners (self, handoff_path);
+
+		/* runtime queries, heavy hitters and flows are only reachable
+		 * through them */
+		if (control_path) {
+			self->hitters = hev_socks5_hitters_new ();
+			if (!self->hitters)
+			  goto fail;
+			if (sample_interval) {
+				self->flows = hev_socks5_flows_new ();
+				if (!self->flows)
+				  goto fail;
+			}
+			self->control = hev_socks5_control_new (loop, control_path,
+						control_command_handler, self);
+			if (!self->control)
+			  goto fail;
+		}
+
+		hev_socks5_budget_set_limit (hev_config_get_relay_budget ());
+
+		/* loop lag and slow callbacks */
+		if (slow_threshold)
+		  hev_socks5_loopmon_start (loop, slow_threshold);
+
+		/* listeners */
+		listeners = hev_config_get_listeners (&listener_count);
+		for (i=0; i<listener_count; i++) {
+			HevSocks5Listener *listener = listener_new (self, &listeners[i], tuning);
+			if (!listener)
+			  goto fail;
+			self->listener_list = hev_slist_append (self->listener_list, listener);
+		}
+		if (-1 < handoff_fd) {
+			handoff_receive_sessions (self, handoff_fd);
+			close (handoff_fd);
+		}
 
 		/* event source timeout */
 		self->timeout_source = hev_event_source_timeout_new (TIMEOUT);
@@ -81,12 +401,32 @@ hev_socks5_server_new (HevEventLoop *loop, const char *addr, unsigned short port
 		hev_event_loop_add_source (loop, self->timeout_source);
 		hev_event_source_unref (self->timeout_source);
 
-		self->ref_count = 1;
-		self->session_list = NULL;
-		self->loop = loop;
+		self->deadline_source = hev_event_source_timeout_new (DEADLINE_TIMEOUT);
+		hev_event_source_set_priority (self->deadline_source, -1);
+		hev_event_source_set_callback (self->deadline_source,
+					deadline_source_handler, self, NULL);
+		hev_event_loop_add_source (loop, self->deadline_source);
+		hev_event_source_unref (self->deadline_source);
+
+		/* TCP_INFO sampling, one pass over the sessions per interval */
+		if (self->flows) {
+			self->sample_source = hev_event_source_timeout_new (sample_interval);
+			hev_event_source_set_priority (self->sample_source, -1);
+			hev_event_source_set_callback (self->sample_source,
+						sample_source_handler, self, NULL);
+			hev_event_loop_add_source (loop, self->sample_source);
+			hev_event_source_unref (self->sample_source);
+		}
 	}
 
 	return self;
+
+fail:
+	if (-1 < handoff_fd)
+	  close (handoff_fd);
+	server_free (self);
+
+	return NULL;
 }
 
 HevSocks5Server *
@@ -105,65 +445,633 @@ hev_socks5_server_unref (HevSocks5Server *self)
 {
 	if (self) {
 		self->ref_count --;
-		if (0 == self->ref_count) {
-			hev_event_loop_del_source (self->loop, self->listener_source);
-			hev_event_loop_del_source (self->loop, self->timeout_source);
-			close (self->listen_fd);
-			remove_all_sessions (self);
+		if (0 == self->ref_count)
+		  server_free (self);
+	}
+}
+
+void
+hev_socks5_server_reload (HevSocks5Server *self)
+{
+	if (self->auth && !hev_socks5_auth_reload (self->auth))
+	  printf ("Reload auth file failed!\n");
+	if (self->hosts && !hev_socks5_hosts_reload (self->hosts))
+	  printf ("Reload hosts file failed!\n");
+	if (self->accesslog)
+	  hev_socks5_accesslog_reopen (self->accesslog);
+}
+
+void
+hev_socks5_server_dump_stats (HevSocks5Server *self, int fd)
+{
+	HevSList *list = NULL;
+
+	hev_socks5_stats_dump (fd);
+	for (list=self->listener_list; list; list=hev_slist_next (list)) {
+		HevSocks5Listener *listener = hev_slist_data (list);
+		dprintf (fd, "listener %s: active %u accepted %llu accept-failed %llu\n",
+					listener->name, listener->active, listener->accepted,
+					listener->accept_failed);
+		if (listener->forward_host[0])
+		  dprintf (fd, "listener %s: forward %s:%u\n", listener->name,
+					  listener->forward_host, listener->forward_port);
+	}
+	if (self->egress)
+	  hev_socks5_egress_dump (self->egress, fd);
+	if (self->accesslog)
+	  hev_socks5_accesslog_dump (self->accesslog, fd);
+	if (self->negcache)
+	  hev_socks5_negcache_dump (self->negcache, fd);
+	if (self->parent)
+	  hev_socks5_tunnel_dump (self->parent, fd);
+	if (self->tunnel)
+	  hev_socks5_tunnel_dump (self->tunnel, fd);
+	if (self->classes)
+	  hev_socks5_classes_dump (self->classes, fd);
+	if (self->hosts)
+	  hev_socks5_hosts_dump (self->hosts, fd);
+	hev_socks5_budget_dump (fd);
+	hev_socks5_busypoll_dump (fd);
+	hev_socks5_loopmon_dump (fd);
+}
+
+static void
+server_free (HevSocks5Server *self)
+{
+	HevSList *list = NULL;
+
+	if (self->timeout_source)
+	  hev_event_loop_del_source (self->loop, self->timeout_source);
+	if (self->deadline_source)
+	  hev_event_loop_del_source (self->loop, self->deadline_source);
+	if (self->sample_source)
+	  hev_event_loop_del_source (self->loop, self->sample_source);
+	hev_socks5_loopmon_stop (self->loop);
+	hev_socks5_busypoll_stop (self->loop);
+	hev_socks5_control_unref (self->control);
+	while (self->walk_list)
+	  walk_free (self, hev_slist_data (self->walk_list));
+	if (self->transfer)
+	  transfer_fail (self);
+	remove_all_sessions (self);
+	for (list=self->listener_list; list; list=hev_slist_next (list))
+	  listener_free (hev_slist_data (list));
+	hev_slist_free (self->listener_list);
+	hev_socks5_dispatch_unref (self->dispatch);
+	hev_socks5_negcache_unref (self->negcache);
+	hev_socks5_tunnel_unref (self->tunnel);
+	hev_socks5_tunnel_unref (self->parent);
+	hev_socks5_classes_unref (self->classes);
+	hev_socks5_flows_unref (self->flows);
+	hev_socks5_hitters_unref (self->hitters);
+	hev_socks5_accesslog_unref (self->accesslog);
+	hev_socks5_sockmap_unref (self->sockmap);
+	hev_socks5_egress_unref (self->egress);
+	hev_socks5_auth_unref (self->auth);
+	hev_socks5_hosts_unref (self->hosts);
+	for (list=self->inherited_list; list; list=hev_slist_next (list)) {
+		HevSocks5Inherited *inherited = hev_slist_data (list);
+		close (inherited->fd);
+		HEV_MEMORY_ALLOCATOR_FREE (inherited);
+	}
+	hev_slist_free (self->inherited_list);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+static void
+walk_add (HevSocks5Server *self, HevSocks5Walk *walk)
+{
+	walk->server = self;
+
+	/* as low as the control socket, the relay always goes first */
+	walk->source = hev_event_source_timeout_new (WALK_INTERVAL);
+	hev_event_source_set_priority (walk->source, -1);
+	hev_event_source_set_callback (walk->source, walk_source_handler, walk, NULL);
+	hev_event_loop_add_source (self->loop, walk->source);
+	hev_event_source_unref (walk->source);
+	self->walk_list = hev_slist_append (self->walk_list, walk);
+}
+
+static void
+walk_start (HevSocks5Server *self, const char *args, int fd)
+{
+	HevSocks5Walk *walk = NULL;
+	HevSList *list = NULL;
+	unsigned int count = 0;
+
+	for (list=self->walk_list; list; list=hev_slist_next (list)) {
+		walk = hev_slist_data (list);
+		if (walk->inspect)
+		  count ++;
+	}
+	if (MAX_WALKS <= count) {
+		dprintf (fd, "busy, try again\n");
+		return;
+	}
+	walk = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Walk));
+	if (!walk)
+	  return;
+	memset (walk, 0, sizeof (HevSocks5Walk));
+	walk->buffer_fd = -1;
+	walk->inspect = hev_socks5_inspect_new (args, fd);
+	if (!walk->inspect) {
+		HEV_MEMORY_ALLOCATOR_FREE (walk);
+		return;
+	}
+	walk->walking = true;
+	walk->cursor = self->session_list;
+	walk_add (self, walk);
+}
+
+static size_t
+walk_fill (char *buf, size_t len, void *data)
+{
+	HevSocks5Walk *walk = data;
+	ssize_t size = read (walk->buffer_fd, buf, len);
+
+	return (0 < size) ? size : 0;
+}
+
+/* buffer_fd holds the whole reply, rewound */
+static void
+walk_start_buffered (HevSocks5Server *self, int buffer_fd, int fd)
+{
+	HevSocks5Walk *walk = NULL;
+
+	walk = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Walk));
+	if (!walk) {
+		close (buffer_fd);
+		return;
+	}
+	memset (walk, 0, sizeof (HevSocks5Walk));
+	walk->buffer_fd = buffer_fd;
+	walk->reply = hev_socks5_reply_new (fd, walk_fill, walk);
+	if (!walk->reply) {
+		close (buffer_fd);
+		HEV_MEMORY_ALLOCATOR_FREE (walk);
+		return;
+	}
+	/* most replies fit the socket buffer, no tick needed */
+	if (hev_socks5_reply_write (walk->reply)) {
+		hev_socks5_reply_free (walk->reply);
+		close (buffer_fd);
+		HEV_MEMORY_ALLOCATOR_FREE (walk);
+		return;
+	}
+	walk_add (self, walk);
+}
+
+static void
+walk_free (HevSocks5Server *self, HevSocks5Walk *walk)
+{
+	hev_event_loop_del_source (self->loop, walk->source);
+	if (walk->inspect)
+	  hev_socks5_inspect_free (walk->inspect);
+	if (walk->reply)
+	  hev_socks5_reply_free (walk->reply);
+	if (-1 < walk->buffer_fd)
+	  close (walk->buffer_fd);
+	self->walk_list = hev_slist_remove (self->walk_list, walk);
+	HEV_MEMORY_ALLOCATOR_FREE (walk);
+}
+
+static bool
+walk_source_handler (void *data)
+{
+	HevSocks5Walk *walk = data;
+	HevSocks5Server *self = walk->server;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	uint64_t now = hev_socks5_stats_clock ();
+	unsigned int i = 0;
+
+	if (walk->walking) {
+		/* remove_session moves the cursor off a session going away */
+		for (i=0; walk->cursor && (WALK_BATCH > i); i++) {
+			HevSocks5SessionInfo info;
+
+			hev_socks5_session_inspect (hev_slist_data (walk->cursor), &info, now);
+			hev_socks5_inspect_add (walk->inspect, &info);
+			walk->cursor = hev_slist_next (walk->cursor);
+		}
+		if (!walk->cursor) {
+			hev_socks5_inspect_sort (walk->inspect);
+			walk->walking = false;
+		}
+	} else if (walk->inspect ? hev_socks5_inspect_write (walk->inspect) :
+				hev_socks5_reply_write (walk->reply)) {
+		walk_free (self, walk);
+	}
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_CONTROL, mon);
+
+	return true;
+}
+
+static void
+kill_session (HevSocks5Server *self, uint64_t id, int fd)
+{
+	HevSocks5Session *session = NULL;
+	HevSList *list = NULL;
+
+	for (list=self->session_list; list; list=hev_slist_next (list)) {
+		session = hev_slist_data (list);
+		if (hev_socks5_session_get_id (session) == id)
+		  break;
+	}
+	if (!list) {
+		dprintf (fd, "no session %llu\n", (unsigned long long) id);
+		return;
+	}
+	hev_socks5_session_set_close_reason (session, HEV_SOCKS5_SESSION_CLOSE_KILLED);
+	remove_session (self, session);
+	self->session_list = hev_slist_remove (self->session_list, session);
+	dprintf (fd, "killed %llu\n", (unsigned long long) id);
+	if (self->handed_off && !self->session_list)
+	  hev_event_loop_quit (self->loop);
+}
+
+static void
+control_command_render (HevSocks5Server *self, const char *command, int fd)
+{
+	if (0 == strcmp (command, "stats"))
+	  hev_socks5_server_dump_stats (self, fd);
+	else if (0 == strcmp (command, "hitters"))
+	  hev_socks5_hitters_dump (self->hitters, fd);
+	else if ((0 == strcmp (command, "flows")) && self->flows)
+	  hev_socks5_flows_dump (self->flows, fd);
+	else if (0 == strncmp (command, "kill ", 5))
+	  kill_session (self, strtoull (command + 5, NULL, 10), fd);
+	else if (0 == strcmp (command, "help"))
+	  dprintf (fd, "commands: stats hitters flows sessions kill handoff help\n");
+	else
+	  dprintf (fd, "unknown command: %s\n", command);
+}
+
+static void
+control_command_handler (const char *command, int fd, void *data)
+{
+	HevSocks5Server *self = data;
+	int buffer_fd = -1;
+
+	if ((0 == strcmp (command, "sessions")) || (0 == strncmp (command, "sessions ", 9))) {
+		walk_start (self, command + 8, fd);
+		return;
+	}
+	if (0 == strncmp (command, "handoff ", 8)) {
+		handoff_send (self, fd, strtoul (command + 8, NULL, 10));
+		return;
+	}
+
+	/* rendered in memory, a slow reader only holds up its own reply */
+	buffer_fd = syscall (__NR_memfd_create, "control-reply", MFD_CLOEXEC);
+	if (0 > buffer_fd)
+	  return;
+	control_command_render (self, command, buffer_fd);
+	lseek (buffer_fd, 0, SEEK_SET);
+	walk_start_buffered (self, buffer_fd, fd);
+}
+
+/* HOST:PORT, the host resolved per session like a request's */
+static bool
+listener_parse_forward (HevSocks5Listener *self, const char *target)
+{
+	const char *colon = strrchr (target, ':');
+	unsigned long port = 0;
+	char *end = NULL;
+
+	if (!colon || (colon == target) ||
+				(sizeof (self->forward_host) <= (size_t) (colon - target)))
+	  return false;
+	port = strtoul (colon + 1, &end, 10);
+	if ((end == (colon + 1)) || *end || (0 == port) || (65535 < port))
+	  return false;
+	memcpy (self->forward_host, target, colon - target);
+	self->forward_host[colon - target] = '\0';
+	self->forward_port = port;
+
+	return true;
+}
+
+static HevSocks5Listener *
+listener_new (HevSocks5Server *server, const HevConfigListener *config,
+			const HevSocks5Tuning *tuning)
+{
+	HevSocks5Listener *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Listener));
+	if (self) {
+		int nonblock = 1, reuseaddr = 1;
+		struct sockaddr_storage addr;
+		socklen_t addr_len = 0;
+
+		memset (self, 0, sizeof (HevSocks5Listener));
+		self->server = server;
+		self->tuning = tuning;
+		if (config->tuning_profile) {
+			self->tuning = hev_socks5_tuning_lookup (config->tuning_profile);
+			if (!self->tuning) {
+				printf ("Unknown tuning profile %s!\n", config->tuning_profile);
+				HEV_MEMORY_ALLOCATOR_FREE (self);
+				return NULL;
+			}
+		}
+
+		if (config->class_name &&
+					!hev_socks5_class_parse (config->class_name, &self->class)) {
+			printf ("Unknown class %s!\n", config->class_name);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+
+		if (config->forward && !listener_parse_forward (self, config->forward)) {
+			printf ("Bad forward target %s!\n", config->forward);
 			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
 		}
+
+		/* handshake in user space, records in the kernel */
+		if (config->tls_cert) {
+			self->tls = hev_socks5_tls_new (config->tls_cert, config->tls_key);
+			if (!self->tls) {
+				HEV_MEMORY_ALLOCATOR_FREE (self);
+				return NULL;
+			}
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		if (AF_UNIX == config->family) {
+			struct sockaddr_un *uaddr = (struct sockaddr_un *) &addr;
+			if (sizeof (uaddr->sun_path) <= strlen (config->address)) {
+				hev_socks5_tls_unref (self->tls);
+				HEV_MEMORY_ALLOCATOR_FREE (self);
+				return NULL;
+			}
+			uaddr->sun_family = AF_UNIX;
+			strcpy (uaddr->sun_path, config->address);
+			addr_len = sizeof (struct sockaddr_un);
+			snprintf (self->name, sizeof (self->name), "unix:%s", config->address);
+		} else {
+			struct sockaddr_in *iaddr = (struct sockaddr_in *) &addr;
+			iaddr->sin_family = AF_INET;
+			iaddr->sin_addr.s_addr = inet_addr (config->address);
+			iaddr->sin_port = htons (config->port);
+			addr_len = sizeof (struct sockaddr_in);
+			snprintf (self->name, sizeof (self->name), "%s:%u",
+						config->address, config->port);
+		}
+
+		/* a listen socket handed over replaces bind and listen */
+		self->fd = listener_inherit (server, self->name);
+		if (-1 < self->fd) {
+			if (AF_UNIX == config->family)
+			  self->path = strdup (config->address);
+			listener_watch (self);
+			return self;
+		}
+
+		/* remove a stale socket left by a previous run */
+		if (AF_UNIX == config->family)
+		  unlink (config->address);
+
+		/* listen socket */
+		self->fd = socket (config->family, SOCK_STREAM, 0);
+		if (0 > self->fd) {
+			hev_socks5_tls_unref (self->tls);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		ioctl (self->fd, FIONBIO, (char *) &nonblock);
+		if (AF_INET == config->family)
+		  setsockopt (self->fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
+		if (0 > bind (self->fd, (struct sockaddr *) &addr, addr_len)) {
+			printf ("Bind %s failed!\n", self->name);
+			close (self->fd);
+			hev_socks5_tls_unref (self->tls);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		if (AF_UNIX == config->family) {
+			self->path = strdup (config->address);
+			chmod (self->path, config->mode);
+		}
+		if (0 > listen (self->fd, 100)) {
+			listener_free (self);
+			return NULL;
+		}
+
+		listener_watch (self);
+	}
+
+	return self;
+}
+
+static int
+listener_inherit (HevSocks5Server *server, const char *name)
+{
+	HevSList *list = NULL;
+
+	for (list=server->inherited_list; list; list=hev_slist_next (list)) {
+		HevSocks5Inherited *inherited = hev_slist_data (list);
+		int fd = inherited->fd;
+
+		if (0 != strcmp (inherited->name, name))
+		  continue;
+		server->inherited_list = hev_slist_remove (server->inherited_list, inherited);
+		HEV_MEMORY_ALLOCATOR_FREE (inherited);
+		return fd;
 	}
+
+	return -1;
+}
+
+static void
+listener_watch (HevSocks5Listener *self)
+{
+	/* event source fds for listener */
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (self->source, 1);
+	hev_event_source_add_fd (self->source, self->fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) listener_source_handler, self, NULL);
+	hev_event_loop_add_source (self->server->loop, self->source);
+	hev_event_source_unref (self->source);
+}
+
+static void
+listener_pause_all (HevSocks5Server *self)
+{
+	HevSList *list = NULL;
+
+	for (list=self->listener_list; list; list=hev_slist_next (list)) {
+		HevSocks5Listener *listener = hev_slist_data (list);
+		if (!listener->source)
+		  continue;
+		hev_event_loop_del_source (self->loop, listener->source);
+		listener->source = NULL;
+	}
+}
+
+static void
+listener_free (HevSocks5Listener *self)
+{
+	if (self->source)
+	  hev_event_loop_del_source (self->server->loop, self->source);
+	close (self->fd);
+	if (self->path) {
+		unlink (self->path);
+		free (self->path);
+	}
+	hev_socks5_tls_unref (self->tls);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
 }
 
 static bool
 listener_source_handler (HevEventSourceFD *fd, void *data)
 {
-	HevSocks5Server *self = data;
-	struct sockaddr_in addr;
+	HevSocks5Listener *listener = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	HevSocks5Server *self = listener->server;
+	struct sockaddr_storage addr;
 	socklen_t addr_len;
 	int client_fd = -1;
 
+	/* no room for more rings, new clients wait in the listen queue until
+	 * a closing session frees some */
+	if (hev_socks5_budget_full ()) {
+		listener_pause_all (self);
+		self->accept_paused = true;
+		hev_socks5_budget.pauses ++;
+		hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_LISTENER, mon);
+		return true;
+	}
+
 	addr_len = sizeof (addr);
 	client_fd = accept (fd->fd, (struct sockaddr *) &addr, (socklen_t *) &addr_len);
 	if (0 > client_fd) {
-		if (EAGAIN == errno)
-		  fd->revents &= ~EPOLLIN;
-		else
-		  printf ("Accept failed!\n");
+		if (EAGAIN == errno) {
+			fd->revents &= ~EPOLLIN;
+		} else {
+			listener->accept_failed ++;
+			printf ("Accept failed!\n");
+		}
 	} else {
 		HevSocks5Session *session = NULL;
 		HevEventSource *source = NULL;
 
-		session = hev_socks5_session_new (client_fd, session_close_handler, self);
+		session = hev_socks5_session_new (client_fd, session_close_handler, listener);
+		if (self->auth)
+		  hev_socks5_session_set_auth (session, self->auth);
+		if (listener->tuning)
+		  hev_socks5_session_set_tuning (session, listener->tuning);
+		hev_socks5_busypoll_apply (client_fd);
+		if (listener->tls)
+		  hev_socks5_session_set_tls (session, listener->tls);
+		hev_socks5_session_set_connect_stagger (session, self->connect_stagger);
+		hev_socks5_session_set_early_reply (session, self->early_reply);
+		if (listener->forward_host[0])
+		  hev_socks5_session_set_forward (session, listener->forward_host,
+					  listener->forward_port);
+		if (self->parent)
+		  hev_socks5_session_set_parent (session, self->parent);
+		session_setup (self, session);
 		source = hev_socks5_session_get_source (session);
 		hev_event_loop_add_source (self->loop, source);
-		/* printf ("New session %p (%d) enter from %s:%u\n", session,
-					client_fd, inet_ntoa (addr.sin_addr), ntohs (addr.sin_port)); */
+		/* printf ("New session %p (%d) enter from %s\n", session,
+					client_fd, listener->name); */
 
+		listener->accepted ++;
+		listener->active ++;
 		self->session_list = hev_slist_append (self->session_list, session);
 	}
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_LISTENER, mon);
 
 	return true;
 }
 
+/* services a relaying session uses, accepted or handed over */
+static void
+session_setup (HevSocks5Server *self, HevSocks5Session *session)
+{
+	HevSocks5Listener *listener = hev_socks5_session_get_notify_data (session);
+
+	hev_socks5_session_set_class (session, listener->class);
+	if (self->classes)
+	  hev_socks5_session_set_classes (session, self->classes);
+	if (self->hosts)
+	  hev_socks5_session_set_hosts (session, self->hosts);
+	if (self->egress)
+	  hev_socks5_session_set_egress (session, self->egress);
+	if (self->sockmap)
+	  hev_socks5_session_set_sockmap (session, self->sockmap);
+	if (self->accesslog)
+	  hev_socks5_session_set_accesslog (session, self->accesslog);
+	if (self->hitters)
+	  hev_socks5_session_set_hitters (session, self->hitters);
+	hev_socks5_session_set_deadlines (session, &self->deadlines);
+	if (self->dispatch)
+	  hev_socks5_session_set_dispatch (session, self->dispatch);
+	if (self->negcache)
+	  hev_socks5_session_set_negcache (session, self->negcache);
+}
+
 static bool
 timeout_source_handler (void *data)
 {
 	HevSocks5Server *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
 	HevSList *list = NULL;
 	for (list=self->session_list; list; list=hev_slist_next (list)) {
 		HevSocks5Session *session = hev_slist_data (list);
 		if (hev_socks5_session_get_idle (session)) {
 			/* printf ("Remove timeout session %p\n", session); */
-			hev_event_loop_del_source (self->loop,
-						hev_socks5_session_get_source (session));
-			hev_socks5_session_unref (session);
+			hev_socks5_session_set_close_reason (session,
+						HEV_SOCKS5_SESSION_CLOSE_IDLE);
+			remove_session (self, session);
 			hev_slist_set_data (list, NULL);
 		} else {
 			hev_socks5_session_set_idle (session);
 		}
 	}
 	self->session_list = hev_slist_remove_all (self->session_list, NULL);
+	if (self->hitters)
+	  hev_socks5_hitters_decay (self->hitters);
+	if (self->flows)
+	  hev_socks5_flows_decay (self->flows);
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_TIMEOUT, mon);
+
+	return true;
+}
+
+static bool
+deadline_source_handler (void *data)
+{
+	HevSocks5Server *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	HevSList *list = NULL;
+	uint64_t now = hev_socks5_stats_clock ();
+
+	for (list=self->session_list; list; list=hev_slist_next (list)) {
+		HevSocks5Session *session = hev_slist_data (list);
+		if (hev_socks5_session_check_deadline (session, now)) {
+			remove_session (self, session);
+			hev_slist_set_data (list, NULL);
+		}
+	}
+	self->session_list = hev_slist_remove_all (self->session_list, NULL);
+	if (self->handed_off && !self->session_list)
+	  hev_event_loop_quit (self->loop);
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_DEADLINE, mon);
+
+	return true;
+}
+
+static bool
+sample_source_handler (void *data)
+{
+	HevSocks5Server *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	HevSList *list = NULL;
+
+	for (list=self->session_list; list; list=hev_slist_next (list))
+	  hev_socks5_session_sample (hev_slist_data (list), self->flows);
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_SAMPLE, mon);
 
 	return true;
 }
@@ -171,13 +1079,48 @@ timeout_source_handler (void *data)
 static void
 session_close_handler (HevSocks5Session *session, void *data)
 {
-	HevSocks5Server *self = data;
+	HevSocks5Listener *listener = data;
+	HevSocks5Server *self = listener->server;
 
 	/* printf ("Remove session %p\n", session); */
+	remove_session (self, session);
+	self->session_list = hev_slist_remove (self->session_list, session);
+	/* handed off, the last session left behind ends the process */
+	if (self->handed_off && !self->session_list)
+	  hev_event_loop_quit (self->loop);
+}
+
+/* listings in progress step past a session before its node goes */
+static void
+walk_skip (HevSocks5Server *self, HevSocks5Session *session)
+{
+	HevSList *list = NULL;
+
+	for (list=self->walk_list; list; list=hev_slist_next (list)) {
+		HevSocks5Walk *walk = hev_slist_data (list);
+		if (walk->cursor && (hev_slist_data (walk->cursor) == session))
+		  walk->cursor = hev_slist_next (walk->cursor);
+	}
+}
+
+static void
+remove_session (HevSocks5Server *self, HevSocks5Session *session)
+{
+	HevSocks5Listener *listener = hev_socks5_session_get_notify_data (session);
+	HevSList *list = NULL;
+
+	walk_skip (self, session);
+	listener->active --;
 	hev_event_loop_del_source (self->loop,
 				hev_socks5_session_get_source (session));
 	hev_socks5_session_unref (session);
-	self->session_list = hev_slist_remove (self->session_list, session);
+
+	/* a re-added listener reports the backlog waiting in its queue */
+	if (self->accept_paused && !hev_socks5_budget_full ()) {
+		for (list=self->listener_list; list; list=hev_slist_next (list))
+		  listener_watch (hev_slist_data (list));
+		self->accept_paused = false;
+	}
 }
 
 static void
@@ -187,6 +1130,8 @@ remove_all_sessions (HevSocks5Server *self)
 	for (list=self->session_list; list; list=hev_slist_next (list)) {
 		HevSocks5Session *session = hev_slist_data (list);
 		/* printf ("Remove session %p\n", session); */
+		hev_socks5_session_set_close_reason (session,
+					HEV_SOCKS5_SESSION_CLOSE_SHUTDOWN);
 		hev_event_loop_del_source (self->loop,
 					hev_socks5_session_get_source (session));
 		hev_socks5_session_unref (session);
@@ -194,3 +1139,457 @@ remove_all_sessions (HevSocks5Server *self)
 	hev_slist_free (self->session_list);
 }
 
+static int
+handoff_receive_listeners (HevSocks5Server *self, const char *path)
+{
+	uint8_t payload[HEV_SOCKS5_HANDOFF_PAYLOAD_MAX];
+	int sock = -1, fds[HEV_SOCKS5_HANDOFF_FDS_MAX];
+	unsigned int i = 0, fd_count = 0;
+
+	sock = hev_socks5_handoff_connect (path);
+	if (0 > sock) {
+		printf ("Handoff from %s failed, starting cold!\n", path);
+		return -1;
+	}
+
+	/* listeners up to the cache record, then the sessions */
+	for (;;) {
+		size_t len = sizeof (payload);
+		HevSocks5HandoffType type = 0;
+		HevSocks5Inherited *inherited = NULL;
+
+		type = hev_socks5_handoff_recv (sock, payload, &len, fds, &fd_count);
+		if (HEV_SOCKS5_HANDOFF_CACHE == type) {
+			if (self->negcache)
+			  hev_socks5_negcache_load (self->negcache, payload, len);
+			return sock;
+		}
+		if ((HEV_SOCKS5_HANDOFF_LISTENER != type) || (1 != fd_count))
+		  break;
+		if (sizeof (inherited->name) <= len)
+		  inherited = NULL;
+		else
+		  inherited = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Inherited));
+		if (!inherited) {
+			close (fds[0]);
+			continue;
+		}
+		inherited->fd = fds[0];
+		memcpy (inherited->name, payload, len);
+		inherited->name[len] = '\0';
+		self->inherited_list = hev_slist_append (self->inherited_list, inherited);
+	}
+
+	/* refused or cut short, whatever arrived is still usable */
+	for (i=0; i<fd_count; i++)
+	  close (fds[i]);
+	close (sock);
+
+	return -1;
+}
+
+static void
+handoff_receive_sessions (HevSocks5Server *self, int sock)
+{
+	uint8_t payload[HEV_SOCKS5_HANDOFF_PAYLOAD_MAX];
+	uint8_t adopted[HEV_SOCKS5_HANDOFF_SESSIONS_MAX / 8];
+	int fds[HEV_SOCKS5_HANDOFF_FDS_MAX];
+	unsigned int i = 0, fd_count = 0, count = 0, seq = 0;
+	HevSList *list = NULL, *pending = NULL;
+	HevSocks5HandoffType type = 0;
+	size_t len = 0;
+
+	/* listen fds no configured listener claimed */
+	for (list=self->inherited_list; list; list=hev_slist_next (list)) {
+		HevSocks5Inherited *inherited = hev_slist_data (list);
+		close (inherited->fd);
+		HEV_MEMORY_ALLOCATOR_FREE (inherited);
+	}
+	hev_slist_free (self->inherited_list);
+	self->inherited_list = NULL;
+
+	/* held off the loop, the old process still owns them until it
+	 * commits to the ack */
+	memset (adopted, 0, sizeof (adopted));
+	for (;; seq++) {
+		HevSocks5Listener *listener = NULL;
+		HevSocks5Session *session = NULL;
+
+		len = sizeof (payload);
+		type = hev_socks5_handoff_recv (sock, payload, &len, fds, &fd_count);
+		if ((HEV_SOCKS5_HANDOFF_SESSION != type) || (2 != fd_count) ||
+					(sizeof (listener->name) > len) ||
+					(HEV_SOCKS5_HANDOFF_SESSIONS_MAX <= seq)) {
+			for (i=0; i<fd_count; i++)
+			  close (fds[i]);
+			break;
+		}
+
+		/* back under the listener it was accepted on */
+		payload[sizeof (listener->name) - 1] = '\0';
+		for (list=self->listener_list; list; list=hev_slist_next (list)) {
+			listener = hev_slist_data (list);
+			if (0 == strcmp (listener->name, (char *) payload))
+			  break;
+		}
+		if (!list) {
+			close (fds[0]);
+			close (fds[1]);
+			continue;
+		}
+
+		session = hev_socks5_session_new (fds[0], session_close_handler, listener);
+		session_setup (self, session);
+		if (!hev_socks5_session_import (session, fds[1],
+						payload + sizeof (listener->name),
+						len - sizeof (listener->name))) {
+			close (fds[1]);
+			hev_socks5_session_unref (session);
+			continue;
+		}
+		pending = hev_slist_prepend (pending, session);
+		adopted[seq / 8] |= 1 << (seq % 8);
+	}
+
+	/* no word back means the old process keeps relaying them */
+	if ((HEV_SOCKS5_HANDOFF_END == type) &&
+				hev_socks5_handoff_send (sock, HEV_SOCKS5_HANDOFF_ACK,
+					adopted, (seq + 7) / 8, NULL, 0)) {
+		len = sizeof (payload);
+		type = hev_socks5_handoff_recv (sock, payload, &len, fds, &fd_count);
+		for (i=0; i<fd_count; i++)
+		  close (fds[i]);
+	}
+
+	for (list=pending; list; list=hev_slist_next (list)) {
+		HevSocks5Session *session = hev_slist_data (list);
+		HevSocks5Listener *listener = hev_socks5_session_get_notify_data (session);
+
+		if (HEV_SOCKS5_HANDOFF_COMMIT != type) {
+			hev_socks5_session_set_close_reason (session,
+						HEV_SOCKS5_SESSION_CLOSE_HANDOFF);
+			hev_socks5_session_unref (session);
+			continue;
+		}
+		hev_event_loop_add_source (self->loop, hev_socks5_session_get_source (session));
+		listener->active ++;
+		self->session_list = hev_slist_prepend (self->session_list, session);
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_HANDOFF_SESSIONS, 1);
+		count ++;
+	}
+	hev_slist_free (pending);
+
+	if (HEV_SOCKS5_HANDOFF_COMMIT == type)
+	  printf ("Handoff took over %u sessions!\n", count);
+	else
+	  printf ("Handoff not confirmed, sessions stay with the old process!\n");
+}
+
+static void
+transfer_free (HevSocks5Server *self)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+
+	hev_event_loop_del_source (self->loop, transfer->source);
+	hev_event_loop_del_source (self->loop, transfer->timer_source);
+	close (transfer->fd);
+	hev_slist_free (transfer->frozen_list);
+	hev_slist_free (transfer->sent_list);
+	HEV_MEMORY_ALLOCATOR_FREE (transfer);
+	self->transfer = NULL;
+}
+
+static void
+transfer_resume (HevSocks5Server *self, HevSocks5Session *session)
+{
+	hev_event_loop_add_source (self->loop, hev_socks5_session_get_source (session));
+	hev_socks5_session_thaw (session);
+	self->session_list = hev_slist_prepend (self->session_list, session);
+}
+
+static void
+transfer_fail (HevSocks5Server *self)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+	HevSList *list = NULL;
+
+	/* the new process is gone, keep serving */
+	printf ("Handoff failed!\n");
+	for (list=transfer->frozen_list; list; list=hev_slist_next (list))
+	  transfer_resume (self, hev_slist_data (list));
+	for (list=transfer->sent_list; list; list=hev_slist_next (list))
+	  transfer_resume (self, hev_slist_data (list));
+	for (list=self->listener_list; list; list=hev_slist_next (list)) {
+		HevSocks5Listener *listener = hev_slist_data (list);
+		if (!listener->source)
+		  listener_watch (listener);
+	}
+	transfer_free (self);
+}
+
+static void
+transfer_commit (HevSocks5Server *self, const uint8_t *adopted, size_t len)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+	unsigned int seq = transfer->sent_count, left = 0;
+	HevSList *list = NULL;
+
+	if (!hev_socks5_handoff_send (transfer->fd, HEV_SOCKS5_HANDOFF_COMMIT,
+					NULL, 0, NULL, 0)) {
+		transfer_fail (self);
+		return;
+	}
+
+	/* newest first, so the record numbers count down */
+	for (list=transfer->sent_list; list; list=hev_slist_next (list)) {
+		HevSocks5Session *session = hev_slist_data (list);
+		HevSocks5Listener *listener = hev_socks5_session_get_notify_data (session);
+
+		seq --;
+		if ((len <= (seq / 8)) || !(adopted[seq / 8] & (1 << (seq % 8)))) {
+			transfer_resume (self, session);
+			continue;
+		}
+		hev_socks5_session_set_close_reason (session, HEV_SOCKS5_SESSION_CLOSE_HANDOFF);
+		listener->active --;
+		hev_socks5_session_unref (session);
+	}
+
+	/* the paths belong to the new process now */
+	for (list=self->listener_list; list; list=hev_slist_next (list)) {
+		HevSocks5Listener *listener = hev_slist_data (list);
+		free (listener->path);
+		listener->path = NULL;
+	}
+	hev_socks5_control_disown (self->control);
+	self->handed_off = true;
+	for (list=self->session_list; list; list=hev_slist_next (list))
+	  left ++;
+	printf ("Handed off, %u sessions left to finish!\n", left);
+	transfer_free (self);
+	if (!self->session_list)
+	  hev_event_loop_quit (self->loop);
+}
+
+/* packs the next record, false once the end is out */
+static bool
+transfer_fill (HevSocks5Server *self)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+	uint8_t payload[HEV_SOCKS5_HANDOFF_PAYLOAD_MAX];
+	size_t len = 0;
+
+	if (transfer->ended)
+	  return false;
+	transfer->out_off = 0;
+	transfer->fd_count = 0;
+
+	if (transfer->listener) {
+		HevSocks5Listener *listener = hev_slist_data (transfer->listener);
+
+		transfer->out_len = hev_socks5_handoff_pack (transfer->out,
+					HEV_SOCKS5_HANDOFF_LISTENER, listener->name, strlen (listener->name));
+		transfer->fds[0] = listener->fd;
+		transfer->fd_count = 1;
+		transfer->listener = hev_slist_next (transfer->listener);
+		return true;
+	}
+
+	if (!transfer->cache_sent) {
+		if (self->negcache)
+		  len = hev_socks5_negcache_save (self->negcache, payload, sizeof (payload));
+		transfer->out_len = hev_socks5_handoff_pack (transfer->out,
+					HEV_SOCKS5_HANDOFF_CACHE, payload, len);
+		transfer->cache_sent = true;
+		return true;
+	}
+
+	while (transfer->frozen_list) {
+		HevSocks5Session *session = hev_slist_data (transfer->frozen_list);
+		HevSocks5Listener *listener = hev_socks5_session_get_notify_data (session);
+		ssize_t size = 0;
+
+		transfer->frozen_list = hev_slist_remove (transfer->frozen_list, session);
+		memset (payload, 0, sizeof (listener->name));
+		strcpy ((char *) payload, listener->name);
+		size = hev_socks5_session_export (session, payload + sizeof (listener->name),
+					sizeof (payload) - sizeof (listener->name), transfer->fds);
+		if (0 > size) {
+			transfer_resume (self, session);
+			continue;
+		}
+		transfer->out_len = hev_socks5_handoff_pack (transfer->out,
+					HEV_SOCKS5_HANDOFF_SESSION, payload,
+					sizeof (listener->name) + size);
+		transfer->fd_count = 2;
+		transfer->sent_list = hev_slist_prepend (transfer->sent_list, session);
+		transfer->sent_count ++;
+		return true;
+	}
+
+	transfer->out_len = hev_socks5_handoff_pack (transfer->out,
+				HEV_SOCKS5_HANDOFF_END, NULL, 0);
+	transfer->ended = true;
+
+	return true;
+}
+
+/* 1 once the end is out, 0 when the socket is full, -1 on error */
+static int
+transfer_flush (HevSocks5Server *self)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+
+	for (;;) {
+		bool first = false;
+		ssize_t size = 0;
+
+		if ((transfer->out_off == transfer->out_len) && !transfer_fill (self))
+		  return 1;
+		/* the fds ride on the first byte of their record */
+		first = (0 == transfer->out_off);
+		size = hev_socks5_handoff_write (transfer->fd,
+					transfer->out + transfer->out_off,
+					transfer->out_len - transfer->out_off,
+					first ? transfer->fds : NULL, first ? transfer->fd_count : 0);
+		if (0 > size)
+		  return (EAGAIN == errno) ? 0 : -1;
+		transfer->out_off += size;
+		transfer->idle = 0;
+	}
+}
+
+/* 1 once acked and committed, 0 while waiting, -1 when the new
+ * process is gone or sent something else */
+static int
+transfer_receive (HevSocks5Server *self)
+{
+	HevSocks5Transfer *transfer = self->transfer;
+	HevSocks5HandoffType type = 0;
+	const void *payload = NULL;
+	size_t len = 0;
+
+	for (;;) {
+		ssize_t size = recv (transfer->fd, transfer->in + transfer->in_len,
+					sizeof (transfer->in) - transfer->in_len, 0);
+		if (0 > size) {
+			if (EAGAIN == errno)
+			  break;
+			return -1;
+		}
+		/* eof, or a record too long to ever complete */
+		if (0 == size)
+		  return -1;
+		transfer->in_len += size;
+		transfer->idle = 0;
+	}
+
+	if (!hev_socks5_handoff_unpack (transfer->in, transfer->in_len, &type,
+					&payload, &len))
+	  return 0;
+	if ((HEV_SOCKS5_HANDOFF_ACK != type) || !transfer->ended ||
+				(transfer->out_off != transfer->out_len))
+	  return -1;
+	transfer_commit (self, payload, len);
+
+	return 1;
+}
+
+static bool
+transfer_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevSocks5Server *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	int res = 0;
+
+	res = transfer_flush (self);
+	if (0 <= res)
+	  res = transfer_receive (self);
+	if (0 > res)
+	  transfer_fail (self);
+	else if (0 == res)
+	  fd->revents = 0;
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_CONTROL, mon);
+
+	return true;
+}
+
+static bool
+transfer_timer_handler (void *data)
+{
+	HevSocks5Server *self = data;
+
+	/* stopped reading, or never acks */
+	self->transfer->idle ++;
+	if (HANDOFF_TIMEOUT <= self->transfer->idle)
+	  transfer_fail (self);
+
+	return true;
+}
+
+static void
+handoff_send (HevSocks5Server *self, int fd, unsigned int version)
+{
+	HevSocks5Transfer *transfer = NULL;
+	HevSList *list = NULL;
+	unsigned int count = 0;
+	int nonblock = 1;
+
+	/* an end right away leaves the new process to start cold */
+	if ((HEV_SOCKS5_HANDOFF_VERSION != version) || self->handed_off || self->transfer)
+	  goto refuse;
+	transfer = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Transfer));
+	if (!transfer)
+	  goto refuse;
+	memset (transfer, 0, sizeof (HevSocks5Transfer));
+	/* the control client closes its fd once this returns */
+	transfer->fd = dup (fd);
+	if (0 > transfer->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (transfer);
+		goto refuse;
+	}
+	ioctl (transfer->fd, FIONBIO, (char *) &nonblock);
+	transfer->listener = self->listener_list;
+	self->transfer = transfer;
+
+	/* stop accepting, pending connections wait in the shared queue */
+	listener_pause_all (self);
+	self->accept_paused = false;
+
+	/* relays hold still off the loop until the ack, anything else
+	 * finishes here */
+	for (list=self->session_list; list; list=hev_slist_next (list)) {
+		HevSocks5Session *session = hev_slist_data (list);
+
+		if ((HEV_SOCKS5_HANDOFF_SESSIONS_MAX <= count) ||
+					!hev_socks5_session_freeze (session))
+		  continue;
+		walk_skip (self, session);
+		hev_event_loop_del_source (self->loop, hev_socks5_session_get_source (session));
+		transfer->frozen_list = hev_slist_prepend (transfer->frozen_list, session);
+		hev_slist_set_data (list, NULL);
+		count ++;
+	}
+	self->session_list = hev_slist_remove_all (self->session_list, NULL);
+
+	transfer->source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (transfer->source, -1);
+	hev_event_source_add_fd (transfer->source, transfer->fd,
+				EPOLLIN | EPOLLOUT | EPOLLET);
+	hev_event_source_set_callback (transfer->source,
+				(HevEventSourceFunc) transfer_source_handler, self, NULL);
+	hev_event_loop_add_source (self->loop, transfer->source);
+	hev_event_source_unref (transfer->source);
+	transfer->timer_source = hev_event_source_timeout_new (HANDOFF_INTERVAL);
+	hev_event_source_set_priority (transfer->timer_source, -1);
+	hev_event_source_set_callback (transfer->timer_source,
+				transfer_timer_handler, self, NULL);
+	hev_event_loop_add_source (self->loop, transfer->timer_source);
+	hev_event_source_unref (transfer->timer_source);
+
+	return;
+
+refuse:
+	hev_socks5_handoff_send (fd, HEV_SOCKS5_HANDOFF_END, NULL, 0, NULL, 0);
+}
+
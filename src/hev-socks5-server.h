@@ -14,10 +14,13 @@
 
 typedef struct _HevSocks5Server HevSocks5Server;
 
-HevSocks5Server * hev_socks5_server_new (HevEventLoop *loop, const char *addr, unsigned short port);
+HevSocks5Server * hev_socks5_server_new (HevEventLoop *loop);
 
 HevSocks5Server * hev_socks5_server_ref (HevSocks5Server *self);
 void hev_socks5_server_unref (HevSocks5Server *self);
 
+void hev_socks5_server_reload (HevSocks5Server *self);
+void hev_socks5_server_dump_stats (HevSocks5Server *self, int fd);
+
 #endif /* __HEV_SOCKS5_SERVER_H__ */
 
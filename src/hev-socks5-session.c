@@ -10,17 +10,35 @@
 #include <errno.h>
 #include <netdb.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
 
 #include "hev-socks5-session.h"
+#include "hev-socks5-stats.h"
+#include "hev-socks5-loopmon.h"
+#include "hev-socks5-budget.h"
+#include "hev-socks5-busypoll.h"
 #include "hev-dns-resolver.h"
 
 #define DNS_SERVER	"8.8.8.8"
+#define DRAIN_INTERVAL	10	/* ms */
+#define DRAIN_TICKS	3000
+#define MAX_ADDRS	8
+#define CONNECT_STAGGER	250	/* ms */
+#define RING_SIZE	2000
+#define SOCKMAP_RETRY	1000	/* ms */
+#define INTEREST_LINGER	8	/* updates an unneeded bit stays subscribed */
+
+/* tag bit in dispatch pointers, sessions are at least 8 byte aligned */
+#define DIRECT_REMOTE	((uintptr_t) 1)
 
 enum
 {
@@ -31,12 +49,25 @@ enum
 	REMOTE_OUT = (1 << 0),
 };
 
+enum
+{
+	PHASE_AUTH,
+	PHASE_REQUEST,
+	PHASE_DNS,
+	PHASE_CONNECT,
+	PHASE_RELAY,
+};
+
 enum
 {
 	STEP_NULL,
+	STEP_TLS_HANDSHAKE,
 	STEP_READ_AUTH_METHOD,
 	STEP_WRITE_AUTH_METHOD,
+	STEP_READ_AUTH_USERPASS,
+	STEP_WRITE_AUTH_USERPASS,
 	STEP_READ_REQUEST,
+	STEP_DO_FORWARD,
 	STEP_DO_CONNECT,
 	STEP_PARSE_ADDR_IPV4,
 	STEP_PARSE_ADDR_DOMAIN,
@@ -49,30 +80,156 @@ enum
 	STEP_CLOSE_SESSION,
 };
 
+static const char *step_names[] =
+{
+	"null",
+	"tls-handshake",
+	"read-auth-method",
+	"write-auth-method",
+	"read-auth-userpass",
+	"write-auth-userpass",
+	"read-request",
+	"do-forward",
+	"do-connect",
+	"parse-addr-ipv4",
+	"parse-addr-domain",
+	"wait-dns-resolv",
+	"do-socket-connect",
+	"wait-socket-connect",
+	"write-response",
+	"splice",
+	"write-response-error",
+	"close-session",
+};
+
+static uint64_t session_serial;
+
+typedef struct _HevSocks5SessionAttempt HevSocks5SessionAttempt;
+typedef struct _HevSocks5SessionState HevSocks5SessionState;
+
+struct _HevSocks5SessionAttempt
+{
+	int fd;
+	int egress_index;
+	HevEventSourceFD *source_fd;
+};
+
+/* a relay carried to another process, buffered bytes follow */
+struct _HevSocks5SessionState
+{
+	struct sockaddr_in addr;
+	struct sockaddr_in peer;
+	uint64_t forward_bytes;
+	uint64_t backward_bytes;
+	uint64_t age;		/* ns since accept */
+	uint64_t handshake;	/* ns from accept to relay */
+	int32_t egress_index;	/* -1 when no pool address was bound */
+	struct in_addr egress_source;
+	uint32_t forward_len;
+	uint32_t backward_len;
+};
+
 struct _HevSocks5Session
 {
 	int cfd;
 	int rfd;
 	int dfd;
+	int tfd;
+	int race_tfd;
+	int connect_error;
+	int egress_index;
+	int sockmap_slot;
 	unsigned int ref_count;
 	unsigned int step;
+	uint64_t id;
 	bool idle;
+	bool peer_loaded;
+	bool direct;
+	bool early_reply;
+	bool tunnelled;		/* rfd is a socketpair end into the parent */
+	bool remote_reset;
+	const char *forward_host;	/* static target, no handshake */
+	uint16_t forward_port;
+	bool replied;
 	uint8_t revents;
+	uint8_t eof;
+	uint8_t throttled;
+	unsigned int drain_ticks;
+	uint32_t client_events;
+	uint32_t remote_events;
+	uint8_t client_linger;
+	uint8_t remote_linger;
 	uint8_t auth_method;
+	uint8_t auth_status;
 	uint8_t addr_type;
+	uint8_t close_reason;
+	uint8_t phase;
+	uint8_t class;		/* the priority the source runs at */
+	uint8_t next_class;	/* resolved so far, applied at the relay */
 	size_t roffset;
+	unsigned int stagger;
+	unsigned int addr_count;
+	unsigned int addr_next;
+	unsigned int attempts_pending;
+	uint32_t addrs[MAX_ADDRS];
+	HevSocks5SessionAttempt attempts[MAX_ADDRS];
+	uint64_t forward_bytes;
+	uint64_t backward_bytes;
+	uint64_t client_sent;
+	uint64_t remote_sent;
+	uint64_t hitters_bytes;
+	uint64_t sockmap_forward;
+	uint64_t sockmap_backward;
+	uint64_t sockmap_retry;
+	uint64_t auth_time;
+	uint64_t start_time;
+	uint64_t active_time;
+	uint64_t splice_time;
+	uint64_t phase_time;
+	uint64_t client_stall;
+	uint64_t remote_stall;
+	uint64_t ring_full;
+	uint64_t socket_full;
+	uint64_t budget_held;
+	uint64_t sample_bytes;
+	uint64_t sample_ring_full;
+	uint64_t sample_socket_full;
+	uint32_t sample_retrans[2];
 	HevEventSourceFD *client_fd;
 	HevEventSourceFD *remote_fd;
 	HevRingBuffer *forward_buffer;
 	HevRingBuffer *backward_buffer;
 	HevEventSource *source;
+	HevSocks5Auth *auth;
+	HevSocks5Hosts *hosts;
+	HevSocks5Egress *egress;
+	const HevSocks5Tuning *tuning;
+	HevSocks5Sockmap *sockmap;
+	HevSocks5AccessLog *accesslog;
+	HevSocks5Hitters *hitters;
+	const HevSocks5SessionDeadlines *deadlines;
+	HevSocks5Dispatch *dispatch;
+	HevSocks5Tls *tls;
+	HevSocks5TlsConn *tls_conn;
+	HevSocks5NegCache *negcache;
+	HevSocks5Tunnel *parent;
+	HevSocks5Classes *classes;
+	HevEventSourceFD direct_fds[2];
 	HevSocks5SessionCloseNotify notify;
 	void *notify_data;
 	struct sockaddr_in addr;
+	struct sockaddr_in peer;
 };
 
 static bool session_source_socks5_handler (HevEventSourceFD *fd, void *data);
+static void session_sockmap_detach (HevSocks5Session *self);
+static bool session_sockmap_refresh (HevSocks5Session *self);
 static bool session_source_splice_handler (HevEventSourceFD *fd, void *data);
+static void session_update_interest (HevSocks5Session *self);
+static void session_log (HevSocks5Session *self);
+static void session_hitters_report (HevSocks5Session *self);
+static void session_attempt_close (HevSocks5Session *self, unsigned int index);
+static void session_race_timer_update (HevSocks5Session *self);
 
 HevSocks5Session *
 hev_socks5_session_new (int client_fd, HevSocks5SessionCloseNotify notify, void *notify_data)
@@ -83,13 +240,80 @@ hev_socks5_session_new (int client_fd, HevSocks5SessionCloseNotify notify, void
 		self->cfd = client_fd;
 		self->rfd = -1;
 		self->dfd = -1;
-		self->revents = 0;
+		self->tfd = -1;
+		self->race_tfd = -1;
+		self->connect_error = 0;
+		self->stagger = CONNECT_STAGGER;
+		self->addr_count = 0;
+		self->addr_next = 0;
+		self->attempts_pending = 0;
+		self->roffset = 0;
+		self->eof = 0;
+		self->throttled = 0;
+		self->client_linger = 0;
+		self->remote_linger = 0;
+		self->drain_ticks = 0;
+		/* writable until a write says otherwise */
+		self->revents = CLIENT_OUT;
 		self->idle = false;
 		self->client_fd = NULL;
 		self->remote_fd = NULL;
-		self->forward_buffer = hev_ring_buffer_new (2000);
-		self->backward_buffer = hev_ring_buffer_new (2000);
+		self->forward_buffer = hev_ring_buffer_new (RING_SIZE);
+		self->backward_buffer = hev_ring_buffer_new (RING_SIZE);
+		self->budget_held = 0;
+		hev_socks5_budget.allocated += 2 * RING_SIZE;
 		self->source = NULL;
+		self->auth = NULL;
+		self->hosts = NULL;
+		self->egress = NULL;
+		self->egress_index = -1;
+		self->tuning = NULL;
+		self->sockmap = NULL;
+		self->sockmap_slot = -1;
+		self->forward_bytes = 0;
+		self->backward_bytes = 0;
+		self->client_sent = 0;
+		self->remote_sent = 0;
+		self->sockmap_forward = 0;
+		self->sockmap_backward = 0;
+		self->sockmap_retry = 0;
+		self->accesslog = NULL;
+		self->hitters = NULL;
+		self->hitters_bytes = 0;
+		self->peer_loaded = false;
+		self->close_reason = HEV_SOCKS5_SESSION_CLOSE_ERROR;
+		self->id = ++ session_serial;
+		self->start_time = hev_socks5_stats_clock ();
+		self->active_time = self->start_time;
+		self->splice_time = 0;
+		self->phase = PHASE_AUTH;
+		self->phase_time = self->start_time;
+		self->client_stall = 0;
+		self->remote_stall = 0;
+		self->ring_full = 0;
+		self->socket_full = 0;
+		self->sample_bytes = 0;
+		self->sample_ring_full = 0;
+		self->sample_socket_full = 0;
+		self->sample_retrans[0] = 0;
+		self->sample_retrans[1] = 0;
+		self->deadlines = NULL;
+		self->dispatch = NULL;
+		self->direct = false;
+		self->early_reply = false;
+		self->forward_host = NULL;
+		self->forward_port = 0;
+		self->replied = false;
+		self->tls = NULL;
+		self->tls_conn = NULL;
+		self->negcache = NULL;
+		self->parent = NULL;
+		self->tunnelled = false;
+		self->remote_reset = false;
+		self->classes = NULL;
+		self->class = HEV_SOCKS5_CLASS_DEFAULT;
+		self->next_class = HEV_SOCKS5_CLASS_DEFAULT;
+		memset (&self->peer, 0, sizeof (self->peer));
 		self->step = STEP_NULL;
 		self->notify = notify;
 		self->notify_data = notify_data;
@@ -110,18 +334,77 @@ hev_socks5_session_ref (HevSocks5Session *self)
 void
 hev_socks5_session_unref (HevSocks5Session *self)
 {
+	unsigned int i = 0;
+
 	if (self) {
 		self->ref_count --;
 		if (0 == self->ref_count) {
+			hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_CLOSE_CLIENT +
+						self->close_reason, 1);
+			if (self->hitters) {
+				session_hitters_report (self);
+				hev_socks5_hitters_unref (self->hitters);
+			}
+			if (self->accesslog) {
+				session_log (self);
+				hev_socks5_accesslog_unref (self->accesslog);
+			}
+			if (self->sockmap) {
+				session_sockmap_detach (self);
+				hev_socks5_sockmap_unref (self->sockmap);
+			}
+			if (self->dispatch) {
+				if (self->direct) {
+					hev_socks5_dispatch_del (self->dispatch, self->cfd, self);
+					hev_socks5_dispatch_del (self->dispatch, self->rfd,
+								(void *) ((uintptr_t) self | DIRECT_REMOTE));
+				}
+				hev_socks5_dispatch_unref (self->dispatch);
+			}
+			if (self->tls) {
+				if (self->tls_conn)
+				  hev_socks5_tls_conn_free (self->tls_conn);
+				hev_socks5_tls_unref (self->tls);
+			}
+			for (i=0; i<self->addr_next; i++) {
+				if (-1 < self->attempts[i].fd)
+				  session_attempt_close (self, i);
+			}
+			if (self->negcache)
+			  hev_socks5_negcache_unref (self->negcache);
+			if (self->parent)
+			  hev_socks5_tunnel_unref (self->parent);
+			if (self->classes)
+			  hev_socks5_classes_unref (self->classes);
+			if (-1 < self->race_tfd)
+			  close (self->race_tfd);
+			/* told the client it worked, a reset is the only way back;
+			 * a reset remote is passed on as one */
+			if ((self->replied && (-1 == self->rfd)) || self->remote_reset) {
+				struct linger linger = { 1, 0 };
+				setsockopt (self->cfd, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+			}
 			close (self->cfd);
 			if (-1 < self->rfd)
 			  close (self->rfd);
 			if (-1 < self->dfd)
 			  close (self->dfd);
+			if (-1 < self->tfd)
+			  close (self->tfd);
 			hev_ring_buffer_unref (self->forward_buffer);
 			hev_ring_buffer_unref (self->backward_buffer);
+			hev_socks5_budget_adjust (-(int64_t) self->budget_held);
+			hev_socks5_budget.allocated -= 2 * RING_SIZE;
 			if (self->source)
 			  hev_event_source_unref (self->source);
+			if (self->auth)
+			  hev_socks5_auth_unref (self->auth);
+			if (self->hosts)
+			  hev_socks5_hosts_unref (self->hosts);
+			if (self->egress) {
+				hev_socks5_egress_release (self->egress, self->egress_index, &self->addr);
+				hev_socks5_egress_unref (self->egress);
+			}
 			HEV_MEMORY_ALLOCATOR_FREE (self);
 		}
 	}
@@ -136,11 +419,18 @@ hev_socks5_session_get_source (HevSocks5Session *self)
 		self->source = hev_event_source_fds_new ();
 		if (self->source) {
 			int nonblock = 1;
+			hev_event_source_set_priority (self->source,
+						hev_socks5_class_priority (self->class));
 			hev_event_source_set_callback (self->source,
 						(HevEventSourceFunc) session_source_socks5_handler, self, NULL);
 			ioctl (self->cfd, FIONBIO, (char *) &nonblock);
+			self->client_events = EPOLLIN | EPOLLET;
+			/* a forward waits for nothing, the first writable edge
+			 * starts the connect */
+			if (self->forward_host)
+			  self->client_events |= EPOLLOUT;
 			self->client_fd = hev_event_source_add_fd (self->source, self->cfd,
-						EPOLLIN | EPOLLOUT | EPOLLET);
+						self->client_events);
 		}
 		return self->source;
 	}
@@ -148,6 +438,18 @@ hev_socks5_session_get_source (HevSocks5Session *self)
 	return NULL;
 }
 
+void *
+hev_socks5_session_get_notify_data (HevSocks5Session *self)
+{
+	return self ? self->notify_data : NULL;
+}
+
+uint64_t
+hev_socks5_session_get_id (HevSocks5Session *self)
+{
+	return self ? self->id : 0;
+}
+
 void
 hev_socks5_session_set_idle (HevSocks5Session *self)
 {
@@ -158,7 +460,339 @@ hev_socks5_session_set_idle (HevSocks5Session *self)
 bool
 hev_socks5_session_get_idle (HevSocks5Session *self)
 {
-	return self ? self->idle : false;
+	if (!self)
+	  return false;
+	/* kernel relayed traffic never wakes the session */
+	if ((-1 < self->sockmap_slot) && session_sockmap_refresh (self)) {
+		self->idle = false;
+		self->active_time = hev_socks5_stats_clock ();
+		if (self->hitters)
+		  session_hitters_report (self);
+	}
+
+	return self->idle;
+}
+
+void
+hev_socks5_session_set_dispatch (HevSocks5Session *self, HevSocks5Dispatch *dispatch)
+{
+	if (self) {
+		if (self->dispatch)
+		  hev_socks5_dispatch_unref (self->dispatch);
+		self->dispatch = hev_socks5_dispatch_ref (dispatch);
+	}
+}
+
+void
+hev_socks5_session_set_tls (HevSocks5Session *self, HevSocks5Tls *tls)
+{
+	if (self) {
+		if (self->tls)
+		  return;
+		/* the handshake comes before anything SOCKS5 */
+		self->tls = hev_socks5_tls_ref (tls);
+		self->tls_conn = hev_socks5_tls_accept (tls, self->cfd);
+		self->step = STEP_TLS_HANDSHAKE;
+	}
+}
+
+void
+hev_socks5_session_set_early_reply (HevSocks5Session *self, bool enable)
+{
+	if (self)
+	  self->early_reply = enable;
+}
+
+void
+hev_socks5_session_set_forward (HevSocks5Session *self, const char *host,
+			unsigned short port)
+{
+	if (self) {
+		self->forward_host = host;
+		self->forward_port = htons (port);
+		/* nobody waits for a reply, and none goes out on failure */
+		self->replied = true;
+		if (STEP_NULL == self->step)
+		  self->step = STEP_DO_FORWARD;
+	}
+}
+
+void
+hev_socks5_session_set_negcache (HevSocks5Session *self, HevSocks5NegCache *negcache)
+{
+	if (self) {
+		if (self->negcache)
+		  hev_socks5_negcache_unref (self->negcache);
+		self->negcache = hev_socks5_negcache_ref (negcache);
+	}
+}
+
+void
+hev_socks5_session_set_parent (HevSocks5Session *self, HevSocks5Tunnel *parent)
+{
+	if (self) {
+		if (self->parent)
+		  hev_socks5_tunnel_unref (self->parent);
+		self->parent = hev_socks5_tunnel_ref (parent);
+	}
+}
+
+void
+hev_socks5_session_set_classes (HevSocks5Session *self, HevSocks5Classes *classes)
+{
+	if (self) {
+		if (self->classes)
+		  hev_socks5_classes_unref (self->classes);
+		self->classes = hev_socks5_classes_ref (classes);
+	}
+}
+
+void
+hev_socks5_session_set_class (HevSocks5Session *self, HevSocks5Class class)
+{
+	if (self) {
+		self->class = class;
+		self->next_class = class;
+	}
+}
+
+void
+hev_socks5_session_set_connect_stagger (HevSocks5Session *self, unsigned int ms)
+{
+	if (self)
+	  self->stagger = ms;
+}
+
+void
+hev_socks5_session_set_deadlines (HevSocks5Session *self,
+			const HevSocks5SessionDeadlines *deadlines)
+{
+	if (self)
+	  self->deadlines = deadlines;
+}
+
+bool
+hev_socks5_session_check_deadline (HevSocks5Session *self, uint64_t now)
+{
+	const HevSocks5SessionDeadlines *deadlines = self->deadlines;
+	uint64_t limit = 0;
+	unsigned int reason = 0;
+
+	if (!deadlines)
+	  return false;
+
+	switch (self->phase) {
+	case PHASE_AUTH:
+		limit = deadlines->auth;
+		reason = HEV_SOCKS5_SESSION_CLOSE_AUTH_TIMEOUT;
+		break;
+	case PHASE_REQUEST:
+		limit = deadlines->request;
+		reason = HEV_SOCKS5_SESSION_CLOSE_REQUEST_TIMEOUT;
+		break;
+	case PHASE_DNS:
+		limit = deadlines->dns;
+		reason = HEV_SOCKS5_SESSION_CLOSE_DNS_TIMEOUT;
+		break;
+	case PHASE_CONNECT:
+		limit = deadlines->connect;
+		reason = HEV_SOCKS5_SESSION_CLOSE_CONNECT_TIMEOUT;
+		break;
+	default:
+		/* relay: a write blocked with no progress since the stall began */
+		if (!deadlines->stall)
+		  return false;
+		if ((self->client_stall && (deadlines->stall < (now - self->client_stall))) ||
+					(self->remote_stall && (deadlines->stall < (now - self->remote_stall)))) {
+			self->close_reason = HEV_SOCKS5_SESSION_CLOSE_STALL;
+			return true;
+		}
+		return false;
+	}
+	if (!limit || (limit >= (now - self->phase_time)))
+	  return false;
+	self->close_reason = reason;
+	/* addresses still connecting count as timed out */
+	if ((HEV_SOCKS5_SESSION_CLOSE_CONNECT_TIMEOUT == reason) && self->negcache) {
+		unsigned int i = 0;
+
+		for (i=0; i<self->addr_next; i++) {
+			struct sockaddr_in dest = self->addr;
+
+			if (0 > self->attempts[i].fd)
+			  continue;
+			dest.sin_addr.s_addr = self->addrs[i];
+			hev_socks5_negcache_failure (self->negcache, &dest, ETIMEDOUT);
+		}
+	}
+	/* the session is freed right after, so the host unreachable reply
+	 * goes out directly when nothing is queued ahead of it */
+	if (((HEV_SOCKS5_SESSION_CLOSE_DNS_TIMEOUT == reason) ||
+				(HEV_SOCKS5_SESSION_CLOSE_CONNECT_TIMEOUT == reason)) && !self->replied) {
+		struct iovec iovec[2];
+
+		if (0 == hev_ring_buffer_reading (self->backward_buffer, iovec)) {
+			uint8_t rep[10] = { 0x05, 0x04, 0x00, 0x01 };
+
+			send (self->cfd, rep, sizeof (rep), MSG_NOSIGNAL);
+		}
+	}
+
+	return true;
+}
+
+static bool
+session_tcp_sample (int fd, uint32_t *retrans, HevSocks5FlowsSample *sample)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof (info);
+	int queued = 0;
+
+	memset (&info, 0, sizeof (info));
+	if (0 > getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+	  return false;
+	if (0 > ioctl (fd, SIOCOUTQ, &queued))
+	  queued = 0;
+	sample->rtt = info.tcpi_rtt;
+	sample->rttvar = info.tcpi_rttvar;
+	/* the kernel counts from connect, report what is new */
+	sample->retrans = info.tcpi_total_retrans - *retrans;
+	*retrans = info.tcpi_total_retrans;
+	sample->cwnd = info.tcpi_snd_cwnd;
+	sample->delivery_rate = info.tcpi_delivery_rate;
+	sample->send_queue = queued;
+
+	return true;
+}
+
+void
+hev_socks5_session_sample (HevSocks5Session *self, HevSocks5Flows *flows)
+{
+	HevSocks5FlowsSample client, remote;
+	HevSocks5FlowsLimit limit = HEV_SOCKS5_FLOWS_LIMIT_APP;
+	uint64_t bytes = 0;
+	bool has_client = false, has_remote = false;
+
+	if (!self || (STEP_DO_SPLICE != self->step))
+	  return;
+	if (-1 < self->sockmap_slot)
+	  session_sockmap_refresh (self);
+	bytes = self->forward_bytes + self->backward_bytes;
+	if (bytes == self->sample_bytes)
+	  return;
+	self->sample_bytes = bytes;
+
+	/* unix socket clients and tunnelled remotes have no TCP side to read */
+	if (!self->tunnelled)
+	  has_remote = session_tcp_sample (self->rfd, &self->sample_retrans[1], &remote);
+	has_client = session_tcp_sample (self->cfd, &self->sample_retrans[0], &client);
+	if (!has_client && !has_remote)
+	  return;
+
+	/* a refused write means the network is the limit, a full ring with
+	 * the sockets still taking data means the relay is */
+	if (self->socket_full != self->sample_socket_full)
+	  limit = HEV_SOCKS5_FLOWS_LIMIT_SOCKET;
+	else if (self->ring_full != self->sample_ring_full)
+	  limit = HEV_SOCKS5_FLOWS_LIMIT_RING;
+	self->sample_socket_full = self->socket_full;
+	self->sample_ring_full = self->ring_full;
+
+	hev_socks5_flows_add (flows, &self->addr, has_client ? &client : NULL,
+				has_remote ? &remote : NULL, limit);
+}
+
+void
+hev_socks5_session_set_auth (HevSocks5Session *self, HevSocks5Auth *auth)
+{
+	if (self) {
+		if (self->auth)
+		  hev_socks5_auth_unref (self->auth);
+		self->auth = hev_socks5_auth_ref (auth);
+	}
+}
+
+void
+hev_socks5_session_set_hosts (HevSocks5Session *self, HevSocks5Hosts *hosts)
+{
+	if (self) {
+		if (self->hosts)
+		  hev_socks5_hosts_unref (self->hosts);
+		self->hosts = hev_socks5_hosts_ref (hosts);
+	}
+}
+
+void
+hev_socks5_session_set_egress (HevSocks5Session *self, HevSocks5Egress *egress)
+{
+	if (self) {
+		if (self->egress)
+		  hev_socks5_egress_unref (self->egress);
+		self->egress = hev_socks5_egress_ref (egress);
+	}
+}
+
+void
+hev_socks5_session_set_sockmap (HevSocks5Session *self, HevSocks5Sockmap *sockmap)
+{
+	if (self) {
+		if (self->sockmap)
+		  hev_socks5_sockmap_unref (self->sockmap);
+		self->sockmap = hev_socks5_sockmap_ref (sockmap);
+	}
+}
+
+static void
+session_load_peer (HevSocks5Session *self)
+{
+	socklen_t len = sizeof (self->peer);
+
+	if (self->peer_loaded)
+	  return;
+	/* unix socket clients leave the peer address zeroed */
+	if ((0 > getpeername (self->cfd, (struct sockaddr *) &self->peer, &len)) ||
+				(AF_INET != self->peer.sin_family))
+	  memset (&self->peer, 0, sizeof (self->peer));
+	self->peer_loaded = true;
+}
+
+void
+hev_socks5_session_set_accesslog (HevSocks5Session *self, HevSocks5AccessLog *accesslog)
+{
+	if (self) {
+		if (self->accesslog)
+		  hev_socks5_accesslog_unref (self->accesslog);
+		self->accesslog = hev_socks5_accesslog_ref (accesslog);
+		session_load_peer (self);
+	}
+}
+
+void
+hev_socks5_session_set_hitters (HevSocks5Session *self, HevSocks5Hitters *hitters)
+{
+	if (self) {
+		if (self->hitters)
+		  hev_socks5_hitters_unref (self->hitters);
+		self->hitters = hev_socks5_hitters_ref (hitters);
+		session_load_peer (self);
+	}
+}
+
+void
+hev_socks5_session_set_close_reason (HevSocks5Session *self,
+			HevSocks5SessionCloseReason reason)
+{
+	if (self)
+	  self->close_reason = reason;
+}
+
+void
+hev_socks5_session_set_tuning (HevSocks5Session *self, const HevSocks5Tuning *tuning)
+{
+	if (self) {
+		self->tuning = tuning;
+		hev_socks5_tuning_apply (tuning, self->cfd);
+	}
 }
 
 static size_t
@@ -172,6 +806,23 @@ iovec_size (struct iovec *iovec, size_t iovec_len)
 	return size;
 }
 
+static size_t
+ring_used (HevRingBuffer *buffer)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = hev_ring_buffer_reading (buffer, iovec);
+
+	return iovec_size (iovec, iovec_len);
+}
+
+/* near the budget, a reader already holding half its ring waits for the
+ * writer, whose pending data guarantees the session is woken again */
+static bool
+session_budget_hold (HevRingBuffer *buffer)
+{
+	return hev_socks5_budget_tight () && ((RING_SIZE / 2) <= ring_used (buffer));
+}
+
 static ssize_t
 read_data (int fd, HevRingBuffer *buffer)
 {
@@ -229,7 +880,11 @@ client_read (HevSocks5Session *self)
 				return false;
 			}
 		} else if (0 == size) {
+			self->eof = CLIENT_IN;
 			return false;
+		} else {
+			self->forward_bytes += size;
+			hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_RELAY_BYTES, size);
 		}
 	} else {
 		self->client_fd->revents &= ~EPOLLIN;
@@ -241,10 +896,24 @@ client_read (HevSocks5Session *self)
 static bool
 client_write (HevSocks5Session *self)
 {
-	ssize_t size = write_data (self->client_fd->fd, self->backward_buffer);
+	uint64_t sent = self->client_sent;
+	ssize_t size = 0;
+
+	/* flush until drained or the socket is full */
+	do {
+		size = write_data (self->client_fd->fd, self->backward_buffer);
+		if (0 < size)
+		  self->client_sent += size;
+	} while (0 < size);
+	if (sent != self->client_sent)
+	  self->client_stall = 0;
 	if (-2 < size) {
 		if (-1 == size) {
 			if (EAGAIN == errno) {
+				/* the stall clock runs until the next write makes progress */
+				if (!self->client_stall)
+				  self->client_stall = hev_socks5_stats_clock ();
+				self->socket_full ++;
 				self->revents &= ~CLIENT_OUT;
 				self->client_fd->revents &= ~EPOLLOUT;
 			} else {
@@ -271,7 +940,11 @@ remote_read (HevSocks5Session *self)
 				return false;
 			}
 		} else if (0 == size) {
+			self->eof = REMOTE_IN;
 			return false;
+		} else {
+			self->backward_bytes += size;
+			hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_RELAY_BYTES, size);
 		}
 	} else {
 		self->remote_fd->revents &= ~EPOLLIN;
@@ -283,10 +956,23 @@ remote_read (HevSocks5Session *self)
 static bool
 remote_write (HevSocks5Session *self)
 {
-	ssize_t size = write_data (self->remote_fd->fd, self->forward_buffer);
+	uint64_t sent = self->remote_sent;
+	ssize_t size = 0;
+
+	/* flush until drained or the socket is full */
+	do {
+		size = write_data (self->remote_fd->fd, self->forward_buffer);
+		if (0 < size)
+		  self->remote_sent += size;
+	} while (0 < size);
+	if (sent != self->remote_sent)
+	  self->remote_stall = 0;
 	if (-2 < size) {
 		if (-1 == size) {
 			if (EAGAIN == errno) {
+				if (!self->remote_stall)
+				  self->remote_stall = hev_socks5_stats_clock ();
+				self->socket_full ++;
 				self->revents &= ~REMOTE_OUT;
 				self->remote_fd->revents &= ~EPOLLOUT;
 			} else {
@@ -318,11 +1004,11 @@ socks5_read_auth_method (HevSocks5Session *self)
 	}
 	if ((2 + data[1]) > size)
 	  return true;
-	/* select a auth method (no auth method only) */
+	/* select a auth method (username/password when a credential store is set) */
 	self->auth_method = 0xff;
 	for (i=2; i<(2+data[1]); i++) {
-		if (0 == data[i]) {
-			self->auth_method = 0x00;
+		if ((self->auth ? 0x02 : 0x00) == data[i]) {
+			self->auth_method = data[i];
 			break;
 		}
 	}
@@ -351,6 +1037,73 @@ socks5_write_auth_method (HevSocks5Session *self)
 		self->step = STEP_CLOSE_SESSION;
 		return false;
 	}
+	if (0x02 == self->auth_method) {
+		self->auth_time = hev_socks5_stats_clock ();
+		self->step = STEP_READ_AUTH_USERPASS;
+		return false;
+	}
+	self->step = STEP_READ_REQUEST;
+
+	return false;
+}
+
+static inline bool
+socks5_read_auth_userpass (HevSocks5Session *self)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = 0, size = 0;
+	uint8_t ulen = 0, plen = 0, *data = NULL;
+
+	iovec_len = hev_ring_buffer_reading (self->forward_buffer, iovec);
+	data = iovec[0].iov_base;
+	size = iovec_size (iovec, iovec_len);
+	if ((self->roffset + 2) > size)
+	  return true;
+	data += self->roffset;
+	/* RFC 1929 sub-negotiation version */
+	if (0x01 != data[0]) {
+		self->step = STEP_CLOSE_SESSION;
+		return false;
+	}
+	ulen = data[1];
+	if ((self->roffset + ulen + 3) > size)
+	  return true;
+	plen = data[ulen+2];
+	if ((self->roffset + ulen + plen + 3) > size)
+	  return true;
+	self->auth_status = hev_socks5_auth_check (self->auth,
+				&data[2], ulen, &data[ulen+3], plen) ? 0x00 : 0x01;
+	if (self->classes && (0x00 == self->auth_status))
+	  self->next_class = hev_socks5_classes_match_user (self->classes,
+				  &data[2], ulen, self->next_class);
+	self->roffset += ulen + plen + 3;
+	/* write auth status to ring buffer */
+	hev_ring_buffer_writing (self->backward_buffer, iovec);
+	data = iovec[0].iov_base;
+	data[0] = 0x01;
+	data[1] = self->auth_status;
+	hev_ring_buffer_write_finish (self->backward_buffer, 2);
+	self->step = STEP_WRITE_AUTH_USERPASS;
+
+	return false;
+}
+
+static inline bool
+socks5_write_auth_userpass (HevSocks5Session *self)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = 0;
+
+	iovec_len = hev_ring_buffer_reading (self->backward_buffer, iovec);
+	if (0 != iovec_len)
+	  return true;
+	hev_socks5_stats_phase_add (HEV_SOCKS5_STATS_PHASE_AUTH,
+				hev_socks5_stats_clock () - self->auth_time,
+				0x00 == self->auth_status);
+	if (0x00 != self->auth_status) {
+		self->step = STEP_CLOSE_SESSION;
+		return false;
+	}
 	self->step = STEP_READ_REQUEST;
 
 	return false;
@@ -444,40 +1197,48 @@ socks5_parse_addr_ipv4 (HevSocks5Session *self)
 	return false;
 }
 
-static inline bool
-socks5_parse_addr_domain (HevSocks5Session *self)
+/* name is NUL terminated, len saves a strlen */
+static inline void
+socks5_write_response_rep (HevSocks5Session *self, uint8_t rep)
 {
 	struct iovec iovec[2];
-	size_t iovec_len = 0, size = 0;
 	uint8_t *data = NULL;
 
-	iovec_len = hev_ring_buffer_reading (self->forward_buffer, iovec);
+	hev_ring_buffer_writing (self->backward_buffer, iovec);
 	data = iovec[0].iov_base;
-	size = iovec_size (iovec, iovec_len);
-	if ((self->roffset + 1) > size)
-	  return true;
-	data += self->roffset;
-	if ((self->roffset + data[0] + 3) > size)
-	  return true;
-	/* construct addr */
-	memset (&self->addr, 0, sizeof (self->addr));
-	self->addr.sin_family = AF_INET;
-	memcpy (&self->addr.sin_port, &data[data[0]+1], 2);
-	data[data[0]+1] = 0x00;
-	self->roffset += data[0] + 3;
+	memset (data, 0, 10);
+	data[0] = 0x05;
+	data[1] = rep;
+	data[3] = 0x01;
+	hev_ring_buffer_write_finish (self->backward_buffer, 10);
+	self->step = STEP_WRITE_RESPONSE_ERROR;
+}
+
+static inline bool
+socks5_resolve_name (HevSocks5Session *self, const char *name, size_t len)
+{
 	/* checking is ipv4 addr */
-	self->addr.sin_addr.s_addr = inet_addr ((const char *) &data[1]);
+	self->addr.sin_addr.s_addr = inet_addr (name);
 	if (INADDR_NONE != self->addr.sin_addr.s_addr) {
 		self->step = STEP_DO_SOCKET_CONNECT;
 		return false;
 	}
+	/* then the static host map */
+	if (self->hosts && hev_socks5_hosts_lookup (self->hosts, name, len,
+					&self->addr.sin_addr.s_addr)) {
+		self->step = STEP_DO_SOCKET_CONNECT;
+		return false;
+	}
 	/* dns resolv */
 	if (-1 == self->dfd) {
 		self->dfd = hev_dns_resolver_new ();
 		hev_event_source_add_fd (self->source, self->dfd, EPOLLIN | EPOLLET);
 	}
-	if (!hev_dns_resolver_query (self->dfd, DNS_SERVER, (const char *) &data[1])) {
-		self->step = STEP_CLOSE_SESSION;
+	if (!hev_dns_resolver_query (self->dfd, DNS_SERVER, name)) {
+		if (self->replied)
+		  self->step = STEP_CLOSE_SESSION;
+		else
+		  socks5_write_response_rep (self, 0x01);
 		return false;
 	}
 	self->step = STEP_WAIT_DNS_RESOLV;
@@ -485,19 +1246,60 @@ socks5_parse_addr_domain (HevSocks5Session *self)
 }
 
 static inline bool
-socks5_wait_dns_resolv (HevSocks5Session *self)
+socks5_parse_addr_domain (HevSocks5Session *self)
+{
+	struct iovec iovec[2];
+	size_t iovec_len = 0, size = 0;
+	uint8_t *data = NULL;
+
+	iovec_len = hev_ring_buffer_reading (self->forward_buffer, iovec);
+	data = iovec[0].iov_base;
+	size = iovec_size (iovec, iovec_len);
+	if ((self->roffset + 1) > size)
+	  return true;
+	data += self->roffset;
+	if ((self->roffset + data[0] + 3) > size)
+	  return true;
+	/* construct addr */
+	memset (&self->addr, 0, sizeof (self->addr));
+	self->addr.sin_family = AF_INET;
+	memcpy (&self->addr.sin_port, &data[data[0]+1], 2);
+	data[data[0]+1] = 0x00;
+	self->roffset += data[0] + 3;
+
+	return socks5_resolve_name (self, (const char *) &data[1], data[0]);
+}
+
+static inline bool
+socks5_do_forward (HevSocks5Session *self)
 {
-	unsigned int addr;
+	memset (&self->addr, 0, sizeof (self->addr));
+	self->addr.sin_family = AF_INET;
+	self->addr.sin_port = self->forward_port;
 
+	return socks5_resolve_name (self, self->forward_host, strlen (self->forward_host));
+}
+
+static inline bool
+socks5_wait_dns_resolv (HevSocks5Session *self)
+{
 	if (!(DNSRSV_IN & self->revents))
 	  return true;
-	addr = hev_dns_resolver_query_finish (self->dfd);
-	memcpy (&self->addr.sin_addr, &addr, 4);
+	self->addr_count = hev_dns_resolver_query_finish (self->dfd,
+				self->addrs, MAX_ADDRS);
+	self->addr.sin_addr.s_addr = self->addrs[0];
 	/* close dns resolver */
 	hev_event_source_del_fd (self->source, self->dfd);
 	close (self->dfd);
 	self->dfd = -1;
 	self->step = STEP_DO_SOCKET_CONNECT;
+	/* no address to try, the client still hears why */
+	if (0 >= self->addr_count) {
+		if (self->replied)
+		  self->step = STEP_CLOSE_SESSION;
+		else
+		  socks5_write_response_rep (self, 0x04);
+	}
 
 	return false;
 }
@@ -520,33 +1322,266 @@ socks5_write_response_addr (HevSocks5Session *self)
 	hev_ring_buffer_write_finish (self->backward_buffer, 10);
 }
 
-static inline bool
-socks5_do_socket_connect (HevSocks5Session *self)
+static void
+session_connect_failed (HevSocks5Session *self)
 {
-	int nonblock = 1;
+	uint8_t rep = 0x01;
 
-	self->rfd = socket (AF_INET, SOCK_STREAM, 0);
-	if (-1 == self->rfd) {
+	if (self->replied) {
+		session_race_timer_update (self);
 		self->step = STEP_CLOSE_SESSION;
-		return false;
+		return;
 	}
-	ioctl (self->rfd, FIONBIO, (char *) &nonblock);
-	/* add fd to source */
+	switch (self->connect_error) {
+	case ECONNREFUSED:
+		rep = 0x05;
+		break;
+	case ENETUNREACH:
+		rep = 0x03;
+		break;
+	case EHOSTUNREACH:
+	case ETIMEDOUT:
+		rep = 0x04;
+		break;
+	}
+	/* every address failed or is known to fail, say why */
+	socks5_write_response_rep (self, rep);
+	session_race_timer_update (self);
+}
+
+static void
+session_attempt_failed (HevSocks5Session *self, unsigned int index, int error)
+{
+	self->connect_error = error;
+	if (self->negcache) {
+		struct sockaddr_in dest = self->addr;
+
+		dest.sin_addr.s_addr = self->addrs[index];
+		hev_socks5_negcache_failure (self->negcache, &dest, error);
+	}
+}
+
+static void
+session_attempt_close (HevSocks5Session *self, unsigned int index)
+{
+	HevSocks5SessionAttempt *attempt = &self->attempts[index];
+	struct sockaddr_in dest = self->addr;
+
 	if (self->source)
-	  self->remote_fd = hev_event_source_add_fd (self->source,
-				  self->rfd, EPOLLIN | EPOLLOUT | EPOLLET);
-	/* connect to remote host */
-	self->step = STEP_WAIT_SOCKET_CONNECT;
-	if (0 > connect (self->rfd, (struct sockaddr *) &self->addr, sizeof (self->addr))) {
-		if (EINPROGRESS != errno) {
-			self->step = STEP_CLOSE_SESSION;
+	  hev_event_source_del_fd (self->source, attempt->fd);
+	close (attempt->fd);
+	if (self->egress) {
+		dest.sin_addr.s_addr = self->addrs[index];
+		hev_socks5_egress_release (self->egress, attempt->egress_index, &dest);
+	}
+	attempt->fd = -1;
+	self->attempts_pending --;
+}
+
+static bool
+session_connect_next (HevSocks5Session *self)
+{
+	/* start the next address, false once nothing is in flight and
+	 * nothing is left to try */
+	while (self->addr_next < self->addr_count) {
+		unsigned int index = self->addr_next ++;
+		HevSocks5SessionAttempt *attempt = &self->attempts[index];
+		struct sockaddr_in dest = self->addr;
+		int fd = -1, nonblock = 1, error = 0;
+
+		dest.sin_addr.s_addr = self->addrs[index];
+		/* skip what failed a moment ago, unless it is due for a probe */
+		if (self->negcache &&
+					hev_socks5_negcache_check (self->negcache, &dest, &error)) {
+			self->connect_error = error;
+			continue;
+		}
+		fd = socket (AF_INET, SOCK_STREAM, 0);
+		if (-1 == fd)
+		  continue;
+		ioctl (fd, FIONBIO, (char *) &nonblock);
+		/* same tuning profile on both sides of the session */
+		hev_socks5_tuning_apply (self->tuning, fd);
+		hev_socks5_busypoll_apply (fd);
+		/* bind to a source address from the egress pool */
+		attempt->egress_index = -1;
+		if (self->egress)
+		  attempt->egress_index = hev_socks5_egress_bind (self->egress, fd, &dest);
+		if ((0 > connect (fd, (struct sockaddr *) &dest, sizeof (dest))) &&
+					(EINPROGRESS != errno)) {
+			error = errno;
+			if (self->egress) {
+				hev_socks5_egress_report_error (self->egress, attempt->egress_index, error);
+				hev_socks5_egress_release (self->egress, attempt->egress_index, &dest);
+			}
+			close (fd);
+			session_attempt_failed (self, index, error);
+			continue;
+		}
+		/* add fd to source, EPOLLOUT reports the connect result */
+		attempt->fd = fd;
+		if (self->source)
+		  attempt->source_fd = hev_event_source_add_fd (self->source, fd,
+					  EPOLLIN | EPOLLOUT | EPOLLET);
+		self->attempts_pending ++;
+		return true;
+	}
+
+	return 0 < self->attempts_pending;
+}
+
+static void
+session_race_timer_update (HevSocks5Session *self)
+{
+	struct itimerspec spec;
+
+	/* (re)started with every attempt while addresses are left to try */
+	if ((self->addr_next < self->addr_count) && self->source) {
+		if (-1 == self->race_tfd) {
+			self->race_tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+			if (0 > self->race_tfd)
+			  return;
+			hev_event_source_add_fd (self->source, self->race_tfd, EPOLLIN | EPOLLET);
+		}
+		spec.it_interval.tv_sec = self->stagger / 1000;
+		spec.it_interval.tv_nsec = (self->stagger % 1000) * 1000000;
+		spec.it_value = spec.it_interval;
+		if (0 == self->stagger)
+		  spec.it_value.tv_nsec = 1;
+		timerfd_settime (self->race_tfd, 0, &spec, NULL);
+		return;
+	}
+	if (-1 < self->race_tfd) {
+		hev_event_source_del_fd (self->source, self->race_tfd);
+		close (self->race_tfd);
+		self->race_tfd = -1;
+	}
+}
+
+static void
+session_race_win (HevSocks5Session *self, unsigned int index)
+{
+	HevSocks5SessionAttempt *attempt = &self->attempts[index];
+	unsigned int i = 0;
+
+	self->rfd = attempt->fd;
+	self->remote_fd = attempt->source_fd;
+	self->remote_events = EPOLLIN | EPOLLOUT | EPOLLET;
+	self->egress_index = attempt->egress_index;
+	self->addr.sin_addr.s_addr = self->addrs[index];
+	attempt->fd = -1;
+	self->attempts_pending --;
+	if (self->negcache)
+	  hev_socks5_negcache_success (self->negcache, &self->addr);
+
+	/* the first socket through wins, the rest are dropped */
+	for (i=0; i<self->addr_next; i++) {
+		if (-1 < self->attempts[i].fd)
+		  session_attempt_close (self, i);
+	}
+	self->addr_next = self->addr_count;
+	session_race_timer_update (self);
+}
+
+/* 1 when fd won the race, 0 when handled, -1 when every attempt failed */
+static int
+session_race_event (HevSocks5Session *self, HevEventSourceFD *fd)
+{
+	socklen_t len = sizeof (int);
+	unsigned int i = 0;
+	int error = 0;
+
+	if (fd->fd == self->race_tfd) {
+		uint64_t expirations = 0;
+
+		fd->revents = 0;
+		read (self->race_tfd, &expirations, sizeof (expirations));
+		if (!session_connect_next (self))
+		  return -1;
+		session_race_timer_update (self);
+		return 0;
+	}
+
+	for (i=0; i<self->addr_next; i++) {
+		if (fd->fd == self->attempts[i].fd)
+		  break;
+	}
+	if (i == self->addr_next) {
+		fd->revents = 0;
+		return 0;
+	}
+	if (!((EPOLLERR | EPOLLHUP | EPOLLOUT) & fd->revents)) {
+		fd->revents = 0;
+		return 0;
+	}
+	getsockopt (fd->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+	if (!((EPOLLERR | EPOLLHUP) & fd->revents) && (0 == error)) {
+		session_race_win (self, i);
+		return 1;
+	}
+
+	/* this address is down, try the next one without waiting */
+	fd->revents = 0;
+	session_attempt_failed (self, i, error ? error : ECONNRESET);
+	session_attempt_close (self, i);
+	if (!session_connect_next (self))
+	  return -1;
+	session_race_timer_update (self);
+
+	return 0;
+}
+
+static inline bool
+socks5_do_socket_connect (HevSocks5Session *self)
+{
+	/* a literal address is a race of one */
+	if (0 == self->addr_count) {
+		self->addrs[0] = self->addr.sin_addr.s_addr;
+		self->addr_count = 1;
+	}
+	/* rank attempts too, a failing destination is a hitter as well */
+	if (self->hitters) {
+		hev_socks5_hitters_add_connect (self->hitters, &self->peer, &self->addr);
+		self->hitters_bytes = self->forward_bytes + self->backward_bytes;
+	}
+	/* routed through the parent, the stream is there before the open
+	 * reached it; a refusal there shows up as a reset */
+	if (self->parent && hev_socks5_tunnel_route (self->parent, &self->addr)) {
+		self->rfd = hev_socks5_tunnel_open (self->parent, &self->addr);
+		if (0 > self->rfd) {
+			self->connect_error = ENETUNREACH;
+			session_connect_failed (self);
 			return false;
 		}
-	} else {
-		socks5_write_response_addr (self);
-		self->step = STEP_WRITE_RESPONSE;
+		/* no TCP socket to hand to the kernel relay */
+		self->tunnelled = true;
+		if (self->sockmap) {
+			hev_socks5_sockmap_unref (self->sockmap);
+			self->sockmap = NULL;
+		}
+		self->remote_events = EPOLLIN | EPOLLOUT | EPOLLET;
+		self->remote_fd = hev_event_source_add_fd (self->source, self->rfd,
+					self->remote_events);
+		self->revents |= REMOTE_OUT;
+		self->step = STEP_WAIT_SOCKET_CONNECT;
+		return false;
+	}
+	/* connect to the remote host, racing staggered attempts across
+	 * every resolved address */
+	self->addr_next = 0;
+	self->attempts_pending = 0;
+	if (!session_connect_next (self)) {
+		session_connect_failed (self);
 		return false;
 	}
+	session_race_timer_update (self);
+	self->step = STEP_WAIT_SOCKET_CONNECT;
+	/* reply now, what the client sends meanwhile waits in the forward
+	 * buffer until the connect is through */
+	if (self->early_reply && !self->replied) {
+		socks5_write_response_addr (self);
+		self->replied = true;
+	}
 
 	return true;
 }
@@ -556,7 +1591,10 @@ socks5_wait_socket_connect (HevSocks5Session *self)
 {
 	if (!(REMOTE_OUT & self->revents))
 	  return true;
-	socks5_write_response_addr (self);
+	if (!self->replied) {
+		socks5_write_response_addr (self);
+		self->replied = true;
+	}
 	self->step = STEP_WRITE_RESPONSE;
 
 	return false;
@@ -576,11 +1614,49 @@ socks5_write_response (HevSocks5Session *self)
 	return false;
 }
 
+static void
+session_direct_attach (HevSocks5Session *self)
+{
+	HevEventSourceFD *fds = self->direct_fds;
+
+	/* session owned stand-ins keep the read/write paths unchanged */
+	memset (fds, 0, sizeof (self->direct_fds));
+	fds[0].fd = self->cfd;
+	fds[0].events = self->client_events;
+	fds[0].revents = self->client_fd->revents;
+	fds[1].fd = self->rfd;
+	fds[1].events = self->remote_events;
+	fds[1].revents = self->remote_fd->revents;
+	hev_event_source_del_fd (self->source, self->cfd);
+	hev_event_source_del_fd (self->source, self->rfd);
+	self->client_fd = &fds[0];
+	self->remote_fd = &fds[1];
+
+	/* an edge triggered add reports whatever is already pending */
+	hev_socks5_dispatch_add (self->dispatch, self->cfd, self->client_events, self);
+	hev_socks5_dispatch_add (self->dispatch, self->rfd, self->remote_events,
+				(void *) ((uintptr_t) self | DIRECT_REMOTE));
+	self->direct = true;
+}
+
 static inline bool
 socks5_do_splice (HevSocks5Session *self)
 {
 	/* clear socks5 request in forward buffer */
 	hev_ring_buffer_read_finish (self->forward_buffer, self->roffset);
+	self->splice_time = hev_socks5_stats_clock ();
+	/* the class is settled once the destination is known */
+	if (self->classes) {
+		self->next_class = hev_socks5_classes_match_dest (self->classes,
+					&self->addr, self->next_class);
+		hev_socks5_classes_relay (self->classes, self->source, self->class,
+					self->next_class);
+		self->class = self->next_class;
+	}
+	/* relay fds leave the session source for the direct dispatch, which
+	 * runs at one priority, so only default class relays go there */
+	if (self->dispatch && (HEV_SOCKS5_CLASS_DEFAULT == self->class))
+	  session_direct_attach (self);
 	/* switch to splice source handler */
 	hev_event_source_set_callback (self->source,
 				(HevEventSourceFunc) session_source_splice_handler, self, NULL);
@@ -606,6 +1682,29 @@ socks5_close_session (HevSocks5Session *self)
 {
 }
 
+static unsigned int
+session_phase (HevSocks5Session *self)
+{
+	switch (self->step) {
+	case STEP_NULL:
+	case STEP_TLS_HANDSHAKE:
+	case STEP_READ_AUTH_METHOD:
+	case STEP_WRITE_AUTH_METHOD:
+	case STEP_READ_AUTH_USERPASS:
+	case STEP_WRITE_AUTH_USERPASS:
+		return PHASE_AUTH;
+	case STEP_WAIT_DNS_RESOLV:
+		return PHASE_DNS;
+	case STEP_DO_SOCKET_CONNECT:
+	case STEP_WAIT_SOCKET_CONNECT:
+		return PHASE_CONNECT;
+	case STEP_DO_SPLICE:
+		return PHASE_RELAY;
+	default:
+		return PHASE_REQUEST;
+	}
+}
+
 static int
 handle_socks5 (HevSocks5Session *self)
 {
@@ -620,9 +1719,18 @@ handle_socks5 (HevSocks5Session *self)
 	case STEP_WRITE_AUTH_METHOD:
 		wait = socks5_write_auth_method (self);
 		break;
+	case STEP_READ_AUTH_USERPASS:
+		wait = socks5_read_auth_userpass (self);
+		break;
+	case STEP_WRITE_AUTH_USERPASS:
+		wait = socks5_write_auth_userpass (self);
+		break;
 	case STEP_READ_REQUEST:
 		wait = socks5_read_request (self);
 		break;
+	case STEP_DO_FORWARD:
+		wait = socks5_do_forward (self);
+		break;
 	case STEP_DO_CONNECT:
 		wait = socks5_do_connect (self);
 		break;
@@ -659,12 +1767,367 @@ handle_socks5 (HevSocks5Session *self)
 	return wait ? 1 : 0;
 }
 
+/* counts each time a side goes from reading to held back */
 static bool
-session_source_socks5_handler (HevEventSourceFD *fd, void *data)
+session_budget_throttle (HevSocks5Session *self, HevRingBuffer *buffer,
+			unsigned int side)
+{
+	if (!session_budget_hold (buffer)) {
+		self->throttled &= ~side;
+		return false;
+	}
+	if (!(side & self->throttled)) {
+		self->throttled |= side;
+		hev_socks5_budget.throttles ++;
+	}
+
+	return true;
+}
+
+static bool
+session_splice (HevSocks5Session *self)
+{
+	/* read first so that whatever arrived is flushed in the same pass; a
+	 * held back side forgets its edge, the re-arm reports it again */
+	if (CLIENT_IN & self->revents) {
+		if (session_budget_throttle (self, self->forward_buffer, CLIENT_IN)) {
+			self->revents &= ~CLIENT_IN;
+			self->client_fd->revents &= ~EPOLLIN;
+		} else if (!client_read (self)) {
+			return false;
+		}
+	}
+	if (REMOTE_IN & self->revents) {
+		if (session_budget_throttle (self, self->backward_buffer, REMOTE_IN)) {
+			self->revents &= ~REMOTE_IN;
+			self->remote_fd->revents &= ~EPOLLIN;
+		} else if (!remote_read (self)) {
+			return false;
+		}
+	}
+	if (CLIENT_OUT & self->revents) {
+		if (!client_write (self))
+		  return false;
+	}
+	if (REMOTE_OUT & self->revents) {
+		if (!remote_write (self))
+		  return false;
+	}
+
+	return true;
+}
+
+static void
+session_sockmap_attach (HevSocks5Session *self, uint64_t now)
+{
+	struct iovec iovec[2];
+
+	/* hand over only when nothing is queued in user space, so the kernel
+	 * relay can't overtake buffered bytes */
+	if ((CLIENT_IN | REMOTE_IN) & self->revents)
+	  return;
+	if ((0 != hev_ring_buffer_reading (self->forward_buffer, iovec)) ||
+				(0 != hev_ring_buffer_reading (self->backward_buffer, iovec)))
+	  return;
+	if (now < self->sockmap_retry)
+	  return;
+	self->sockmap_slot = hev_socks5_sockmap_attach (self->sockmap, self->cfd, self->rfd);
+	if (-1 < self->sockmap_slot) {
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_SOCKMAP_SESSIONS, 1);
+		return;
+	}
+	if (ENOSPC == errno) {
+		/* a slot may free up later, but don't ask on every wakeup */
+		self->sockmap_retry = now + SOCKMAP_RETRY * 1000000ULL;
+		return;
+	}
+	/* the pair doesn't qualify, stay in user space for good */
+	hev_socks5_sockmap_unref (self->sockmap);
+	self->sockmap = NULL;
+}
+
+static bool
+session_sockmap_refresh (HevSocks5Session *self)
+{
+	uint64_t forward = 0, backward = 0, delta = 0;
+
+	/* the map counters only grow, fold the deltas into the session */
+	hev_socks5_sockmap_get_bytes (self->sockmap, self->sockmap_slot, &forward, &backward);
+	delta = (forward - self->sockmap_forward) + (backward - self->sockmap_backward);
+	self->forward_bytes += forward - self->sockmap_forward;
+	self->backward_bytes += backward - self->sockmap_backward;
+	self->sockmap_forward = forward;
+	self->sockmap_backward = backward;
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_RELAY_BYTES, delta);
+
+	return 0 < delta;
+}
+
+static void
+session_sockmap_detach (HevSocks5Session *self)
+{
+	if (0 > self->sockmap_slot)
+	  return;
+	session_sockmap_refresh (self);
+	hev_socks5_sockmap_detach (self->sockmap, self->sockmap_slot);
+	self->sockmap_slot = -1;
+}
+
+static bool
+session_sockmap_drain (HevSocks5Session *self)
+{
+	struct itimerspec spec;
+
+	/* one side is done, but bytes the kernel already redirected may still
+	 * be queued toward the other, so close only once they are acked */
+	if ((0 > self->sockmap_slot) || !self->eof || (-1 < self->tfd))
+	  return false;
+	self->tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (0 > self->tfd)
+	  return false;
+	spec.it_interval.tv_sec = 0;
+	spec.it_interval.tv_nsec = DRAIN_INTERVAL * 1000000;
+	spec.it_value = spec.it_interval;
+	timerfd_settime (self->tfd, 0, &spec, NULL);
+	hev_event_source_add_fd (self->source, self->tfd, EPOLLIN | EPOLLET);
+
+	return true;
+}
+
+static bool
+session_sockmap_drained (HevSocks5Session *self)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof (info);
+	uint64_t expirations = 0, sent = 0;
+	int fd = -1;
+
+	while (0 < read (self->tfd, &expirations, sizeof (expirations)))
+	  self->drain_ticks ++;
+	if (DRAIN_TICKS < self->drain_ticks)
+	  return true;
+
+	session_sockmap_refresh (self);
+	if (CLIENT_IN == self->eof) {
+		fd = self->rfd;
+		sent = self->remote_sent + self->sockmap_forward;
+	} else {
+		fd = self->cfd;
+		sent = self->client_sent + self->sockmap_backward;
+	}
+	if (0 > getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+	  return true;
+
+	return sent <= info.tcpi_bytes_acked;
+}
+
+static void
+session_close (HevSocks5Session *self)
+{
+	/* a socketpair can't carry the reset of a tunnel stream, its end
+	 * looks like an orderly one */
+	if (self->tunnelled && hev_socks5_tunnel_take_reset (self->parent, self->rfd))
+	  self->remote_reset = true;
+
+	if (self->remote_reset)
+	  self->close_reason = HEV_SOCKS5_SESSION_CLOSE_ERROR;
+	else if (CLIENT_IN == self->eof)
+	  self->close_reason = HEV_SOCKS5_SESSION_CLOSE_CLIENT;
+	else if (REMOTE_IN == self->eof)
+	  self->close_reason = HEV_SOCKS5_SESSION_CLOSE_REMOTE;
+	else if (STEP_DO_SPLICE != self->step)
+	  self->close_reason = HEV_SOCKS5_SESSION_CLOSE_HANDSHAKE;
+	else
+	  self->close_reason = HEV_SOCKS5_SESSION_CLOSE_ERROR;
+
+	if (self->notify)
+	  self->notify (self, self->notify_data);
+}
+
+static void
+session_hitters_report (HevSocks5Session *self)
+{
+	uint64_t bytes = self->forward_bytes + self->backward_bytes;
+
+	/* relay bytes since the last report, nothing before the connect */
+	if ((0 > self->rfd) || (bytes == self->hitters_bytes))
+	  return;
+	hev_socks5_hitters_add_bytes (self->hitters, &self->peer, &self->addr,
+				bytes - self->hitters_bytes);
+	self->hitters_bytes = bytes;
+}
+
+static void
+session_log (HevSocks5Session *self)
+{
+	HevSocks5AccessLogRecord record;
+	struct timespec ts;
+	uint64_t now = hev_socks5_stats_clock ();
+
+	if (self->sockmap)
+	  session_sockmap_detach (self);
+
+	memset (&record, 0, sizeof (record));
+	clock_gettime (CLOCK_REALTIME, &ts);
+	record.time = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	record.duration = now - self->start_time;
+	if (self->splice_time)
+	  record.handshake = self->splice_time - self->start_time;
+	record.forward_bytes = self->forward_bytes;
+	record.backward_bytes = self->backward_bytes;
+	record.client_addr = self->peer.sin_addr.s_addr;
+	record.client_port = self->peer.sin_port;
+	if (-1 < self->rfd) {
+		record.remote_addr = self->addr.sin_addr.s_addr;
+		record.remote_port = self->addr.sin_port;
+	}
+	record.reason = self->close_reason;
+	hev_socks5_accesslog_push (self->accesslog, &record);
+}
+
+static unsigned int interest_linger = INTEREST_LINGER;
+
+/* a needed bit goes in at once, or the side stalls. EPOLLOUT that is
+ * no longer needed stays until a few updates went by without it, a bulk
+ * write flips between blocked and drained on nearly every pass and an
+ * idle edge costs nothing. EPOLLIN goes at once, its re-add is the edge
+ * that reports data left behind while the ring was full */
+static uint32_t
+session_interest_settle (uint32_t events, uint32_t current, uint8_t *linger)
+{
+	uint32_t dropped = current & ~events & EPOLLOUT;
+
+	if (!dropped || (interest_linger <= ++ *linger)) {
+		*linger = 0;
+		return events;
+	}
+
+	return events | dropped;
+}
+
+static void
+session_update_interest (HevSocks5Session *self)
+{
+	struct iovec iovec[2];
+	uint32_t events = 0;
+	uint64_t held = 0;
+	bool relay = STEP_DO_SPLICE == self->step;
+
+	held = ring_used (self->forward_buffer) + ring_used (self->backward_buffer);
+	hev_socks5_budget_adjust ((int64_t) held - (int64_t) self->budget_held);
+	self->budget_held = held;
+
+	/* EPOLLIN only while the buffer we read into has room, EPOLLOUT only
+	 * while a write is blocked on pending data */
+	events = EPOLLET;
+	if (0 == hev_ring_buffer_writing (self->forward_buffer, iovec))
+	  self->ring_full ++;
+	else if (!relay || !session_budget_hold (self->forward_buffer))
+	  events |= EPOLLIN;
+	if (!(CLIENT_OUT & self->revents))
+	  events |= EPOLLOUT;
+	/* a side let go of its hold needs a fresh edge for what is pending */
+	if ((EPOLLIN & events) && (CLIENT_IN & self->throttled)) {
+		self->throttled &= ~CLIENT_IN;
+		self->client_events = 0;
+	}
+	events = session_interest_settle (events, self->client_events, &self->client_linger);
+	if (events != self->client_events) {
+		if (self->direct) {
+			hev_socks5_dispatch_mod (self->dispatch, self->cfd, events, self);
+		} else {
+			hev_event_source_del_fd (self->source, self->cfd);
+			self->client_fd = hev_event_source_add_fd (self->source, self->cfd, events);
+		}
+		self->client_events = events;
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_INTEREST_CHANGES, 1);
+	}
+
+	if (!self->remote_fd)
+	  return;
+	events = EPOLLET;
+	if (0 == hev_ring_buffer_writing (self->backward_buffer, iovec))
+	  self->ring_full ++;
+	else if (!relay || !session_budget_hold (self->backward_buffer))
+	  events |= EPOLLIN;
+	if (!(REMOTE_OUT & self->revents))
+	  events |= EPOLLOUT;
+	if ((EPOLLIN & events) && (REMOTE_IN & self->throttled)) {
+		self->throttled &= ~REMOTE_IN;
+		self->remote_events = 0;
+	}
+	events = session_interest_settle (events, self->remote_events, &self->remote_linger);
+	if (events != self->remote_events) {
+		if (self->direct) {
+			hev_socks5_dispatch_mod (self->dispatch, self->rfd, events,
+						(void *) ((uintptr_t) self | DIRECT_REMOTE));
+		} else {
+			hev_event_source_del_fd (self->source, self->rfd);
+			self->remote_fd = hev_event_source_add_fd (self->source, self->rfd, events);
+		}
+		self->remote_events = events;
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_INTEREST_CHANGES, 1);
+	}
+}
+
+static bool
+session_tls_handshake (HevSocks5Session *self, HevEventSourceFD *fd)
+{
+	uint32_t events = 0;
+	int res = 0;
+
+	fd->revents = 0;
+	res = hev_socks5_tls_handshake (self->tls_conn, &events);
+	if (0 > res)
+	  return false;
+	if (0 == res) {
+		events |= EPOLLET;
+		if (events != self->client_events) {
+			hev_event_source_del_fd (self->source, self->cfd);
+			self->client_fd = hev_event_source_add_fd (self->source, self->cfd, events);
+			self->client_events = events;
+		}
+		return true;
+	}
+
+	/* plaintext from here on, the kernel owns the record layer */
+	hev_socks5_tls_conn_free (self->tls_conn);
+	self->tls_conn = NULL;
+	self->step = self->forward_host ? STEP_DO_FORWARD : STEP_READ_AUTH_METHOD;
+
+	return true;
+}
+
+static bool
+session_socks5_handle (HevEventSourceFD *fd, void *data)
 {
 	HevSocks5Session *self = data;
 	int wait = -1;
 
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_WAKEUPS, 1);
+	hev_socks5_busypoll_kick ();
+
+	if (STEP_TLS_HANDSHAKE == self->step) {
+		if (!session_tls_handshake (self, fd))
+		  goto close_session;
+		if (STEP_TLS_HANDSHAKE == self->step)
+		  return true;
+		/* the request may have come in with the last handshake flight */
+		fd->revents |= EPOLLIN;
+	}
+
+	/* a failed attempt must not take the session down with it */
+	if ((STEP_WAIT_SOCKET_CONNECT == self->step) && (fd != self->client_fd)) {
+		int res = session_race_event (self, fd);
+		if (0 == res)
+		  return true;
+		/* fd may be gone, only the reply is left to flush */
+		if (-1 == res) {
+			session_connect_failed (self);
+			goto process;
+		}
+	}
+
 	if ((EPOLLERR | EPOLLHUP) & fd->revents)
 	  goto close_session;
 
@@ -683,6 +2146,7 @@ session_source_socks5_handler (HevEventSourceFD *fd, void *data)
 		  self->revents |= DNSRSV_IN;
 	}
 
+process:
 	do {
 		if (CLIENT_OUT & self->revents) {
 			if (!client_write (self))
@@ -699,22 +2163,79 @@ session_source_socks5_handler (HevEventSourceFD *fd, void *data)
 		  goto close_session;
 	} while (0 == wait);
 
+	/* each handshake phase gets its own deadline */
+	if (self->deadlines && (self->phase != session_phase (self))) {
+		self->phase = session_phase (self);
+		self->phase_time = hev_socks5_stats_clock ();
+	}
+
+	/* relay data the client sent ahead of the reply */
+	if (STEP_DO_SPLICE == self->step) {
+		if (!session_splice (self))
+		  goto close_session;
+	}
+
 	self->idle = false;
+	self->active_time = hev_socks5_stats_clock ();
+	session_update_interest (self);
 
 	return true;
 
 close_session:
-	if (self->notify)
-	  self->notify (self, self->notify_data);
+	session_close (self);
 
 	return true;
 }
 
 static bool
-session_source_splice_handler (HevEventSourceFD *fd, void *data)
+session_source_socks5_handler (HevEventSourceFD *fd, void *data)
+{
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	bool res = session_socks5_handle (fd, data);
+
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_SESSION, mon);
+
+	return res;
+}
+
+/* false once the session has been handed back to be freed */
+static bool
+session_relay (HevSocks5Session *self, HevEventSourceFD *fd)
+{
+	if (-1 < self->tfd) {
+		/* draining, the timer decides when to close */
+		fd->revents = 0;
+		return true;
+	}
+	if (!session_splice (self)) {
+		if (!session_sockmap_drain (self)) {
+			session_close (self);
+			return false;
+		}
+		fd->revents = 0;
+		return true;
+	}
+	self->active_time = hev_socks5_stats_clock ();
+	/* the verdict program can't sit on top of the kernel TLS record layer */
+	if (self->sockmap && !self->tls && (0 > self->sockmap_slot))
+	  session_sockmap_attach (self, self->active_time);
+	if (self->hitters)
+	  session_hitters_report (self);
+
+	self->idle = false;
+	session_update_interest (self);
+
+	return true;
+}
+
+static bool
+session_splice_handle (HevEventSourceFD *fd, void *data)
 {
 	HevSocks5Session *self = data;
 
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_WAKEUPS, 1);
+	hev_socks5_busypoll_kick ();
+
 	if ((EPOLLERR | EPOLLHUP) & fd->revents)
 	  goto close_session;
 
@@ -723,38 +2244,260 @@ session_source_splice_handler (HevEventSourceFD *fd, void *data)
 		  self->revents |= CLIENT_IN;
 		if (EPOLLOUT & fd->revents)
 		  self->revents |= CLIENT_OUT;
-	} else {
+	} else if (fd == self->remote_fd) {
 		if (EPOLLIN & fd->revents)
 		  self->revents |= REMOTE_IN;
 		if (EPOLLOUT & fd->revents)
 		  self->revents |= REMOTE_OUT;
+	} else {
+		fd->revents = 0;
+		if (session_sockmap_drained (self))
+		  goto close_session;
+		return true;
 	}
 
-	if (CLIENT_OUT & self->revents) {
-		if (!client_write (self))
-		  goto close_session;
+	session_relay (self, fd);
+
+	return true;
+
+close_session:
+	session_close (self);
+
+	return true;
+}
+
+static bool
+session_source_splice_handler (HevEventSourceFD *fd, void *data)
+{
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	bool res = session_splice_handle (fd, data);
+
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_RELAY, mon);
+
+	return res;
+}
+
+void
+hev_socks5_session_dispatch (void *data, uint32_t events)
+{
+	HevSocks5Session *self = (HevSocks5Session *) ((uintptr_t) data & ~DIRECT_REMOTE);
+	HevEventSourceFD *fd = NULL;
+	uint8_t in = 0, out = 0;
+
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_WAKEUPS, 1);
+
+	if ((EPOLLERR | EPOLLHUP) & events) {
+		session_close (self);
+		return;
 	}
-	if (REMOTE_OUT & self->revents) {
-		if (!remote_write (self))
-		  goto close_session;
+
+	if (DIRECT_REMOTE & (uintptr_t) data) {
+		fd = self->remote_fd;
+		in = REMOTE_IN;
+		out = REMOTE_OUT;
+	} else {
+		fd = self->client_fd;
+		in = CLIENT_IN;
+		out = CLIENT_OUT;
 	}
-	if (CLIENT_IN & self->revents) {
-		if (!client_read (self))
-		  goto close_session;
+	fd->revents |= events;
+
+	/* edge triggered, run until the fd has nothing left like the
+	 * loop's redispatch would, or a pass moves nothing */
+	for (;;) {
+		uint64_t moved = self->forward_bytes + self->backward_bytes +
+			self->client_sent + self->remote_sent;
+
+		if (EPOLLIN & fd->revents)
+		  self->revents |= in;
+		if (EPOLLOUT & fd->revents)
+		  self->revents |= out;
+		if (!session_relay (self, fd) || !fd->revents)
+		  break;
+		if (moved == (self->forward_bytes + self->backward_bytes +
+						self->client_sent + self->remote_sent))
+		  break;
 	}
-	if (REMOTE_IN & self->revents) {
-		if (!remote_read (self))
-		  goto close_session;
+}
+
+static size_t
+ring_copy (HevRingBuffer *buffer, uint8_t *data)
+{
+	struct iovec iovec[2];
+	size_t i = 0, iovec_len = 0, size = 0;
+
+	iovec_len = hev_ring_buffer_reading (buffer, iovec);
+	for (i=0; i<iovec_len; i++) {
+		memcpy (data + size, iovec[i].iov_base, iovec[i].iov_len);
+		size += iovec[i].iov_len;
 	}
 
-	self->idle = false;
+	return size;
+}
+
+static void
+ring_fill (HevRingBuffer *buffer, const uint8_t *data, size_t len)
+{
+	struct iovec iovec[2];
+	size_t i = 0, iovec_len = 0, size = 0;
+
+	iovec_len = hev_ring_buffer_writing (buffer, iovec);
+	for (i=0; (i<iovec_len) && (size<len); i++) {
+		size_t part = (iovec[i].iov_len < (len - size)) ? iovec[i].iov_len : (len - size);
+		memcpy (iovec[i].iov_base, data + size, part);
+		size += part;
+	}
+	hev_ring_buffer_write_finish (buffer, size);
+}
+
+/* only a plain relay is nothing but two sockets and its buffers, a
+ * tunnelled one also needs the stream in this process */
+static bool
+session_movable (HevSocks5Session *self)
+{
+	return (STEP_DO_SPLICE == self->step) && !self->eof && (0 > self->tfd) &&
+		!self->tls && (0 > self->sockmap_slot) && !self->tunnelled;
+}
+
+bool
+hev_socks5_session_freeze (HevSocks5Session *self)
+{
+	if (!session_movable (self))
+	  return false;
+	/* the nested epoll would still run it */
+	if (self->direct) {
+		hev_socks5_dispatch_del (self->dispatch, self->cfd, self);
+		hev_socks5_dispatch_del (self->dispatch, self->rfd,
+					(void *) ((uintptr_t) self | DIRECT_REMOTE));
+	}
 
 	return true;
+}
 
-close_session:
-	if (self->notify)
-	  self->notify (self, self->notify_data);
+void
+hev_socks5_session_thaw (HevSocks5Session *self)
+{
+	/* an edge triggered add reports whatever arrived meanwhile */
+	if (self->direct) {
+		hev_socks5_dispatch_add (self->dispatch, self->cfd, self->client_events, self);
+		hev_socks5_dispatch_add (self->dispatch, self->rfd, self->remote_events,
+					(void *) ((uintptr_t) self | DIRECT_REMOTE));
+	}
+}
+
+ssize_t
+hev_socks5_session_export (HevSocks5Session *self, void *buf, size_t len, int *fds)
+{
+	HevSocks5SessionState *state = buf;
+	uint8_t *data = (uint8_t *) (state + 1);
+	uint64_t now = hev_socks5_stats_clock ();
+
+	if (!session_movable (self))
+	  return -1;
+	if (len < (sizeof (HevSocks5SessionState) + 2 * RING_SIZE))
+	  return -1;
+
+	session_load_peer (self);
+	memset (state, 0, sizeof (HevSocks5SessionState));
+	state->addr = self->addr;
+	state->peer = self->peer;
+	state->forward_bytes = self->forward_bytes;
+	state->backward_bytes = self->backward_bytes;
+	state->age = now - self->start_time;
+	state->handshake = self->splice_time - self->start_time;
+	/* the pool usage moves along with the connection */
+	state->egress_index = self->egress_index;
+	if (-1 < self->egress_index) {
+		struct sockaddr_in local;
+		socklen_t local_len = sizeof (local);
+
+		if (0 > getsockname (self->rfd, (struct sockaddr *) &local, &local_len))
+		  state->egress_index = -1;
+		else
+		  state->egress_source = local.sin_addr;
+	}
+	state->forward_len = ring_copy (self->forward_buffer, data);
+	state->backward_len = ring_copy (self->backward_buffer, data + state->forward_len);
+	fds[0] = self->cfd;
+	fds[1] = self->rfd;
+
+	return sizeof (HevSocks5SessionState) + state->forward_len + state->backward_len;
+}
+
+bool
+hev_socks5_session_import (HevSocks5Session *self, int remote_fd,
+			const void *buf, size_t len)
+{
+	const HevSocks5SessionState *state = buf;
+	const uint8_t *data = (const uint8_t *) (state + 1);
+	uint64_t now = hev_socks5_stats_clock ();
+
+	if ((sizeof (HevSocks5SessionState) > len) ||
+				(RING_SIZE < state->forward_len) || (RING_SIZE < state->backward_len) ||
+				(len != (sizeof (HevSocks5SessionState) +
+						 state->forward_len + state->backward_len)))
+	  return false;
+	if (!hev_socks5_session_get_source (self))
+	  return false;
+
+	self->rfd = remote_fd;
+	self->addr = state->addr;
+	self->peer = state->peer;
+	self->peer_loaded = true;
+	self->forward_bytes = state->forward_bytes;
+	self->backward_bytes = state->backward_bytes;
+	/* the old process already reported these */
+	self->hitters_bytes = self->forward_bytes + self->backward_bytes;
+	self->start_time = now - state->age;
+	self->active_time = now;
+	self->splice_time = self->start_time + state->handshake;
+	if (self->egress && (-1 < state->egress_index))
+	  self->egress_index = hev_socks5_egress_adopt (self->egress, state->egress_index,
+				  &state->egress_source, &self->addr);
+	self->phase = PHASE_RELAY;
+	self->phase_time = now;
+	ring_fill (self->forward_buffer, data, state->forward_len);
+	ring_fill (self->backward_buffer, data + state->forward_len, state->backward_len);
+
+	/* writable until a write says otherwise, the remote EPOLLOUT edge
+	 * runs the first pass, which flushes whatever was carried over */
+	self->step = STEP_DO_SPLICE;
+	self->revents = CLIENT_OUT | REMOTE_OUT;
+	self->remote_events = EPOLLIN | EPOLLOUT | EPOLLET;
+	self->remote_fd = hev_event_source_add_fd (self->source, self->rfd,
+				self->remote_events);
+	if (self->dispatch && (HEV_SOCKS5_CLASS_DEFAULT == self->class))
+	  session_direct_attach (self);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) session_source_splice_handler, self, NULL);
 
 	return true;
 }
 
+
+void
+hev_socks5_session_inspect (HevSocks5Session *self, HevSocks5SessionInfo *info,
+			uint64_t now)
+{
+	if ((-1 < self->sockmap_slot) && session_sockmap_refresh (self))
+	  self->active_time = now;
+	session_load_peer (self);
+
+	info->id = self->id;
+	info->step = step_names[self->step];
+	info->class = hev_socks5_class_name (self->class);
+	info->peer = self->peer;
+	/* the destination is known once a connect started */
+	if (STEP_DO_SOCKET_CONNECT <= self->step)
+	  info->addr = self->addr;
+	else
+	  memset (&info->addr, 0, sizeof (info->addr));
+	info->age = now - self->start_time;
+	info->idle = (now > self->active_time) ? now - self->active_time : 0;
+	info->forward_bytes = self->forward_bytes;
+	info->backward_bytes = self->backward_bytes;
+	info->forward_fill = ring_used (self->forward_buffer);
+	info->backward_fill = ring_used (self->backward_buffer);
+	info->ring_size = RING_SIZE;
+}
+
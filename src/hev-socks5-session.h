@@ -10,11 +10,75 @@
 #ifndef __HEV_SOCKS5_SESSION_H__
 #define __HEV_SOCKS5_SESSION_H__
 
+#include <sys/types.h>
+#include <netinet/in.h>
 #include <hev-lib.h>
 
+#include "hev-socks5-auth.h"
+#include "hev-socks5-hosts.h"
+#include "hev-socks5-egress.h"
+#include "hev-socks5-tuning.h"
+#include "hev-socks5-sockmap.h"
+#include "hev-socks5-accesslog.h"
+#include "hev-socks5-hitters.h"
+#include "hev-socks5-dispatch.h"
+#include "hev-socks5-tls.h"
+#include "hev-socks5-flows.h"
+#include "hev-socks5-negcache.h"
+#include "hev-socks5-tunnel.h"
+#include "hev-socks5-classes.h"
+
 typedef struct _HevSocks5Session HevSocks5Session;
+typedef enum _HevSocks5SessionCloseReason HevSocks5SessionCloseReason;
+typedef struct _HevSocks5SessionDeadlines HevSocks5SessionDeadlines;
+typedef struct _HevSocks5SessionInfo HevSocks5SessionInfo;
 typedef void (*HevSocks5SessionCloseNotify) (HevSocks5Session *self, void *data);
 
+enum _HevSocks5SessionCloseReason
+{
+	HEV_SOCKS5_SESSION_CLOSE_CLIENT,	/* client closed */
+	HEV_SOCKS5_SESSION_CLOSE_REMOTE,	/* remote closed */
+	HEV_SOCKS5_SESSION_CLOSE_ERROR,		/* socket error */
+	HEV_SOCKS5_SESSION_CLOSE_HANDSHAKE,	/* socks5 request failed */
+	HEV_SOCKS5_SESSION_CLOSE_IDLE,
+	HEV_SOCKS5_SESSION_CLOSE_SHUTDOWN,
+	HEV_SOCKS5_SESSION_CLOSE_AUTH_TIMEOUT,
+	HEV_SOCKS5_SESSION_CLOSE_REQUEST_TIMEOUT,
+	HEV_SOCKS5_SESSION_CLOSE_DNS_TIMEOUT,
+	HEV_SOCKS5_SESSION_CLOSE_CONNECT_TIMEOUT,
+	HEV_SOCKS5_SESSION_CLOSE_STALL,		/* peer stopped reading */
+	HEV_SOCKS5_SESSION_CLOSE_HANDOFF,	/* moved to a new process */
+	HEV_SOCKS5_SESSION_CLOSE_KILLED,	/* killed over the control socket */
+	HEV_SOCKS5_SESSION_CLOSE_MAX,
+};
+
+/* nanoseconds, 0 disables a deadline */
+struct _HevSocks5SessionDeadlines
+{
+	uint64_t auth;
+	uint64_t request;
+	uint64_t dns;
+	uint64_t connect;
+	uint64_t stall;
+};
+
+/* one session as seen from the control socket, times in ns */
+struct _HevSocks5SessionInfo
+{
+	uint64_t id;
+	const char *step;
+	const char *class;
+	struct sockaddr_in peer;	/* zeroed for unix socket clients */
+	struct sockaddr_in addr;	/* zeroed before the connect */
+	uint64_t age;
+	uint64_t idle;		/* since the last wakeup */
+	uint64_t forward_bytes;
+	uint64_t backward_bytes;
+	size_t forward_fill;
+	size_t backward_fill;
+	size_t ring_size;
+};
+
 HevSocks5Session * hev_socks5_session_new (int client_fd,
 			HevSocks5SessionCloseNotify notify, void *notify_data);
 
@@ -22,9 +86,63 @@ HevSocks5Session * hev_socks5_session_ref (HevSocks5Session *self);
 void hev_socks5_session_unref (HevSocks5Session *self);
 
 HevEventSource * hev_socks5_session_get_source (HevSocks5Session *self);
+void * hev_socks5_session_get_notify_data (HevSocks5Session *self);
+/* unique within the process, never 0 */
+uint64_t hev_socks5_session_get_id (HevSocks5Session *self);
 
 void hev_socks5_session_set_idle (HevSocks5Session *self);
 bool hev_socks5_session_get_idle (HevSocks5Session *self);
 
+void hev_socks5_session_set_connect_stagger (HevSocks5Session *self, unsigned int ms);
+
+void hev_socks5_session_set_deadlines (HevSocks5Session *self,
+			const HevSocks5SessionDeadlines *deadlines);
+bool hev_socks5_session_check_deadline (HevSocks5Session *self, uint64_t now);
+/* TCP_INFO of both sockets into flows, skipped while nothing moved */
+void hev_socks5_session_sample (HevSocks5Session *self, HevSocks5Flows *flows);
+
+void hev_socks5_session_set_auth (HevSocks5Session *self, HevSocks5Auth *auth);
+void hev_socks5_session_set_hosts (HevSocks5Session *self, HevSocks5Hosts *hosts);
+void hev_socks5_session_set_egress (HevSocks5Session *self, HevSocks5Egress *egress);
+void hev_socks5_session_set_tuning (HevSocks5Session *self, const HevSocks5Tuning *tuning);
+void hev_socks5_session_set_sockmap (HevSocks5Session *self, HevSocks5Sockmap *sockmap);
+void hev_socks5_session_set_accesslog (HevSocks5Session *self, HevSocks5AccessLog *accesslog);
+void hev_socks5_session_set_hitters (HevSocks5Session *self, HevSocks5Hitters *hitters);
+void hev_socks5_session_set_dispatch (HevSocks5Session *self, HevSocks5Dispatch *dispatch);
+void hev_socks5_session_set_tls (HevSocks5Session *self, HevSocks5Tls *tls);
+void hev_socks5_session_set_negcache (HevSocks5Session *self, HevSocks5NegCache *negcache);
+/* routed destinations are opened as streams through the parent */
+void hev_socks5_session_set_parent (HevSocks5Session *self, HevSocks5Tunnel *parent);
+/* user and destination rules, resolved when the relay starts */
+void hev_socks5_session_set_classes (HevSocks5Session *self, HevSocks5Classes *classes);
+/* the listener's class, set before the source is made */
+void hev_socks5_session_set_class (HevSocks5Session *self, HevSocks5Class class);
+/* success reply before the connect completes, a failure resets the client */
+void hev_socks5_session_set_early_reply (HevSocks5Session *self, bool enable);
+/* skip the handshake and relay to host, which must outlive the session */
+void hev_socks5_session_set_forward (HevSocks5Session *self, const char *host,
+			unsigned short port);
+
+/* a relaying session as state plus its client and remote fd, -1 while it
+ * can't move; import rebuilds it around a session made from the client fd */
+ssize_t hev_socks5_session_export (HevSocks5Session *self, void *buf, size_t len,
+			int *fds);
+/* holds a relay still while it is exported, the caller takes its source
+ * off the loop; false while it can't move */
+bool hev_socks5_session_freeze (HevSocks5Session *self);
+/* back to relaying once its source is on the loop again */
+void hev_socks5_session_thaw (HevSocks5Session *self);
+bool hev_socks5_session_import (HevSocks5Session *self, int remote_fd,
+			const void *buf, size_t len);
+
+void hev_socks5_session_inspect (HevSocks5Session *self, HevSocks5SessionInfo *info,
+			uint64_t now);
+
+/* HevSocks5DispatchFunc for relay fds handed to the direct dispatch */
+void hev_socks5_session_dispatch (void *data, uint32_t events);
+
+void hev_socks5_session_set_close_reason (HevSocks5Session *self,
+			HevSocks5SessionCloseReason reason);
+
 #endif /* __HEV_SOCKS5_SESSION_H__ */
 
@@ -0,0 +1,399 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-sockmap.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 in-kernel relay via eBPF sockmap
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <hev-lib.h>
+
+#include "hev-socks5-sockmap.h"
+
+#define MAX_SLOTS	16384
+
+#define INSN(c, d, s, o, i)	((struct bpf_insn) { c, d, s, o, i })
+#define MOV64_REG(d, s)		INSN (BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)		INSN (BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)		INSN (BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LDX_W(d, s, o)		INSN (BPF_LDX | BPF_W | BPF_MEM, d, s, o, 0)
+#define STX_W(d, s, o)		INSN (BPF_STX | BPF_W | BPF_MEM, d, s, o, 0)
+#define XADD_DW(d, s, o)	INSN (BPF_STX | BPF_DW | BPF_XADD, d, s, o, 0)
+#define LD_MAP_FD(d, fd)	INSN (BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+				INSN (0, 0, 0, 0, 0)
+#define JEQ_IMM(d, i, o)	INSN (BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define CALL(f)			INSN (BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()			INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define SKB(field)		offsetof (struct __sk_buff, field)
+
+typedef struct _HevSocks5SockmapKey HevSocks5SockmapKey;
+typedef struct _HevSocks5SockmapPeer HevSocks5SockmapPeer;
+typedef struct _HevSocks5SockmapSlot HevSocks5SockmapSlot;
+
+/* matches the __sk_buff fields the verdict program copies to the stack */
+struct _HevSocks5SockmapKey
+{
+	uint32_t remote_ip4;
+	uint32_t local_ip4;
+	uint32_t remote_port;
+	uint32_t local_port;
+};
+
+struct _HevSocks5SockmapPeer
+{
+	uint32_t index;
+	uint32_t pad;
+	uint64_t bytes;
+};
+
+struct _HevSocks5SockmapSlot
+{
+	int next_free;
+	HevSocks5SockmapKey keys[2];
+};
+
+struct _HevSocks5Sockmap
+{
+	unsigned int ref_count;
+	int sock_map;
+	int peer_map;
+	int parser_prog;
+	int verdict_prog;
+	int free_slot;
+	HevSocks5SockmapSlot slots[MAX_SLOTS];
+};
+
+static int
+bpf (int cmd, union bpf_attr *attr)
+{
+	return syscall (__NR_bpf, cmd, attr, sizeof (union bpf_attr));
+}
+
+static int
+bpf_map_create (unsigned int type, unsigned int key_size,
+			unsigned int value_size, unsigned int max_entries)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+
+	return bpf (BPF_MAP_CREATE, &attr);
+}
+
+static int
+bpf_map_update (int map, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (uintptr_t) key;
+	attr.value = (uint64_t) (uintptr_t) value;
+	attr.flags = BPF_ANY;
+
+	return bpf (BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+bpf_map_lookup (int map, const void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (uintptr_t) key;
+	attr.value = (uint64_t) (uintptr_t) value;
+
+	return bpf (BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static int
+bpf_map_delete (int map, const void *key)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (uintptr_t) key;
+
+	return bpf (BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int
+bpf_prog_load (const struct bpf_insn *insns, unsigned int insn_cnt)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uint64_t) (uintptr_t) insns;
+	attr.insn_cnt = insn_cnt;
+	attr.license = (uint64_t) (uintptr_t) "GPL";
+
+	return bpf (BPF_PROG_LOAD, &attr);
+}
+
+static int
+bpf_prog_attach (int prog, int map, unsigned int type)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.target_fd = map;
+	attr.attach_bpf_fd = prog;
+	attr.attach_type = type;
+
+	return bpf (BPF_PROG_ATTACH, &attr);
+}
+
+static bool
+sockmap_load_progs (HevSocks5Sockmap *self)
+{
+	/* every skb is one message */
+	const struct bpf_insn parser[] =
+	{
+		LDX_W (BPF_REG_0, BPF_REG_1, SKB (len)),
+		EXIT (),
+	};
+	/* look up the peer of the receiving socket by its 4-tuple, count the
+	 * bytes and redirect the skb out of the peer socket */
+	const struct bpf_insn verdict[] =
+	{
+		MOV64_REG (BPF_REG_6, BPF_REG_1),
+		LDX_W (BPF_REG_2, BPF_REG_6, SKB (remote_ip4)),
+		STX_W (BPF_REG_10, BPF_REG_2, -16),
+		LDX_W (BPF_REG_2, BPF_REG_6, SKB (local_ip4)),
+		STX_W (BPF_REG_10, BPF_REG_2, -12),
+		LDX_W (BPF_REG_2, BPF_REG_6, SKB (remote_port)),
+		STX_W (BPF_REG_10, BPF_REG_2, -8),
+		LDX_W (BPF_REG_2, BPF_REG_6, SKB (local_port)),
+		STX_W (BPF_REG_10, BPF_REG_2, -4),
+		LD_MAP_FD (BPF_REG_1, self->peer_map),
+		MOV64_REG (BPF_REG_2, BPF_REG_10),
+		ADD64_IMM (BPF_REG_2, -16),
+		CALL (BPF_FUNC_map_lookup_elem),
+		JEQ_IMM (BPF_REG_0, 0, 9),
+		LDX_W (BPF_REG_7, BPF_REG_6, SKB (len)),
+		XADD_DW (BPF_REG_0, BPF_REG_7, offsetof (HevSocks5SockmapPeer, bytes)),
+		LDX_W (BPF_REG_3, BPF_REG_0, offsetof (HevSocks5SockmapPeer, index)),
+		MOV64_REG (BPF_REG_1, BPF_REG_6),
+		LD_MAP_FD (BPF_REG_2, self->sock_map),
+		MOV64_IMM (BPF_REG_4, 0),
+		CALL (BPF_FUNC_sk_redirect_map),
+		EXIT (),
+		/* unknown socket, leave the data to user space */
+		MOV64_IMM (BPF_REG_0, SK_PASS),
+		EXIT (),
+	};
+
+	self->parser_prog = bpf_prog_load (parser, sizeof (parser) / sizeof (parser[0]));
+	if (0 > self->parser_prog)
+	  return false;
+	self->verdict_prog = bpf_prog_load (verdict, sizeof (verdict) / sizeof (verdict[0]));
+	if (0 > self->verdict_prog)
+	  return false;
+	if (0 > bpf_prog_attach (self->parser_prog, self->sock_map, BPF_SK_SKB_STREAM_PARSER))
+	  return false;
+	if (0 > bpf_prog_attach (self->verdict_prog, self->sock_map, BPF_SK_SKB_STREAM_VERDICT))
+	  return false;
+
+	return true;
+}
+
+static bool
+sockmap_load (HevSocks5Sockmap *self)
+{
+	/* the programs embed the map fds, create the maps first */
+	self->sock_map = bpf_map_create (BPF_MAP_TYPE_SOCKMAP, sizeof (uint32_t),
+				sizeof (uint32_t), MAX_SLOTS * 2);
+	if (0 > self->sock_map)
+	  return false;
+	self->peer_map = bpf_map_create (BPF_MAP_TYPE_HASH, sizeof (HevSocks5SockmapKey),
+				sizeof (HevSocks5SockmapPeer), MAX_SLOTS * 2);
+	if (0 > self->peer_map)
+	  return false;
+
+	return sockmap_load_progs (self);
+}
+
+static void
+sockmap_close (HevSocks5Sockmap *self)
+{
+	if (-1 < self->verdict_prog)
+	  close (self->verdict_prog);
+	if (-1 < self->parser_prog)
+	  close (self->parser_prog);
+	if (-1 < self->peer_map)
+	  close (self->peer_map);
+	if (-1 < self->sock_map)
+	  close (self->sock_map);
+}
+
+HevSocks5Sockmap *
+hev_socks5_sockmap_new (void)
+{
+	HevSocks5Sockmap *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Sockmap));
+	if (self) {
+		int i = 0;
+
+		self->sock_map = -1;
+		self->peer_map = -1;
+		self->parser_prog = -1;
+		self->verdict_prog = -1;
+		if (!sockmap_load (self)) {
+			sockmap_close (self);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+
+		for (i=0; i<MAX_SLOTS; i++)
+		  self->slots[i].next_free = i + 1;
+		self->slots[MAX_SLOTS-1].next_free = -1;
+		self->free_slot = 0;
+		self->ref_count = 1;
+	}
+
+	return self;
+}
+
+HevSocks5Sockmap *
+hev_socks5_sockmap_ref (HevSocks5Sockmap *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_sockmap_unref (HevSocks5Sockmap *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			sockmap_close (self);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+static bool
+sockmap_key (int fd, HevSocks5SockmapKey *key)
+{
+	struct sockaddr_in local, remote;
+	socklen_t len = sizeof (local);
+
+	if ((0 > getsockname (fd, (struct sockaddr *) &local, &len)) ||
+				(AF_INET != local.sin_family))
+	  return false;
+	len = sizeof (remote);
+	if (0 > getpeername (fd, (struct sockaddr *) &remote, &len))
+	  return false;
+
+	key->remote_ip4 = remote.sin_addr.s_addr;
+	key->local_ip4 = local.sin_addr.s_addr;
+	/* __sk_buff.remote_port holds the raw port in its upper half on
+	 * little endian, local_port is in host order */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	key->remote_port = (uint32_t) remote.sin_port << 16;
+#else
+	key->remote_port = remote.sin_port;
+#endif
+	key->local_port = ntohs (local.sin_port);
+
+	return true;
+}
+
+int
+hev_socks5_sockmap_attach (HevSocks5Sockmap *self, int client_fd, int remote_fd)
+{
+	HevSocks5SockmapSlot *slot = NULL;
+	HevSocks5SockmapPeer peer;
+	uint32_t index = 0;
+	int id = self->free_slot;
+
+	if (0 > id) {
+		errno = ENOSPC;
+		return -1;
+	}
+	slot = &self->slots[id];
+	if (!sockmap_key (client_fd, &slot->keys[0]) ||
+				!sockmap_key (remote_fd, &slot->keys[1]))
+	  return -1;
+
+	/* peers first, so the verdict never sees a socket without one */
+	memset (&peer, 0, sizeof (peer));
+	peer.index = id * 2 + 1;
+	if (0 > bpf_map_update (self->peer_map, &slot->keys[0], &peer))
+	  return -1;
+	peer.index = id * 2;
+	if (0 > bpf_map_update (self->peer_map, &slot->keys[1], &peer))
+	  goto fail_peer;
+	index = id * 2;
+	if (0 > bpf_map_update (self->sock_map, &index, &client_fd))
+	  goto fail_peer;
+	index = id * 2 + 1;
+	if (0 > bpf_map_update (self->sock_map, &index, &remote_fd))
+	  goto fail_sock;
+
+	self->free_slot = slot->next_free;
+
+	return id;
+
+fail_sock:
+	index = id * 2;
+	bpf_map_delete (self->sock_map, &index);
+fail_peer:
+	bpf_map_delete (self->peer_map, &slot->keys[0]);
+	bpf_map_delete (self->peer_map, &slot->keys[1]);
+
+	return -1;
+}
+
+void
+hev_socks5_sockmap_detach (HevSocks5Sockmap *self, int id)
+{
+	HevSocks5SockmapSlot *slot = &self->slots[id];
+	uint32_t index = 0;
+
+	index = id * 2;
+	bpf_map_delete (self->sock_map, &index);
+	index = id * 2 + 1;
+	bpf_map_delete (self->sock_map, &index);
+	bpf_map_delete (self->peer_map, &slot->keys[0]);
+	bpf_map_delete (self->peer_map, &slot->keys[1]);
+
+	slot->next_free = self->free_slot;
+	self->free_slot = id;
+}
+
+void
+hev_socks5_sockmap_get_bytes (HevSocks5Sockmap *self, int id,
+			uint64_t *forward, uint64_t *backward)
+{
+	HevSocks5SockmapSlot *slot = &self->slots[id];
+	HevSocks5SockmapPeer peer;
+
+	*forward = 0;
+	*backward = 0;
+	if (0 == bpf_map_lookup (self->peer_map, &slot->keys[0], &peer))
+	  *forward = peer.bytes;
+	if (0 == bpf_map_lookup (self->peer_map, &slot->keys[1], &peer))
+	  *backward = peer.bytes;
+}
+
@@ -0,0 +1,32 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-sockmap.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 in-kernel relay via eBPF sockmap
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_SOCKMAP_H__
+#define __HEV_SOCKS5_SOCKMAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct _HevSocks5Sockmap HevSocks5Sockmap;
+
+HevSocks5Sockmap * hev_socks5_sockmap_new (void);
+
+HevSocks5Sockmap * hev_socks5_sockmap_ref (HevSocks5Sockmap *self);
+void hev_socks5_sockmap_unref (HevSocks5Sockmap *self);
+
+/* -1 with errno ENOSPC while every slot is taken, any other errno means
+ * the pair can never be attached */
+int hev_socks5_sockmap_attach (HevSocks5Sockmap *self, int client_fd, int remote_fd);
+void hev_socks5_sockmap_detach (HevSocks5Sockmap *self, int slot);
+
+void hev_socks5_sockmap_get_bytes (HevSocks5Sockmap *self, int slot,
+			uint64_t *forward, uint64_t *backward);
+
+#endif /* __HEV_SOCKS5_SOCKMAP_H__ */
+
@@ -0,0 +1,107 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-stats.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 statistics
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "hev-socks5-stats.h"
+
+typedef struct _HevSocks5StatsPhaseTiming HevSocks5StatsPhaseTiming;
+
+struct _HevSocks5StatsPhaseTiming
+{
+	uint64_t count;
+	uint64_t failed;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static const char *phase_names[HEV_SOCKS5_STATS_PHASE_MAX] =
+{
+	"auth",
+};
+
+static const char *counter_names[HEV_SOCKS5_STATS_COUNTER_MAX] =
+{
+	"wakeups",
+	"interest-changes",
+	"relay-bytes",
+	"sockmap-sessions",
+	"accesslog-drops",
+	"tls-handshakes",
+	"tls-failures",
+	"handoff-sessions",
+	"close-client",
+	"close-remote",
+	"close-error",
+	"close-handshake",
+	"close-idle",
+	"close-shutdown",
+	"close-auth-timeout",
+	"close-request-timeout",
+	"close-dns-timeout",
+	"close-connect-timeout",
+	"close-stall",
+	"close-handoff",
+	"close-killed",
+};
+
+static HevSocks5StatsPhaseTiming phases[HEV_SOCKS5_STATS_PHASE_MAX];
+uint64_t hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_MAX];
+
+uint64_t
+hev_socks5_stats_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+hev_socks5_stats_phase_add (HevSocks5StatsPhase phase, uint64_t ns, bool success)
+{
+	HevSocks5StatsPhaseTiming *timing = &phases[phase];
+
+	timing->count ++;
+	if (!success)
+	  timing->failed ++;
+	timing->total_ns += ns;
+	if (ns > timing->max_ns)
+	  timing->max_ns = ns;
+}
+
+void
+hev_socks5_stats_dump (int fd)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<HEV_SOCKS5_STATS_PHASE_MAX; i++) {
+		HevSocks5StatsPhaseTiming *timing = &phases[i];
+		uint64_t avg_ns = timing->count ? (timing->total_ns / timing->count) : 0;
+
+		dprintf (fd, "phase %s: count %llu failed %llu avg %lluus max %lluus\n",
+					phase_names[i], (unsigned long long) timing->count,
+					(unsigned long long) timing->failed,
+					(unsigned long long) (avg_ns / 1000),
+					(unsigned long long) (timing->max_ns / 1000));
+	}
+
+	for (i=0; i<HEV_SOCKS5_STATS_COUNTER_MAX; i++) {
+		dprintf (fd, "counter %s: %llu\n", counter_names[i],
+					(unsigned long long) hev_socks5_stats_counters[i]);
+	}
+	if (hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_WAKEUPS]) {
+		dprintf (fd, "relay bytes per wakeup: %llu\n", (unsigned long long)
+					(hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_RELAY_BYTES] /
+					 hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_WAKEUPS]));
+	}
+}
+
@@ -0,0 +1,66 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-stats.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 statistics
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_STATS_H__
+#define __HEV_SOCKS5_STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum _HevSocks5StatsPhase HevSocks5StatsPhase;
+typedef enum _HevSocks5StatsCounter HevSocks5StatsCounter;
+
+enum _HevSocks5StatsPhase
+{
+	HEV_SOCKS5_STATS_PHASE_AUTH,
+	HEV_SOCKS5_STATS_PHASE_MAX,
+};
+
+enum _HevSocks5StatsCounter
+{
+	HEV_SOCKS5_STATS_COUNTER_WAKEUPS,
+	HEV_SOCKS5_STATS_COUNTER_INTEREST_CHANGES,
+	HEV_SOCKS5_STATS_COUNTER_RELAY_BYTES,
+	HEV_SOCKS5_STATS_COUNTER_SOCKMAP_SESSIONS,
+	HEV_SOCKS5_STATS_COUNTER_ACCESSLOG_DROPS,
+	HEV_SOCKS5_STATS_COUNTER_TLS_HANDSHAKES,
+	HEV_SOCKS5_STATS_COUNTER_TLS_FAILURES,
+	HEV_SOCKS5_STATS_COUNTER_HANDOFF_SESSIONS,
+	/* one per HevSocks5SessionCloseReason, same order */
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_CLIENT,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_REMOTE,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_ERROR,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_HANDSHAKE,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_IDLE,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_SHUTDOWN,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_AUTH_TIMEOUT,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_REQUEST_TIMEOUT,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_DNS_TIMEOUT,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_CONNECT_TIMEOUT,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_STALL,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_HANDOFF,
+	HEV_SOCKS5_STATS_COUNTER_CLOSE_KILLED,
+	HEV_SOCKS5_STATS_COUNTER_MAX,
+};
+
+uint64_t hev_socks5_stats_clock (void);
+
+void hev_socks5_stats_phase_add (HevSocks5StatsPhase phase, uint64_t ns, bool success);
+
+static inline void
+hev_socks5_stats_counter_add (HevSocks5StatsCounter counter, uint64_t value)
+{
+	extern uint64_t hev_socks5_stats_counters[HEV_SOCKS5_STATS_COUNTER_MAX];
+	hev_socks5_stats_counters[counter] += value;
+}
+
+void hev_socks5_stats_dump (int fd);
+
+#endif /* __HEV_SOCKS5_STATS_H__ */
+
@@ -0,0 +1,199 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tls.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 TLS listener with kernel TLS offload
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <hev-lib.h>
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "hev-socks5-tls.h"
+#include "hev-socks5-stats.h"
+
+struct _HevSocks5Tls
+{
+	unsigned int ref_count;
+#ifdef ENABLE_OPENSSL
+	SSL_CTX *ctx;
+#endif
+};
+
+#ifdef ENABLE_OPENSSL
+
+static bool ktls_warned;
+
+HevSocks5Tls *
+hev_socks5_tls_new (const char *cert_file, const char *key_file)
+{
+	HevSocks5Tls *self = NULL;
+	SSL_CTX *ctx = NULL;
+
+	ctx = SSL_CTX_new (TLS_server_method ());
+	if (!ctx)
+	  return NULL;
+	SSL_CTX_set_min_proto_version (ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+	/* older releases only offload the TLS 1.3 send side */
+	SSL_CTX_set_max_proto_version (ctx, TLS1_2_VERSION);
+#endif
+	/* only what the kernel record layer implements */
+	SSL_CTX_set_cipher_list (ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+	SSL_CTX_set_ciphersuites (ctx, "TLS_AES_128_GCM_SHA256:"
+				"TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+	/* nothing but application data may follow the handshake */
+	SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_num_tickets (ctx, 0);
+	if ((1 != SSL_CTX_use_certificate_chain_file (ctx, cert_file)) ||
+				(1 != SSL_CTX_use_PrivateKey_file (ctx, key_file, SSL_FILETYPE_PEM)) ||
+				(1 != SSL_CTX_check_private_key (ctx))) {
+		printf ("Load TLS certificate %s or key %s failed!\n", cert_file, key_file);
+		SSL_CTX_free (ctx);
+		return NULL;
+	}
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Tls));
+	if (!self) {
+		SSL_CTX_free (ctx);
+		return NULL;
+	}
+	self->ref_count = 1;
+	self->ctx = ctx;
+
+	return self;
+}
+
+HevSocks5Tls *
+hev_socks5_tls_ref (HevSocks5Tls *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_tls_unref (HevSocks5Tls *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			SSL_CTX_free (self->ctx);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+HevSocks5TlsConn *
+hev_socks5_tls_accept (HevSocks5Tls *self, int fd)
+{
+	SSL *ssl = SSL_new (self->ctx);
+
+	if (!ssl)
+	  return NULL;
+	if (1 != SSL_set_fd (ssl, fd)) {
+		SSL_free (ssl);
+		return NULL;
+	}
+	SSL_set_accept_state (ssl);
+
+	return (HevSocks5TlsConn *) ssl;
+}
+
+int
+hev_socks5_tls_handshake (HevSocks5TlsConn *conn, uint32_t *events)
+{
+	SSL *ssl = (SSL *) conn;
+	int res = 0;
+
+	if (!ssl)
+	  return -1;
+
+	res = SSL_do_handshake (ssl);
+	if (1 != res) {
+		switch (SSL_get_error (ssl, res)) {
+		case SSL_ERROR_WANT_READ:
+			*events = EPOLLIN;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			*events = EPOLLOUT;
+			return 0;
+		default:
+			ERR_clear_error ();
+			hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_TLS_FAILURES, 1);
+			return -1;
+		}
+	}
+
+	/* the relay only speaks plaintext, both directions must be offloaded
+	 * and nothing may be left behind in the user space buffers */
+	if (!BIO_get_ktls_send (SSL_get_wbio (ssl)) ||
+				!BIO_get_ktls_recv (SSL_get_rbio (ssl)) || SSL_has_pending (ssl)) {
+		if (!ktls_warned) {
+			printf ("Kernel TLS offload unavailable, closing TLS sessions!\n");
+			ktls_warned = true;
+		}
+		hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_TLS_FAILURES, 1);
+		return -1;
+	}
+	hev_socks5_stats_counter_add (HEV_SOCKS5_STATS_COUNTER_TLS_HANDSHAKES, 1);
+
+	return 1;
+}
+
+void
+hev_socks5_tls_conn_free (HevSocks5TlsConn *conn)
+{
+	/* no close_notify, the kernel owns the connection state now */
+	SSL_free ((SSL *) conn);
+}
+
+#else /* ENABLE_OPENSSL */
+
+HevSocks5Tls *
+hev_socks5_tls_new (const char *cert_file, const char *key_file)
+{
+	printf ("TLS listeners need a build with OPENSSL=1!\n");
+
+	return NULL;
+}
+
+HevSocks5Tls *
+hev_socks5_tls_ref (HevSocks5Tls *self)
+{
+	return self;
+}
+
+void
+hev_socks5_tls_unref (HevSocks5Tls *self)
+{
+}
+
+HevSocks5TlsConn *
+hev_socks5_tls_accept (HevSocks5Tls *self, int fd)
+{
+	return NULL;
+}
+
+int
+hev_socks5_tls_handshake (HevSocks5TlsConn *conn, uint32_t *events)
+{
+	return -1;
+}
+
+void
+hev_socks5_tls_conn_free (HevSocks5TlsConn *conn)
+{
+}
+
+#endif /* !ENABLE_OPENSSL */
+
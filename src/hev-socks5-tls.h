@@ -0,0 +1,30 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tls.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 TLS listener with kernel TLS offload
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_TLS_H__
+#define __HEV_SOCKS5_TLS_H__
+
+#include <stdint.h>
+
+typedef struct _HevSocks5Tls HevSocks5Tls;
+typedef struct _HevSocks5TlsConn HevSocks5TlsConn;
+
+HevSocks5Tls * hev_socks5_tls_new (const char *cert_file, const char *key_file);
+
+HevSocks5Tls * hev_socks5_tls_ref (HevSocks5Tls *self);
+void hev_socks5_tls_unref (HevSocks5Tls *self);
+
+HevSocks5TlsConn * hev_socks5_tls_accept (HevSocks5Tls *self, int fd);
+/* 1 once the kernel carries the records both ways and fd is plaintext,
+ * 0 to wait for events (EPOLLIN or EPOLLOUT), -1 on failure */
+int hev_socks5_tls_handshake (HevSocks5TlsConn *conn, uint32_t *events);
+void hev_socks5_tls_conn_free (HevSocks5TlsConn *conn);
+
+#endif /* __HEV_SOCKS5_TLS_H__ */
+
@@ -0,0 +1,90 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tuning.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 socket tuning profiles
+ ============================================================================
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hev-socks5-tuning.h"
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT	25
+#endif
+
+#ifndef TCP_USER_TIMEOUT
+#define TCP_USER_TIMEOUT	18
+#endif
+
+struct _HevSocks5Tuning
+{
+	const char *name;
+	int nodelay;
+	int notsent_lowat;	/* 0: leave unset */
+	int sndbuf;		/* 0: kernel autotuning */
+	int rcvbuf;		/* 0: kernel autotuning */
+	int keepalive_idle;	/* seconds, 0: no keepalive */
+	int keepalive_intvl;
+	int keepalive_cnt;
+	int user_timeout;	/* milliseconds, 0: leave unset */
+};
+
+static const HevSocks5Tuning profiles[] =
+{
+	/* small unsent queues and no Nagle, for request/response traffic */
+	{ "interactive", 1, 16384, 0, 0, 30, 10, 3, 30000 },
+	/* large fixed buffers for throughput, Nagle stays on */
+	{ "bulk", 0, 0, 4194304, 4194304, 60, 10, 6, 120000 },
+};
+
+const HevSocks5Tuning *
+hev_socks5_tuning_lookup (const char *name)
+{
+	unsigned int i = 0;
+
+	for (i=0; i<(sizeof (profiles) / sizeof (profiles[0])); i++) {
+		if (0 == strcmp (profiles[i].name, name))
+		  return &profiles[i];
+	}
+
+	return NULL;
+}
+
+const char *
+hev_socks5_tuning_get_name (const HevSocks5Tuning *self)
+{
+	return self ? self->name : "default";
+}
+
+void
+hev_socks5_tuning_apply (const HevSocks5Tuning *self, int fd)
+{
+	if (!self)
+	  return;
+
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &self->nodelay, sizeof (int));
+	if (self->notsent_lowat)
+	  setsockopt (fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				  &self->notsent_lowat, sizeof (int));
+	if (self->sndbuf)
+	  setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &self->sndbuf, sizeof (int));
+	if (self->rcvbuf)
+	  setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &self->rcvbuf, sizeof (int));
+	if (self->keepalive_idle) {
+		int keepalive = 1;
+		setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof (int));
+		setsockopt (fd, IPPROTO_TCP, TCP_KEEPIDLE, &self->keepalive_idle, sizeof (int));
+		setsockopt (fd, IPPROTO_TCP, TCP_KEEPINTVL, &self->keepalive_intvl, sizeof (int));
+		setsockopt (fd, IPPROTO_TCP, TCP_KEEPCNT, &self->keepalive_cnt, sizeof (int));
+	}
+	if (self->user_timeout)
+	  setsockopt (fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+				  &self->user_timeout, sizeof (int));
+}
+
@@ -0,0 +1,21 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tuning.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 socket tuning profiles
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_TUNING_H__
+#define __HEV_SOCKS5_TUNING_H__
+
+typedef struct _HevSocks5Tuning HevSocks5Tuning;
+
+const HevSocks5Tuning * hev_socks5_tuning_lookup (const char *name);
+const char * hev_socks5_tuning_get_name (const HevSocks5Tuning *self);
+
+void hev_socks5_tuning_apply (const HevSocks5Tuning *self, int fd);
+
+#endif /* __HEV_SOCKS5_TUNING_H__ */
+
@@ -0,0 +1,953 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tunnel.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 multiplexed tunnel to a parent proxy
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "hev-socks5-tunnel.h"
+#include "hev-socks5-loopmon.h"
+
+#define MAX_SERVER_CONNS	64
+#define MAX_STREAMS	1024	/* per connection, power of 2 */
+#define MAX_ROUTES	64
+#define SECRET_MAX	64
+#define FRAME_HEADER	8	/* type, 0, length, stream id */
+#define FRAME_MAX	16384
+#define WINDOW		(256 * 1024)	/* unacknowledged bytes per stream */
+#define IN_SIZE		(FRAME_HEADER + FRAME_MAX)
+#define OUT_SIZE	(128 * 1024)
+#define OUT_RESERVE	(8 * 1024)	/* left to control frames */
+#define OUT_ROOM	1024	/* least worth a data frame */
+#define RECONNECT	1000	/* ms */
+#define MAX_RESETS	64	/* aborted streams not yet seen by sessions */
+
+enum
+{
+	FRAME_HELLO,	/* secret, first frame of a connection */
+	FRAME_OPEN,	/* IPv4 address and port, network order */
+	FRAME_DATA,
+	FRAME_WINDOW,	/* bytes delivered, 32 bit */
+	FRAME_FIN,	/* no more data this way */
+	FRAME_RESET,	/* errno, 32 bit */
+};
+
+typedef struct _HevSocks5TunnelConn HevSocks5TunnelConn;
+typedef struct _HevSocks5TunnelStream HevSocks5TunnelStream;
+typedef struct _HevSocks5TunnelRoute HevSocks5TunnelRoute;
+
+struct _HevSocks5TunnelStream
+{
+	int fd;
+	uint32_t id;
+	bool connecting;
+	bool readable;
+	bool fin_sent;
+	bool fin_recv;
+	bool shut;
+	uint32_t send_window;
+	uint32_t recv_unacked;
+	ino_t peer_ino;		/* the session end of the socketpair */
+	size_t pending_off;
+	size_t pending_len;
+	uint8_t *pending;	/* from the peer, waiting for fd */
+	HevEventSource *source;
+	HevSocks5TunnelConn *conn;
+};
+
+struct _HevSocks5TunnelConn
+{
+	int fd;
+	bool up;
+	bool broken;
+	bool blocked;	/* a stream waits for room in out */
+	uint32_t next_id;
+	unsigned int stream_count;
+	size_t in_len;
+	size_t out_len;
+	HevEventSource *source;
+	HevSocks5Tunnel *tunnel;
+	HevSocks5TunnelStream *streams[MAX_STREAMS];
+	uint8_t in[IN_SIZE];
+	uint8_t out[OUT_SIZE];
+};
+
+struct _HevSocks5TunnelRoute
+{
+	uint32_t network;
+	uint32_t mask;
+};
+
+struct _HevSocks5Tunnel
+{
+	int fd;
+	unsigned int ref_count;
+	bool server;
+	unsigned int conns;
+	unsigned int conn_count;
+	unsigned int route_count;
+	size_t secret_len;
+	char secret[SECRET_MAX];
+	char name[64];
+	struct sockaddr_in addr;
+	uint64_t opened;
+	uint64_t failed;
+	uint64_t resets;
+	uint64_t reconnects;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	unsigned int reset_next;
+	ino_t reset_inos[MAX_RESETS];
+	HevSList *conn_list;
+	HevSocks5TunnelRoute routes[MAX_ROUTES];
+	HevEventSource *source;
+	HevEventSource *timer_source;
+	HevEventLoop *loop;
+};
+
+static bool conn_source_handler (HevEventSourceFD *fd, void *data);
+static bool stream_source_handler (HevEventSourceFD *fd, void *data);
+static bool listener_source_handler (HevEventSourceFD *fd, void *data);
+static bool timer_source_handler (void *data);
+static void conn_free (HevSocks5TunnelConn *self);
+
+static HevSocks5Tunnel *
+tunnel_new (HevEventLoop *loop, const char *addr, unsigned int port,
+			const char *secret)
+{
+	HevSocks5Tunnel *self = NULL;
+
+	if (secret && (SECRET_MAX < strlen (secret)))
+	  return NULL;
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5Tunnel));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5Tunnel));
+	self->ref_count = 1;
+	self->fd = -1;
+	self->loop = loop;
+	self->addr.sin_family = AF_INET;
+	self->addr.sin_addr.s_addr = inet_addr (addr);
+	self->addr.sin_port = htons (port);
+	snprintf (self->name, sizeof (self->name), "%s:%u", addr, port);
+	if (secret) {
+		self->secret_len = strlen (secret);
+		memcpy (self->secret, secret, self->secret_len);
+	}
+
+	return self;
+}
+
+HevSocks5Tunnel *
+hev_socks5_tunnel_new (HevEventLoop *loop, const char *addr,
+			unsigned int port, unsigned int conns, const char *secret)
+{
+	HevSocks5Tunnel *self = tunnel_new (loop, addr, port, secret);
+
+	if (!self)
+	  return NULL;
+	self->conns = conns ? conns : 1;
+
+	/* connects right away, then keeps the count up */
+	timer_source_handler (self);
+	self->reconnects = 0;
+	self->timer_source = hev_event_source_timeout_new (RECONNECT);
+	hev_event_source_set_priority (self->timer_source, -1);
+	hev_event_source_set_callback (self->timer_source, timer_source_handler, self, NULL);
+	hev_event_loop_add_source (loop, self->timer_source);
+	hev_event_source_unref (self->timer_source);
+
+	return self;
+}
+
+HevSocks5Tunnel *
+hev_socks5_tunnel_new_server (HevEventLoop *loop, const char *addr,
+			unsigned int port, const char *secret)
+{
+	HevSocks5Tunnel *self = tunnel_new (loop, addr, port, secret);
+	int nonblock = 1, reuseaddr = 1;
+
+	if (!self)
+	  return NULL;
+	self->server = true;
+
+	self->fd = socket (AF_INET, SOCK_STREAM, 0);
+	if (0 > self->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	ioctl (self->fd, FIONBIO, (char *) &nonblock);
+	setsockopt (self->fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
+	if ((0 > bind (self->fd, (struct sockaddr *) &self->addr, sizeof (self->addr))) ||
+				(0 > listen (self->fd, 16))) {
+		printf ("Bind tunnel %s failed!\n", self->name);
+		close (self->fd);
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (self->source, 1);
+	hev_event_source_add_fd (self->source, self->fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) listener_source_handler, self, NULL);
+	hev_event_loop_add_source (loop, self->source);
+	hev_event_source_unref (self->source);
+
+	return self;
+}
+
+HevSocks5Tunnel *
+hev_socks5_tunnel_ref (HevSocks5Tunnel *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_socks5_tunnel_unref (HevSocks5Tunnel *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			while (self->conn_list)
+			  conn_free (hev_slist_data (self->conn_list));
+			if (self->timer_source)
+			  hev_event_loop_del_source (self->loop, self->timer_source);
+			if (self->source)
+			  hev_event_loop_del_source (self->loop, self->source);
+			if (-1 < self->fd)
+			  close (self->fd);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+bool
+hev_socks5_tunnel_add_route (HevSocks5Tunnel *self, const char *route)
+{
+	const char *slash = strchr (route, '/');
+	size_t len = slash ? (size_t) (slash - route) : strlen (route);
+	unsigned long prefix = 32;
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in;
+	uint32_t mask = 0;
+
+	if ((MAX_ROUTES <= self->route_count) || (sizeof (addr) <= len))
+	  return false;
+	memcpy (addr, route, len);
+	addr[len] = '\0';
+	if (slash) {
+		char *end = NULL;
+
+		prefix = strtoul (slash + 1, &end, 10);
+		if ((end == (slash + 1)) || *end || (32 < prefix))
+		  return false;
+	}
+	if (1 != inet_pton (AF_INET, addr, &in))
+	  return false;
+
+	mask = prefix ? htonl (~0U << (32 - prefix)) : 0;
+	self->routes[self->route_count].network = in.s_addr & mask;
+	self->routes[self->route_count].mask = mask;
+	self->route_count ++;
+
+	return true;
+}
+
+bool
+hev_socks5_tunnel_route (HevSocks5Tunnel *self, const struct sockaddr_in *dest)
+{
+	unsigned int i = 0;
+
+	if (0 == self->route_count)
+	  return true;
+	for (i=0; i<self->route_count; i++) {
+		if ((dest->sin_addr.s_addr & self->routes[i].mask) == self->routes[i].network)
+		  return true;
+	}
+
+	return false;
+}
+
+static void
+frame_header (uint8_t *buf, unsigned int type, uint32_t id, size_t len)
+{
+	buf[0] = type;
+	buf[1] = 0;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	id = htonl (id);
+	memcpy (&buf[4], &id, 4);
+}
+
+static void
+conn_send (HevSocks5TunnelConn *self, unsigned int type, uint32_t id,
+			const void *payload, size_t len)
+{
+	/* control frames may use the reserve, past it the peer is hopeless */
+	if (OUT_SIZE < (self->out_len + FRAME_HEADER + len)) {
+		self->broken = true;
+		return;
+	}
+	frame_header (self->out + self->out_len, type, id, len);
+	if (len)
+	  memcpy (self->out + self->out_len + FRAME_HEADER, payload, len);
+	self->out_len += FRAME_HEADER + len;
+}
+
+static void
+conn_send_u32 (HevSocks5TunnelConn *self, unsigned int type, uint32_t id,
+			uint32_t value)
+{
+	value = htonl (value);
+	conn_send (self, type, id, &value, sizeof (value));
+}
+
+static HevSocks5TunnelStream *
+stream_new (HevSocks5TunnelConn *conn, uint32_t id, int fd)
+{
+	HevSocks5TunnelStream *self = NULL;
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5TunnelStream));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevSocks5TunnelStream));
+	self->fd = fd;
+	self->id = id;
+	self->send_window = WINDOW;
+	self->conn = conn;
+
+	/* both directions edge triggered, no interest to keep in sync */
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_add_fd (self->source, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) stream_source_handler, self, NULL);
+	hev_event_loop_add_source (conn->tunnel->loop, self->source);
+	hev_event_source_unref (self->source);
+
+	conn->streams[id & (MAX_STREAMS - 1)] = self;
+	conn->stream_count ++;
+
+	return self;
+}
+
+static void
+stream_free (HevSocks5TunnelStream *self, bool abort)
+{
+	HevSocks5TunnelConn *conn = self->conn;
+	HevSocks5Tunnel *tunnel = conn->tunnel;
+
+	/* a reset from the far end is passed on as one; a socketpair closes
+	 * orderly whatever the linger, so the session asks at its EOF */
+	if (abort && self->peer_ino) {
+		tunnel->reset_inos[tunnel->reset_next % MAX_RESETS] = self->peer_ino;
+		tunnel->reset_next ++;
+	} else if (abort) {
+		struct linger linger = { 1, 0 };
+		setsockopt (self->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+	}
+	hev_event_loop_del_source (conn->tunnel->loop, self->source);
+	close (self->fd);
+	conn->streams[self->id & (MAX_STREAMS - 1)] = NULL;
+	conn->stream_count --;
+	if (self->pending)
+	  HEV_MEMORY_ALLOCATOR_FREE (self->pending);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+static void
+stream_reset (HevSocks5TunnelStream *self, int error)
+{
+	conn_send_u32 (self->conn, FRAME_RESET, self->id, error);
+	self->conn->tunnel->resets ++;
+	stream_free (self, false);
+}
+
+/* false once the stream is gone */
+static bool
+stream_check_done (HevSocks5TunnelStream *self)
+{
+	if (!self->fin_sent || !self->shut)
+	  return true;
+	stream_free (self, false);
+
+	return false;
+}
+
+static void
+stream_delivered (HevSocks5TunnelStream *self, size_t len)
+{
+	/* the window comes back in batches, not per write */
+	self->recv_unacked += len;
+	self->conn->tunnel->bytes_in += len;
+	if ((WINDOW / 2) <= self->recv_unacked) {
+		conn_send_u32 (self->conn, FRAME_WINDOW, self->id, self->recv_unacked);
+		self->recv_unacked = 0;
+	}
+}
+
+static bool
+stream_flush (HevSocks5TunnelStream *self)
+{
+	if (self->connecting)
+	  return true;
+
+	while (self->pending_len) {
+		ssize_t size = write (self->fd, self->pending + self->pending_off,
+					self->pending_len);
+		if (0 > size) {
+			if (EAGAIN == errno)
+			  return true;
+			stream_reset (self, errno);
+			return false;
+		}
+		self->pending_off += size;
+		self->pending_len -= size;
+		stream_delivered (self, size);
+	}
+	self->pending_off = 0;
+
+	/* a fin from the peer waits for what was sent before it */
+	if (self->fin_recv && !self->shut) {
+		shutdown (self->fd, SHUT_WR);
+		self->shut = true;
+		return stream_check_done (self);
+	}
+
+	return true;
+}
+
+static bool
+stream_pump (HevSocks5TunnelStream *self)
+{
+	HevSocks5TunnelConn *conn = self->conn;
+
+	while (self->readable && !self->fin_sent && !self->connecting) {
+		size_t len = FRAME_MAX, room = 0;
+		ssize_t size = 0;
+
+		if ((OUT_SIZE - OUT_RESERVE) > (conn->out_len + FRAME_HEADER))
+		  room = OUT_SIZE - OUT_RESERVE - conn->out_len - FRAME_HEADER;
+		if (OUT_ROOM > room) {
+			conn->blocked = true;
+			break;
+		}
+		/* a closed window stops this stream only */
+		if (0 == self->send_window)
+		  break;
+		if (len > room)
+		  len = room;
+		if (len > self->send_window)
+		  len = self->send_window;
+
+		size = read (self->fd, conn->out + conn->out_len + FRAME_HEADER, len);
+		if (0 < size) {
+			frame_header (conn->out + conn->out_len, FRAME_DATA, self->id, size);
+			conn->out_len += FRAME_HEADER + size;
+			self->send_window -= size;
+			conn->tunnel->bytes_out += size;
+		} else if (0 == size) {
+			conn_send (conn, FRAME_FIN, self->id, NULL, 0);
+			self->fin_sent = true;
+			return stream_check_done (self);
+		} else if (EAGAIN == errno) {
+			self->readable = false;
+		} else {
+			stream_reset (self, errno);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+stream_receive (HevSocks5TunnelStream *self, const uint8_t *data, size_t len)
+{
+	/* more than the window allows, the peer is broken */
+	if (self->fin_recv ||
+				(WINDOW < (self->pending_len + self->recv_unacked + len))) {
+		stream_reset (self, EPROTO);
+		return;
+	}
+
+	if (!self->pending_len && !self->connecting) {
+		ssize_t size = write (self->fd, data, len);
+		if (0 > size) {
+			if (EAGAIN != errno) {
+				stream_reset (self, errno);
+				return;
+			}
+			size = 0;
+		}
+		data += size;
+		len -= size;
+		stream_delivered (self, size);
+	}
+	if (0 == len)
+	  return;
+
+	if (!self->pending) {
+		self->pending = HEV_MEMORY_ALLOCATOR_ALLOC (WINDOW);
+		if (!self->pending) {
+			stream_reset (self, ENOMEM);
+			return;
+		}
+	}
+	if (WINDOW < (self->pending_off + self->pending_len + len)) {
+		memmove (self->pending, self->pending + self->pending_off, self->pending_len);
+		self->pending_off = 0;
+	}
+	memcpy (self->pending + self->pending_off + self->pending_len, data, len);
+	self->pending_len += len;
+}
+
+static void
+stream_connect (HevSocks5TunnelConn *conn, uint32_t id, const uint8_t *payload)
+{
+	HevSocks5TunnelStream *stream = NULL;
+	struct sockaddr_in dest;
+	int fd = -1, nonblock = 1;
+
+	memset (&dest, 0, sizeof (dest));
+	dest.sin_family = AF_INET;
+	memcpy (&dest.sin_addr, payload, 4);
+	memcpy (&dest.sin_port, payload + 4, 2);
+
+	conn->tunnel->opened ++;
+	fd = socket (AF_INET, SOCK_STREAM, 0);
+	if (0 > fd) {
+		conn->tunnel->failed ++;
+		conn_send_u32 (conn, FRAME_RESET, id, errno);
+		return;
+	}
+	ioctl (fd, FIONBIO, (char *) &nonblock);
+	if ((0 > connect (fd, (struct sockaddr *) &dest, sizeof (dest))) &&
+				(EINPROGRESS != errno)) {
+		conn->tunnel->failed ++;
+		conn_send_u32 (conn, FRAME_RESET, id, errno);
+		close (fd);
+		return;
+	}
+
+	/* data may follow the open at once, it waits in pending */
+	stream = stream_new (conn, id, fd);
+	if (!stream) {
+		conn_send_u32 (conn, FRAME_RESET, id, ENOMEM);
+		close (fd);
+		return;
+	}
+	stream->connecting = true;
+}
+
+static void
+conn_process (HevSocks5TunnelConn *self, unsigned int type, uint32_t id,
+			const uint8_t *payload, size_t len)
+{
+	HevSocks5Tunnel *tunnel = self->tunnel;
+	HevSocks5TunnelStream *stream = self->streams[id & (MAX_STREAMS - 1)];
+	uint32_t value = 0;
+
+	if (stream && (stream->id != id))
+	  stream = NULL;
+
+	/* nothing goes through before the secret matched */
+	if (!self->up) {
+		if ((FRAME_HELLO != type) || (tunnel->secret_len != len) ||
+					(0 != memcmp (tunnel->secret, payload, len)))
+		  self->broken = true;
+		else
+		  self->up = true;
+		return;
+	}
+
+	switch (type) {
+	case FRAME_OPEN:
+		if (!tunnel->server || (6 != len))
+		  self->broken = true;
+		else if (self->streams[id & (MAX_STREAMS - 1)])
+		  conn_send_u32 (self, FRAME_RESET, id, EBUSY);
+		else
+		  stream_connect (self, id, payload);
+		break;
+	case FRAME_DATA:
+		if (stream)
+		  stream_receive (stream, payload, len);
+		break;
+	case FRAME_WINDOW:
+		if (!stream || (sizeof (value) != len))
+		  break;
+		memcpy (&value, payload, sizeof (value));
+		value = ntohl (value);
+		stream->send_window = (WINDOW < (stream->send_window + (uint64_t) value)) ?
+			WINDOW : (stream->send_window + value);
+		stream_pump (stream);
+		break;
+	case FRAME_FIN:
+		if (!stream)
+		  break;
+		stream->fin_recv = true;
+		stream_flush (stream);
+		break;
+	case FRAME_RESET:
+		if (stream)
+		  stream_free (stream, true);
+		break;
+	}
+}
+
+static bool
+conn_read (HevSocks5TunnelConn *self)
+{
+	for (;;) {
+		size_t offset = 0;
+		ssize_t size = 0;
+
+		size = read (self->fd, self->in + self->in_len, IN_SIZE - self->in_len);
+		if (0 == size)
+		  return false;
+		if (0 > size)
+		  return EAGAIN == errno;
+		self->in_len += size;
+
+		while ((self->in_len - offset) >= FRAME_HEADER) {
+			uint8_t *frame = self->in + offset;
+			size_t len = (frame[2] << 8) | frame[3];
+			uint32_t id = 0;
+
+			if (FRAME_MAX < len)
+			  return false;
+			if ((self->in_len - offset) < (FRAME_HEADER + len))
+			  break;
+			memcpy (&id, &frame[4], 4);
+			conn_process (self, frame[0], ntohl (id), frame + FRAME_HEADER, len);
+			if (self->broken)
+			  return false;
+			offset += FRAME_HEADER + len;
+		}
+		memmove (self->in, self->in + offset, self->in_len - offset);
+		self->in_len -= offset;
+	}
+}
+
+static void
+conn_flush (HevSocks5TunnelConn *self)
+{
+	unsigned int i = 0;
+
+	for (;;) {
+		while (self->out_len) {
+			ssize_t size = write (self->fd, self->out, self->out_len);
+			if (0 > size) {
+				if (EAGAIN != errno)
+				  self->broken = true;
+				break;
+			}
+			memmove (self->out, self->out + size, self->out_len - size);
+			self->out_len -= size;
+		}
+		if (self->broken || !self->blocked ||
+					((OUT_SIZE - OUT_RESERVE) < (self->out_len + FRAME_HEADER + OUT_ROOM)))
+		  return;
+
+		/* room again, streams that were held back read on */
+		self->blocked = false;
+		for (i=0; i<MAX_STREAMS; i++) {
+			if (self->streams[i] && self->streams[i]->readable)
+			  stream_pump (self->streams[i]);
+		}
+	}
+}
+
+static HevSocks5TunnelConn *
+conn_new (HevSocks5Tunnel *tunnel, int fd, bool up)
+{
+	HevSocks5TunnelConn *self = NULL;
+	int nodelay = 1, keepalive = 1, nonblock = 1;
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevSocks5TunnelConn));
+	if (!self) {
+		close (fd);
+		return NULL;
+	}
+	memset (self, 0, sizeof (HevSocks5TunnelConn));
+	self->fd = fd;
+	self->up = up;
+	self->tunnel = tunnel;
+	ioctl (fd, FIONBIO, (char *) &nonblock);
+	/* frames are batched already, what is left is latency */
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+	setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof (keepalive));
+
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_add_fd (self->source, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) conn_source_handler, self, NULL);
+	hev_event_loop_add_source (tunnel->loop, self->source);
+	hev_event_source_unref (self->source);
+
+	tunnel->conn_list = hev_slist_append (tunnel->conn_list, self);
+	tunnel->conn_count ++;
+
+	return self;
+}
+
+static void
+conn_free (HevSocks5TunnelConn *self)
+{
+	HevSocks5Tunnel *tunnel = self->tunnel;
+	unsigned int i = 0;
+
+	/* every stream on it goes down with the connection */
+	for (i=0; i<MAX_STREAMS; i++) {
+		if (self->streams[i])
+		  stream_free (self->streams[i], true);
+	}
+	hev_event_loop_del_source (tunnel->loop, self->source);
+	close (self->fd);
+	tunnel->conn_list = hev_slist_remove (tunnel->conn_list, self);
+	tunnel->conn_count --;
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+static void
+conn_handle (HevSocks5TunnelConn *self, HevEventSourceFD *fd)
+{
+	uint32_t revents = fd->revents;
+
+	fd->revents = 0;
+	/* the parent accepted, introduce ourselves */
+	if (!self->up && !self->tunnel->server) {
+		socklen_t len = sizeof (int);
+		int error = 0;
+
+		if (!((EPOLLOUT | EPOLLERR | EPOLLHUP) & revents))
+		  return;
+		getsockopt (self->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error || ((EPOLLERR | EPOLLHUP) & revents)) {
+			conn_free (self);
+			return;
+		}
+		self->up = true;
+		conn_send (self, FRAME_HELLO, 0, self->tunnel->secret, self->tunnel->secret_len);
+	}
+	if ((EPOLLERR | EPOLLHUP) & revents) {
+		conn_free (self);
+		return;
+	}
+	if ((EPOLLIN & revents) && !conn_read (self)) {
+		conn_free (self);
+		return;
+	}
+	conn_flush (self);
+	if (self->broken)
+	  conn_free (self);
+}
+
+static bool
+conn_source_handler (HevEventSourceFD *fd, void *data)
+{
+	uint64_t mon = hev_socks5_loopmon_enter ();
+
+	conn_handle (data, fd);
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_TUNNEL, mon);
+
+	return true;
+}
+
+static void
+stream_handle (HevSocks5TunnelStream *self, HevEventSourceFD *fd)
+{
+	uint32_t revents = fd->revents;
+	socklen_t len = sizeof (int);
+	int error = 0;
+
+	fd->revents = 0;
+	if (self->connecting) {
+		if (!((EPOLLOUT | EPOLLERR | EPOLLHUP) & revents))
+		  return;
+		getsockopt (self->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error || ((EPOLLERR | EPOLLHUP) & revents)) {
+			self->conn->tunnel->failed ++;
+			stream_reset (self, error ? error : ECONNREFUSED);
+			return;
+		}
+		self->connecting = false;
+	}
+	if (EPOLLERR & revents) {
+		getsockopt (self->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		stream_reset (self, error ? error : EIO);
+		return;
+	}
+	if ((EPOLLIN | EPOLLHUP) & revents)
+	  self->readable = true;
+	if (stream_flush (self))
+	  stream_pump (self);
+}
+
+static bool
+stream_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevSocks5TunnelStream *self = data;
+	HevSocks5TunnelConn *conn = self->conn;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+
+	stream_handle (self, fd);
+	conn_flush (conn);
+	if (conn->broken)
+	  conn_free (conn);
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_TUNNEL, mon);
+
+	return true;
+}
+
+int
+hev_socks5_tunnel_open (HevSocks5Tunnel *self, const struct sockaddr_in *dest)
+{
+	HevSocks5TunnelConn *conn = NULL;
+	HevSocks5TunnelStream *stream = NULL;
+	HevSList *list = NULL;
+	struct stat st;
+	uint8_t payload[6];
+	unsigned int i = 0;
+	uint32_t id = 0;
+	int fds[2];
+
+	/* the least loaded connection that is up */
+	for (list=self->conn_list; list; list=hev_slist_next (list)) {
+		HevSocks5TunnelConn *c = hev_slist_data (list);
+		if (!c->up || c->broken)
+		  continue;
+		if (!conn || (c->stream_count < conn->stream_count))
+		  conn = c;
+	}
+	if (!conn || (MAX_STREAMS <= conn->stream_count))
+	  return -1;
+	for (i=0; i<MAX_STREAMS; i++) {
+		id = conn->next_id ++;
+		if (!conn->streams[id & (MAX_STREAMS - 1)])
+		  break;
+	}
+
+	/* the session relays into one end like into any remote socket */
+	if (0 > socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds))
+	  return -1;
+	if (0 > fstat (fds[0], &st))
+	  st.st_ino = 0;
+	stream = stream_new (conn, id, fds[1]);
+	if (!stream) {
+		close (fds[0]);
+		close (fds[1]);
+		return -1;
+	}
+	stream->peer_ino = st.st_ino;
+	memcpy (payload, &dest->sin_addr, 4);
+	memcpy (payload + 4, &dest->sin_port, 2);
+	conn_send (conn, FRAME_OPEN, id, payload, sizeof (payload));
+	self->opened ++;
+
+	return fds[0];
+}
+
+bool
+hev_socks5_tunnel_take_reset (HevSocks5Tunnel *self, int fd)
+{
+	struct stat st;
+	unsigned int i = 0;
+
+	if (0 > fstat (fd, &st))
+	  return false;
+	for (i=0; i<MAX_RESETS; i++) {
+		if (st.st_ino == self->reset_inos[i]) {
+			self->reset_inos[i] = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+listener_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevSocks5Tunnel *self = data;
+	uint64_t mon = hev_socks5_loopmon_enter ();
+	int conn_fd = accept (fd->fd, NULL, NULL);
+
+	if (0 > conn_fd) {
+		if (EAGAIN == errno)
+		  fd->revents &= ~EPOLLIN;
+	} else if (MAX_SERVER_CONNS <= self->conn_count) {
+		close (conn_fd);
+	} else {
+		conn_new (self, conn_fd, false);
+	}
+	hev_socks5_loopmon_leave (HEV_SOCKS5_LOOPMON_TUNNEL, mon);
+
+	return true;
+}
+
+static bool
+timer_source_handler (void *data)
+{
+	HevSocks5Tunnel *self = data;
+
+	while (self->conn_count < self->conns) {
+		int fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+		if (0 > fd)
+		  break;
+		if ((0 > connect (fd, (struct sockaddr *) &self->addr, sizeof (self->addr))) &&
+					(EINPROGRESS != errno)) {
+			close (fd);
+			break;
+		}
+		if (!conn_new (self, fd, false))
+		  break;
+		self->reconnects ++;
+	}
+
+	return true;
+}
+
+void
+hev_socks5_tunnel_dump (HevSocks5Tunnel *self, int fd)
+{
+	unsigned int up = 0, streams = 0;
+	HevSList *list = NULL;
+
+	for (list=self->conn_list; list; list=hev_slist_next (list)) {
+		HevSocks5TunnelConn *conn = hev_slist_data (list);
+		if (conn->up)
+		  up ++;
+		streams += conn->stream_count;
+	}
+	dprintf (fd, "tunnel %s %s: conns %u/%u streams %u opened %llu failed %llu "
+				"resets %llu reconnects %llu bytes-out %llu bytes-in %llu\n",
+				self->server ? "server" : "parent", self->name, up,
+				self->server ? self->conn_count : self->conns, streams,
+				(unsigned long long) self->opened, (unsigned long long) self->failed,
+				(unsigned long long) self->resets,
+				(unsigned long long) self->reconnects,
+				(unsigned long long) self->bytes_out,
+				(unsigned long long) self->bytes_in);
+}
+
@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tunnel.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Socks5 multiplexed tunnel to a parent proxy
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_TUNNEL_H__
+#define __HEV_SOCKS5_TUNNEL_H__
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <hev-lib.h>
+
+typedef struct _HevSocks5Tunnel HevSocks5Tunnel;
+
+/* keeps conns connections to the parent at addr:port open */
+HevSocks5Tunnel * hev_socks5_tunnel_new (HevEventLoop *loop, const char *addr,
+			unsigned int port, unsigned int conns, const char *secret);
+/* the parent end, connects the streams children open through it */
+HevSocks5Tunnel * hev_socks5_tunnel_new_server (HevEventLoop *loop, const char *addr,
+			unsigned int port, const char *secret);
+
+HevSocks5Tunnel * hev_socks5_tunnel_ref (HevSocks5Tunnel *self);
+void hev_socks5_tunnel_unref (HevSocks5Tunnel *self);
+
+/* ADDR/PREFIX, with no routes every destination goes to the parent */
+bool hev_socks5_tunnel_add_route (HevSocks5Tunnel *self, const char *route);
+bool hev_socks5_tunnel_route (HevSocks5Tunnel *self, const struct sockaddr_in *dest);
+
+/* a connected socket for a new stream to dest, the open travels with the
+ * first data so no round trip is spent; -1 while no connection is up */
+int hev_socks5_tunnel_open (HevSocks5Tunnel *self, const struct sockaddr_in *dest);
+/* at EOF on an opened socket, true once if the stream was reset rather
+ * than finished */
+bool hev_socks5_tunnel_take_reset (HevSocks5Tunnel *self, int fd);
+
+void hev_socks5_tunnel_dump (HevSocks5Tunnel *self, int fd);
+
+#endif /* __HEV_SOCKS5_TUNNEL_H__ */
+
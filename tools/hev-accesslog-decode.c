@@ -0,0 +1,159 @@
+/*
+ ============================================================================
+ Name        : hev-accesslog-decode.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2013 everyone.
+ Description : Decode binary access logs to text
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "hev-socks5-accesslog.h"
+
+static const char *reason_names[] =
+{
+	"client",
+	"remote",
+	"error",
+	"handshake",
+	"idle",
+	"shutdown",
+	"auth-timeout",
+	"request-timeout",
+	"dns-timeout",
+	"connect-timeout",
+	"stall",
+	"handoff",
+	"killed",
+};
+
+typedef struct _Reader Reader;
+
+struct _Reader
+{
+	int fd;
+#ifdef ENABLE_ZLIB
+	gzFile gz;
+#endif
+};
+
+static ssize_t
+reader_read (Reader *reader, void *data, size_t size)
+{
+#ifdef ENABLE_ZLIB
+	/* reads plain files as well as gzip ones */
+	return gzread (reader->gz, data, size);
+#else
+	size_t len = 0;
+
+	while (len < size) {
+		ssize_t res = read (reader->fd, (uint8_t *) data + len, size - len);
+		if (0 > res)
+		  return -1;
+		if (0 == res)
+		  break;
+		len += res;
+	}
+
+	return len;
+#endif
+}
+
+static void
+print_record (const HevSocks5AccessLogRecord *record)
+{
+	char client[INET_ADDRSTRLEN], remote[INET_ADDRSTRLEN], stamp[32];
+	const char *reason = "unknown";
+	time_t sec = record->time / 1000000000ULL;
+	struct tm tm;
+
+	inet_ntop (AF_INET, &record->client_addr, client, sizeof (client));
+	inet_ntop (AF_INET, &record->remote_addr, remote, sizeof (remote));
+	gmtime_r (&sec, &tm);
+	strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	if (record->reason < (sizeof (reason_names) / sizeof (reason_names[0])))
+	  reason = reason_names[record->reason];
+
+	printf ("%s.%03uZ %s:%u -> %s:%u fwd %llu bwd %llu handshake %lluus "
+				"duration %lluus reason %s\n", stamp,
+				(unsigned int) ((record->time / 1000000) % 1000),
+				client, ntohs (record->client_port),
+				remote, ntohs (record->remote_port),
+				(unsigned long long) record->forward_bytes,
+				(unsigned long long) record->backward_bytes,
+				(unsigned long long) (record->handshake / 1000),
+				(unsigned long long) (record->duration / 1000), reason);
+}
+
+static int
+decode (int fd, const char *name)
+{
+	HevSocks5AccessLogHeader header;
+	HevSocks5AccessLogRecord record;
+	Reader reader;
+	ssize_t res = 0;
+
+	reader.fd = fd;
+#ifdef ENABLE_ZLIB
+	reader.gz = gzdopen (fd, "rb");
+	if (!reader.gz)
+	  return -1;
+#endif
+
+	res = reader_read (&reader, &header, sizeof (header));
+	if ((sizeof (header) != res) || (HEV_SOCKS5_ACCESSLOG_MAGIC != header.magic) ||
+				(HEV_SOCKS5_ACCESSLOG_VERSION != header.version) ||
+				(sizeof (record) != header.record_size)) {
+		fprintf (stderr, "%s: not an access log!\n", name);
+		res = -1;
+		goto out;
+	}
+
+	while (sizeof (record) == (res = reader_read (&reader, &record, sizeof (record))))
+	  print_record (&record);
+	if (0 != res) {
+		fprintf (stderr, "%s: truncated record!\n", name);
+		res = -1;
+	}
+
+out:
+#ifdef ENABLE_ZLIB
+	gzclose (reader.gz);
+#else
+	close (fd);
+#endif
+
+	return res;
+}
+
+int
+main (int argc, char *argv[])
+{
+	int i = 0, ret = 0;
+
+	if (1 == argc)
+	  return (0 > decode (STDIN_FILENO, "stdin")) ? 1 : 0;
+
+	for (i=1; i<argc; i++) {
+		int fd = open (argv[i], O_RDONLY);
+		if (0 > fd) {
+			fprintf (stderr, "Open %s failed!\n", argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (0 > decode (fd, argv[i]))
+		  ret = 1;
+	}
+
+	return ret;
+}
+